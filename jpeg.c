@@ -4,12 +4,46 @@
 #include <jpeglib.h>
 
 #include <math.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#if defined(_WIN32)
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if LUA_VERSION_NUM < 503
 #include "lua-compat/compat.h"
 #endif
 
+/*
+The SIMD instruction set is selected at compile time, define LUA_JPEG_NO_SIMD to use the portable code only.
+SIMD_LANES is the number of 16-bit lanes in a vector.
+*/
+#if !defined(LUA_JPEG_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_AVX2 1
+#define SIMD_LANES 16
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define SIMD_SSE2 1
+#define SIMD_LANES 8
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON 1
+#define SIMD_LANES 8
+#endif
+#endif
+
 /*
 The libjpeg supports 8-bit to 12-bit data precision, but this is a compile-time choice, here 8-bit only.
 
@@ -69,6 +103,437 @@ static void unregisterLuaReference(LuaReference *r) {
 	}
 }
 
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
+// Returns the FILE of a Lua file handle or NULL if the file is closed
+static FILE *getStreamFile(void *stream) {
+#if LUA_VERSION_NUM >= 502
+	luaL_Stream *p = (luaL_Stream *) stream;
+	return (p->closef == NULL) ? NULL : p->f;
+#else
+	return *((FILE **) stream);
+#endif
+}
+
+
+/*
+********************************************************************************
+* Memory mapped file functions
+********************************************************************************
+*/
+
+// Maps the whole file in memory for reading, returns NULL on failure
+static void *mapFile(const char *path, size_t *size) {
+	void *data = NULL;
+#if defined(_WIN32)
+	HANDLE hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		return NULL;
+	}
+	LARGE_INTEGER fileSize;
+	if (GetFileSizeEx(hFile, &fileSize) && (fileSize.QuadPart > 0) && ((ULONGLONG) fileSize.QuadPart <= (size_t) -1)) {
+		HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (hMapping != NULL) {
+			data = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+			// the view keeps a reference on the mapping
+			CloseHandle(hMapping);
+			*size = (size_t) fileSize.QuadPart;
+		}
+	}
+	CloseHandle(hFile);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+		data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			data = NULL;
+		} else {
+			*size = (size_t) st.st_size;
+#ifdef MADV_SEQUENTIAL
+			// the decoder reads the data once from start to end
+			madvise(data, *size, MADV_SEQUENTIAL);
+#endif
+		}
+	}
+	// the mapping keeps a reference on the file
+	close(fd);
+#endif
+	return data;
+}
+
+static void unmapFile(void *data, size_t size) {
+#if defined(_WIN32)
+	UnmapViewOfFile(data);
+#else
+	munmap(data, size);
+#endif
+}
+
+
+/*
+********************************************************************************
+* Worker pool functions
+********************************************************************************
+*/
+
+/*
+* The module has a single pool of native worker threads shared by all the Lua states.
+* The workers never call Lua, they run tasks from a queue.
+* The caller of a parallel operation also runs its part of the work then waits for the workers.
+*/
+
+#define MAX_POOL_THREADS 256
+
+#if defined(_WIN32)
+typedef SRWLOCK PoolMutex;
+typedef CONDITION_VARIABLE PoolCondition;
+typedef HANDLE PoolThread;
+#define POOL_MUTEX_INITIALIZER SRWLOCK_INIT
+#define POOL_CONDITION_INITIALIZER CONDITION_VARIABLE_INIT
+#define poolMutexLock(_m) AcquireSRWLockExclusive(_m)
+#define poolMutexUnlock(_m) ReleaseSRWLockExclusive(_m)
+#define poolConditionWait(_c, _m) SleepConditionVariableSRW(_c, _m, INFINITE, 0)
+#define poolConditionSignal(_c) WakeConditionVariable(_c)
+#define poolConditionBroadcast(_c) WakeAllConditionVariable(_c)
+#else
+typedef pthread_mutex_t PoolMutex;
+typedef pthread_cond_t PoolCondition;
+typedef pthread_t PoolThread;
+#define POOL_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define POOL_CONDITION_INITIALIZER PTHREAD_COND_INITIALIZER
+#define poolMutexLock(_m) pthread_mutex_lock(_m)
+#define poolMutexUnlock(_m) pthread_mutex_unlock(_m)
+#define poolConditionWait(_c, _m) pthread_cond_wait(_c, _m)
+#define poolConditionSignal(_c) pthread_cond_signal(_c)
+#define poolConditionBroadcast(_c) pthread_cond_broadcast(_c)
+#endif
+
+typedef struct PoolTaskStruct {
+	void (*run)(struct PoolTaskStruct *task);
+	struct PoolTaskStruct *next;
+} PoolTask;
+
+typedef struct WorkerPoolStruct {
+	PoolMutex mutex;
+	PoolCondition workAvailable;
+	PoolCondition taskDone;
+	PoolTask *head;
+	PoolTask *tail;
+	int stopping;
+	int workerCount;
+	PoolThread workers[MAX_POOL_THREADS];
+} WorkerPool;
+
+static WorkerPool pool = {
+	POOL_MUTEX_INITIALIZER, POOL_CONDITION_INITIALIZER, POOL_CONDITION_INITIALIZER, NULL, NULL, 0, 0, { 0 }
+};
+
+// Serializes the workers start and stop
+static PoolMutex poolControlMutex = POOL_MUTEX_INITIALIZER;
+
+// The number of Lua states that loaded the module, protected by the control mutex
+static int poolStateCount = 0;
+
+// Must be called with the pool mutex locked
+static void poolEnqueue(PoolTask *task) {
+	task->next = NULL;
+	if (pool.tail == NULL) {
+		pool.head = task;
+	} else {
+		pool.tail->next = task;
+	}
+	pool.tail = task;
+	poolConditionSignal(&pool.workAvailable);
+}
+
+// Removes the task if it is still queued, must be called with the pool mutex locked
+static int poolRemove(PoolTask *task) {
+	PoolTask *previous = NULL;
+	PoolTask *t;
+	for (t = pool.head; t != NULL; previous = t, t = t->next) {
+		if (t == task) {
+			if (previous == NULL) {
+				pool.head = t->next;
+			} else {
+				previous->next = t->next;
+			}
+			if (pool.tail == t) {
+				pool.tail = previous;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#if defined(_WIN32)
+static unsigned __stdcall poolWorker(void *arg) {
+#else
+static void *poolWorker(void *arg) {
+#endif
+	PoolTask *task;
+	(void) arg;
+	poolMutexLock(&pool.mutex);
+	for (;;) {
+		while (!pool.stopping && (pool.head == NULL)) {
+			poolConditionWait(&pool.workAvailable, &pool.mutex);
+		}
+		// the remaining tasks are run by the next workers or by their caller
+		if (pool.stopping) {
+			break;
+		}
+		task = pool.head;
+		pool.head = task->next;
+		if (pool.head == NULL) {
+			pool.tail = NULL;
+		}
+		poolMutexUnlock(&pool.mutex);
+		task->run(task);
+		poolMutexLock(&pool.mutex);
+	}
+	poolMutexUnlock(&pool.mutex);
+	return 0;
+}
+
+static void poolStopWorkers(void) {
+	int i;
+	poolMutexLock(&pool.mutex);
+	pool.stopping = 1;
+	poolConditionBroadcast(&pool.workAvailable);
+	poolMutexUnlock(&pool.mutex);
+	for (i = 0; i < pool.workerCount; i++) {
+#if defined(_WIN32)
+		WaitForSingleObject(pool.workers[i], INFINITE);
+		CloseHandle(pool.workers[i]);
+#else
+		pthread_join(pool.workers[i], NULL);
+#endif
+	}
+	poolMutexLock(&pool.mutex);
+	pool.workerCount = 0;
+	pool.stopping = 0;
+	poolMutexUnlock(&pool.mutex);
+}
+
+static int getProcessorCount(void) {
+#if defined(_WIN32)
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return (int) si.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int) count : 1;
+#else
+	return 1;
+#endif
+}
+
+static int poolGetThreadCount(void) {
+	int workerCount;
+	poolMutexLock(&pool.mutex);
+	workerCount = pool.workerCount;
+	poolMutexUnlock(&pool.mutex);
+	return workerCount + 1;
+}
+
+/*
+* Sets the number of threads used by the parallel operations, including the calling thread.
+* Zero or less uses the number of processors.
+* Returns the actual number of threads.
+*/
+static int poolSetThreadCount(int threadCount) {
+	int workerCount, i;
+	if (threadCount <= 0) {
+		threadCount = getProcessorCount();
+	}
+	if (threadCount > MAX_POOL_THREADS) {
+		threadCount = MAX_POOL_THREADS;
+	}
+	poolMutexLock(&poolControlMutex);
+	if (threadCount == poolGetThreadCount()) {
+		// the running workers are kept
+		poolMutexUnlock(&poolControlMutex);
+		return threadCount;
+	}
+	poolStopWorkers();
+	for (workerCount = 0; workerCount < threadCount - 1; workerCount++) {
+#if defined(_WIN32)
+		pool.workers[workerCount] = (HANDLE) _beginthreadex(NULL, 0, poolWorker, NULL, 0, NULL);
+		if (pool.workers[workerCount] == 0) {
+			break;
+		}
+#else
+		if (pthread_create(&pool.workers[workerCount], NULL, poolWorker, NULL) != 0) {
+			break;
+		}
+#endif
+	}
+	poolMutexLock(&pool.mutex);
+	pool.workerCount = workerCount;
+	// tasks queued without worker
+	if (pool.head != NULL) {
+		for (i = 0; i < workerCount; i++) {
+			poolConditionSignal(&pool.workAvailable);
+		}
+	}
+	// the tasks left in the queue by the stopped workers are run by the caller when there is no more worker
+	while ((workerCount == 0) && (pool.head != NULL)) {
+		PoolTask *task = pool.head;
+		pool.head = task->next;
+		if (pool.head == NULL) {
+			pool.tail = NULL;
+		}
+		poolMutexUnlock(&pool.mutex);
+		task->run(task);
+		poolMutexLock(&pool.mutex);
+	}
+	poolMutexUnlock(&pool.mutex);
+	poolMutexUnlock(&poolControlMutex);
+	return workerCount + 1;
+}
+
+/*
+* Parallel bands, the band function is called once for each band, in any order and from any thread.
+*/
+
+typedef void (*BandFunction)(void *context, int band, int bandCount);
+
+typedef struct BandGroupStruct BandGroup;
+
+typedef struct BandHelperStruct {
+	PoolTask task; // first member, the task is the helper
+	BandGroup *group;
+} BandHelper;
+
+struct BandGroupStruct {
+	BandFunction fn;
+	void *context;
+	int bandCount;
+	int nextBand;
+	int finishedHelpers;
+	BandHelper helpers[MAX_POOL_THREADS];
+};
+
+static void runGroupBands(BandGroup *group) {
+	int band;
+	for (;;) {
+		poolMutexLock(&pool.mutex);
+		band = group->nextBand < group->bandCount ? group->nextBand++ : -1;
+		poolMutexUnlock(&pool.mutex);
+		if (band < 0) {
+			break;
+		}
+		group->fn(group->context, band, group->bandCount);
+	}
+}
+
+static void runBandHelper(PoolTask *task) {
+	BandGroup *group = ((BandHelper *) task)->group;
+	runGroupBands(group);
+	poolMutexLock(&pool.mutex);
+	group->finishedHelpers++;
+	poolConditionBroadcast(&pool.taskDone);
+	poolMutexUnlock(&pool.mutex);
+}
+
+/*
+* Runs the bands using the pool workers and the calling thread, returns when all the bands are done.
+* The helpers that are not started when the caller runs out of bands are removed from the queue.
+*/
+static void runBands(BandFunction fn, void *context, int bandCount) {
+	BandGroup *group;
+	int helperCount, removedCount, i;
+	if (bandCount <= 0) {
+		return;
+	}
+	helperCount = poolGetThreadCount() - 1;
+	if (helperCount > bandCount - 1) {
+		helperCount = bandCount - 1;
+	}
+	group = helperCount > 0 ? (BandGroup *)malloc(sizeof(BandGroup)) : NULL;
+	if (group == NULL) {
+		for (i = 0; i < bandCount; i++) {
+			fn(context, i, bandCount);
+		}
+		return;
+	}
+	group->fn = fn;
+	group->context = context;
+	group->bandCount = bandCount;
+	group->nextBand = 0;
+	group->finishedHelpers = 0;
+	poolMutexLock(&pool.mutex);
+	for (i = 0; i < helperCount; i++) {
+		group->helpers[i].task.run = runBandHelper;
+		group->helpers[i].group = group;
+		poolEnqueue(&group->helpers[i].task);
+	}
+	poolMutexUnlock(&pool.mutex);
+	runGroupBands(group);
+	poolMutexLock(&pool.mutex);
+	removedCount = 0;
+	for (i = 0; i < helperCount; i++) {
+		removedCount += poolRemove(&group->helpers[i].task);
+	}
+	while (group->finishedHelpers < helperCount - removedCount) {
+		poolConditionWait(&pool.taskDone, &pool.mutex);
+	}
+	poolMutexUnlock(&pool.mutex);
+	free(group);
+}
+
+/*
+* Returns the number of bands to split the rows into, each band having at least the minimum number of rows.
+*/
+static int getBandCount(int rows, int minRows) {
+	int bandCount = poolGetThreadCount();
+	if ((minRows > 0) && (bandCount > rows / minRows)) {
+		bandCount = rows / minRows;
+	}
+	return bandCount < 1 ? 1 : bandCount;
+}
+
+static void getBandRows(int rows, int band, int bandCount, int *start, int *end) {
+	*start = (int) ((long long) rows * band / bandCount);
+	*end = (int) ((long long) rows * (band + 1) / bandCount);
+}
+
+static int luajpeg_set_thread_count(lua_State *l) {
+	int threadCount = (int) luaL_optinteger(l, 1, 0);
+	lua_pushinteger(l, poolSetThreadCount(threadCount));
+	return 1;
+}
+
+static int luajpeg_get_thread_count(lua_State *l) {
+	lua_pushinteger(l, poolGetThreadCount());
+	return 1;
+}
+
+static void poolAddState(void) {
+	poolMutexLock(&poolControlMutex);
+	poolStateCount++;
+	poolMutexUnlock(&poolControlMutex);
+}
+
+// The workers are stopped when the last Lua state that loaded the module is closed
+static int luajpeg_pool_gc(lua_State *l) {
+	(void) l;
+	trace("luajpeg_pool_gc()\n");
+	poolMutexLock(&poolControlMutex);
+	if (--poolStateCount <= 0) {
+		poolStateCount = 0;
+		poolStopWorkers();
+	}
+	poolMutexUnlock(&poolControlMutex);
+	return 0;
+}
+
 
 /*
 ********************************************************************************
@@ -76,20 +541,65 @@ static void unregisterLuaReference(LuaReference *r) {
 ********************************************************************************
 */
 
+#define DESTINATION_NONE 0
+#define DESTINATION_FUNCTION 1
+#define DESTINATION_MEMORY 2
+#define DESTINATION_FILE 3
+
+#define SOURCE_LUA 0
+#define SOURCE_FILE 1
+#define SOURCE_MAPPING 2
+
+#define DEFAULT_FILE_BUFFER_SIZE 65536
+
 typedef struct JpegCompressStruct {
+	int destType;
 	LuaReference destFn;
 	LuaReference buffer;
+	JOCTET *destData; // native destination buffer for the memory and file destinations
+	size_t destSize;
+	size_t destLength;
+	const char *destError; // the error message when the destination failed
+	JOCTET destDiscard[256]; // used to discard the output when the destination failed
+	FILE *destFile; // native file destination
+	void *destStream; // the Lua file handle of the native file destination, if any
+	LuaReference destStreamRef;
 	unsigned long bytesPerRow;
+	int rowsPerCall; // number of scanlines to write per libjpeg call, 0 for a whole iMCU row
+	JSAMPARRAY rawScratch[MAX_COMPONENTS]; // the padded rows for the raw data planes
 	struct jpeg_error_mgr errormgr;
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_destination_mgr destmgr;
 } JpegCompress;
 
 typedef struct JpegDecompressStruct {
+	int srcType;
 	LuaReference srcFn;
 	LuaReference buffer;
+	FILE *srcFile; // native file source
+	void *srcStream; // the Lua file handle of the native file source, if any
+	LuaReference srcStreamRef;
+	JOCTET *srcData; // native source buffer
+	size_t srcSize;
+	void *srcMapping; // memory mapped file source
+	size_t srcMappingSize;
+	size_t skipBytes; // bytes to skip from the next pushed data
+	int endOfInput;
+	const JOCTET *srcCommitted; // the position libjpeg backs up to on suspension
+	const JOCTET *srcReturned; // the start of the data returned by the source function
 	int runStep;
 	unsigned long bytesPerRow;
+	int rowsPerCall; // number of scanlines to read per libjpeg call, 0 for a whole iMCU row
+	JSAMPROW rawScratch; // the row receiving the raw data outside of the planes
+	jvirt_barray_ptr *transformArrays; // the destination coefficients of a pending transformation
+	int region; // whether only a region of the output image is returned
+	JDIMENSION regionX;
+	JDIMENSION regionY;
+	JDIMENSION regionWidth;
+	JDIMENSION regionHeight;
+	JSAMPARRAY regionScratch; // the full rows decoded outside of the image buffer
+	JDIMENSION regionScratchRows;
+	int outputStarted; // whether an output pass is started in buffered image mode
 	struct jpeg_error_mgr errormgr;
 	struct jpeg_decompress_struct cinfo;
 	struct jpeg_source_mgr srcmgr;
@@ -101,9 +611,42 @@ typedef struct JpegDecompressStruct {
 #define JPEG_DECOMPRESS_PTR(_cp) \
 	((JpegDecompress *) ((char *) (_cp) - offsetof(JpegDecompress, cinfo)))
 
+/*
+* The number of scanlines processed in one call to libjpeg is bounded to keep the row pointers on the stack.
+* A whole iMCU row is at most 4 * 16 scanlines for a supported sampling factor and scaling.
+*/
+#define MAX_ROWS_PER_CALL 64
+
+#if JPEG_LIB_VERSION >= 70
+#define DECOMPRESS_IMCU_ROWS(_cinfo) ((_cinfo)->max_v_samp_factor * (_cinfo)->min_DCT_v_scaled_size)
+#define COMPRESS_IMCU_ROWS(_cinfo) ((_cinfo)->max_v_samp_factor * (_cinfo)->min_DCT_v_scaled_size)
+#define COMPONENT_DCT_H_SCALED_SIZE(_compptr) ((_compptr)->DCT_h_scaled_size)
+#define COMPONENT_DCT_V_SCALED_SIZE(_compptr) ((_compptr)->DCT_v_scaled_size)
+#else
+#define DECOMPRESS_IMCU_ROWS(_cinfo) ((_cinfo)->max_v_samp_factor * (_cinfo)->min_DCT_scaled_size)
+#define COMPRESS_IMCU_ROWS(_cinfo) ((_cinfo)->max_v_samp_factor * DCTSIZE)
+#define COMPONENT_DCT_H_SCALED_SIZE(_compptr) ((_compptr)->DCT_scaled_size)
+#define COMPONENT_DCT_V_SCALED_SIZE(_compptr) ((_compptr)->DCT_scaled_size)
+#endif
+
+/*
+* In raw data mode, the planes are processed by whole blocks,
+* the minimal plane stride is the component width rounded up to a multiple of the block size.
+*/
+#define COMPONENT_RAW_STRIDE(_compptr) ((_compptr)->width_in_blocks * COMPONENT_DCT_H_SCALED_SIZE(_compptr))
+#define COMPONENT_RAW_ROWS(_compptr) ((_compptr)->v_samp_factor * COMPONENT_DCT_V_SCALED_SIZE(_compptr))
+
 static const char *JCS_OPTIONS[] = { "UNKNOWN", "RGB", "sRGB", "YUV", "YCbCr", "GRAYSCALE", NULL };
 static const int JCS_VALUES[] = { JCS_UNKNOWN, JCS_RGB, JCS_RGB, JCS_YCbCr, JCS_YCbCr, JCS_GRAYSCALE };
 
+// The luma sampling factors, horizontal in the high nibble and vertical in the low nibble
+static const char *SUBSAMPLING_OPTIONS[] = { "4:4:4", "4:2:2", "4:2:0", "4:4:0", "4:1:1", NULL };
+static const int SUBSAMPLING_VALUES[] = { 0x11, 0x21, 0x22, 0x12, 0x41 };
+
+// The transpose maps the rows to the columns, the transverse is the transposition across the other diagonal
+static const char *ROTATE_OPTIONS[] = { "none", "right", "180", "left", "flip-horizontal", "flip-vertical", "transpose", "transverse", NULL };
+static const int ROTATE_VALUES[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
 
 /*
 ********************************************************************************
@@ -139,7 +682,7 @@ typedef struct PixmapInfoStruct {
 ********************************************************************************
 */
 
-/*static int getBooleanField(lua_State *l, int i, const char *k, int def) {
+static int getBooleanField(lua_State *l, int i, const char *k, int def) {
 	int v;
 	lua_getfield(l, i, k);
 	if (lua_isboolean(l, -1)) {
@@ -149,7 +692,7 @@ typedef struct PixmapInfoStruct {
 	}
 	lua_pop(l, 1);
 	return v;
-}*/
+}
 
 /*static int getLength(lua_State *l, int i) {
 	int v;
@@ -187,6 +730,18 @@ static long getLongField(lua_State *l, int i, const char *k, long def) {
 	return v;
 }
 
+static double getNumberField(lua_State *l, int i, const char *k, double def) {
+	double v;
+	lua_getfield(l, i, k);
+	if (lua_isnumber(l, -1)) {
+		v = (double) lua_tonumber(l, -1);
+	} else {
+		v = def;
+	}
+	lua_pop(l, 1);
+	return v;
+}
+
 static int checkOptionField(lua_State *l, int i, const char *k, const char *def, const char *const *options, const int *values) {
 	int value;
 	lua_getfield(l, i, k);
@@ -275,16 +830,82 @@ static void luajpeg_flush_buffer(JpegCompress *jc, size_t freeInBuffer, int upda
 	}
 }
 
-static void luajpeg_set_source_buffer(JpegDecompress *jd, lua_State *l) {
-	const char *bufferData = NULL;
-	size_t bufferSize = 0;
-	trace("luajpeg_set_source_buffer()\n");
-	if (lua_isstring(l, -1)) {
-		bufferData = lua_tolstring(l, -1, &bufferSize);
+/*
+* Appends the data to the input that libjpeg has not consumed yet, the pending bytes to skip are discarded first.
+* When there is no remaining input and in place is allowed, the data is used without copy and 2 is returned,
+* the caller shall then keep the data alive, otherwise the data is copied in the native buffer.
+* Returns 0 if the native buffer cannot be allocated.
+*/
+static int luajpeg_append_source_data(JpegDecompress *jd, const JOCTET *data, size_t length, int inPlace) {
+	size_t remaining = jd->srcmgr.bytes_in_buffer;
+	size_t size;
+	trace("luajpeg_append_source_data() %d + %d, skip %d\n", remaining, length, jd->skipBytes);
+	size = (jd->skipBytes < length) ? jd->skipBytes : length;
+	jd->skipBytes -= size;
+	data += size;
+	length -= size;
+	jd->srcReturned = NULL;
+	if (length == 0) {
+		return 1;
+	}
+	if ((remaining == 0) && inPlace) {
+		jd->srcmgr.next_input_byte = data;
+		jd->srcmgr.bytes_in_buffer = length;
+		return 2;
+	}
+	size = remaining + length;
+	if (size > jd->srcSize) {
+		size_t newSize = jd->srcSize * 2;
+		if (newSize < size) {
+			newSize = size;
+		}
+		JOCTET *newData = (JOCTET *) malloc(newSize);
+		if (newData == NULL) {
+			return 0;
+		}
+		if (remaining > 0) {
+			memcpy(newData, jd->srcmgr.next_input_byte, remaining);
+		}
+		if (jd->srcData != NULL) {
+			free(jd->srcData);
+		}
+		jd->srcData = newData;
+		jd->srcSize = newSize;
+	} else {
+		// the remaining bytes may be in the native buffer or in the referenced string
+		memmove(jd->srcData, jd->srcmgr.next_input_byte, remaining);
+	}
+	memcpy(jd->srcData + remaining, data, length);
+	jd->srcmgr.next_input_byte = jd->srcData;
+	jd->srcmgr.bytes_in_buffer = size;
+	return 1;
+}
+
+/*
+* Appends the string at the specified index to the remaining input.
+* The string is referenced when used in place.
+*/
+static int luajpeg_push_source_data(JpegDecompress *jd, lua_State *l, int i) {
+	size_t length = 0;
+	const JOCTET *data = (const JOCTET *)lua_tolstring(l, i, &length);
+	int status = luajpeg_append_source_data(jd, data, length, TRUE);
+	if (status == 2) {
+		lua_pushvalue(l, i);
 		registerLuaReference(&jd->buffer, l);
+	} else if ((status == 1) && (jd->srcmgr.next_input_byte == jd->srcData)) {
+		unregisterLuaReference(&jd->buffer);
 	}
-	jd->cinfo.src->next_input_byte = (const JOCTET *)bufferData;
-	jd->cinfo.src->bytes_in_buffer = bufferSize;
+	return status;
+}
+
+// Discards the remaining input, the native buffer is kept for the next image
+static void luajpeg_reset_source_data(JpegDecompress *jd) {
+	unregisterLuaReference(&jd->buffer);
+	jd->srcmgr.next_input_byte = NULL;
+	jd->srcmgr.bytes_in_buffer = 0;
+	jd->skipBytes = 0;
+	jd->endOfInput = FALSE;
+	jd->srcReturned = NULL;
 }
 
 
@@ -328,80 +949,468 @@ luajpeg_term_destination (j_compress_ptr cinfo)
 }
 
 
-METHODDEF(void)
-luajpeg_source_no_operation (j_decompress_ptr cinfo)
+/*
+* Returns the estimated size of the compressed image from its sample count and its luminance quantization,
+* so the memory destination is allocated once for most images.
+* The estimate is above the usual photographic sizes, the pages of the unused part are usually not touched.
+*/
+static size_t luajpeg_estimate_compressed_size(j_compress_ptr cinfo)
 {
-	trace("luajpeg_source_no_operation()\n");
+	int ci, i, maxH = 1, maxV = 1;
+	double samples = 0.0, quantSum = 0.0;
+	for (ci = 0; ci < cinfo->num_components; ci++) {
+		if (cinfo->comp_info[ci].h_samp_factor > maxH) {
+			maxH = cinfo->comp_info[ci].h_samp_factor;
+		}
+		if (cinfo->comp_info[ci].v_samp_factor > maxV) {
+			maxV = cinfo->comp_info[ci].v_samp_factor;
+		}
+	}
+	for (ci = 0; ci < cinfo->num_components; ci++) {
+		samples += (double) cinfo->image_width * cinfo->comp_info[ci].h_samp_factor / maxH
+			* cinfo->image_height * cinfo->comp_info[ci].v_samp_factor / maxV;
+	}
+	JQUANT_TBL *qtbl = cinfo->quant_tbl_ptrs[0];
+	double averageQuant = 1.0;
+	if (qtbl != NULL) {
+		for (i = 0; i < DCTSIZE2; i++) {
+			quantSum += qtbl->quantval[i];
+		}
+		averageQuant = quantSum / DCTSIZE2;
+	}
+	// about 0.9 byte per sample at quality 100, 0.2 at quality 75 and 0.1 at quality 50
+	return (size_t) (samples / (1.0 + averageQuant / 8.0)) + 4096;
 }
 
+METHODDEF(void)
+luajpeg_init_memory_destination (j_compress_ptr cinfo)
+{
+	trace("luajpeg_init_memory_destination()\n");
+	JpegCompress *jc = JPEG_COMPRESS_PTR(cinfo);
+	jc->destLength = 0;
+	jc->destError = NULL;
+	if ((jc->destData == NULL) && (jc->destSize == 0)) {
+		jc->destSize = luajpeg_estimate_compressed_size(cinfo);
+		trace("luajpeg_init_memory_destination() estimated size %d\n", jc->destSize);
+	}
+	if (jc->destData == NULL) {
+		jc->destData = (JOCTET *) malloc(jc->destSize);
+	}
+	if (jc->destData == NULL) {
+		jc->destError = "not enough memory";
+		cinfo->dest->next_output_byte = jc->destDiscard;
+		cinfo->dest->free_in_buffer = sizeof(jc->destDiscard);
+		return;
+	}
+	cinfo->dest->next_output_byte = jc->destData;
+	cinfo->dest->free_in_buffer = jc->destSize;
+}
 
 METHODDEF(boolean)
-luajpeg_fill_input_buffer (j_decompress_ptr cinfo)
+luajpeg_empty_memory_output_buffer (j_compress_ptr cinfo)
 {
-	trace("luajpeg_fill_input_buffer()\n");
-	JpegDecompress *jd = JPEG_DECOMPRESS_PTR(cinfo);
-	if ((jd->srcFn.state == NULL) || (jd->srcFn.ref == LUA_NOREF)) {
-		return FALSE; // to indicate I/O suspension
+	JpegCompress *jc = JPEG_COMPRESS_PTR(cinfo);
+	// the buffer is full, grow it geometrically to keep the amortized copy cost linear
+	size_t size = jc->destSize * 2;
+	trace("luajpeg_empty_memory_output_buffer() %d => %d\n", jc->destSize, size);
+	JOCTET *data = NULL;
+	if (jc->destError == NULL) {
+		data = (JOCTET *) realloc(jc->destData, size);
 	}
-	lua_State *l = jd->srcFn.state;
-	lua_rawgeti(l, LUA_REGISTRYINDEX, jd->srcFn.ref);
-	if (lua_pcall(l, 0, 1, 0) != 0) {
-		trace("fillBuffer() => Failed\n"); // TODO
-	} else {
-		luajpeg_set_source_buffer(jd, l);
+	if (data == NULL) {
+		// discard the output, the error is reported when the compression completes
+		jc->destError = "not enough memory";
+		cinfo->dest->next_output_byte = jc->destDiscard;
+		cinfo->dest->free_in_buffer = sizeof(jc->destDiscard);
+		return TRUE;
 	}
+	cinfo->dest->next_output_byte = data + jc->destSize;
+	cinfo->dest->free_in_buffer = size - jc->destSize;
+	jc->destData = data;
+	jc->destSize = size;
 	return TRUE;
 }
 
 METHODDEF(void)
-luajpeg_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+luajpeg_term_memory_destination (j_compress_ptr cinfo)
 {
-	trace("luajpeg_skip_input_data(%d)\n", num_bytes);
-	if (num_bytes > 0) {
-		while (num_bytes > (long) cinfo->src->bytes_in_buffer) {
-			num_bytes -= (long) cinfo->src->bytes_in_buffer;
-			if (!luajpeg_fill_input_buffer(cinfo)) {
-				// TODO record the additional skip distance somewhere else
-				cinfo->src->bytes_in_buffer = 0;
-				return;
-			}
-		}
-		cinfo->src->next_input_byte += (size_t) num_bytes;
-		cinfo->src->bytes_in_buffer -= (size_t) num_bytes;
+	trace("luajpeg_term_memory_destination()\n");
+	JpegCompress *jc = JPEG_COMPRESS_PTR(cinfo);
+	if (jc->destError == NULL) {
+		jc->destLength = jc->destSize - cinfo->dest->free_in_buffer;
 	}
 }
 
 
-/*
-********************************************************************************
-* JPEG Decompress functions
-********************************************************************************
-*/
+static FILE *luajpeg_get_destination_file(JpegCompress *jc) {
+	return (jc->destStream != NULL) ? getStreamFile(jc->destStream) : jc->destFile;
+}
 
-static int luajpeg_decompress_new(lua_State *l) {
-	JpegDecompress *jd = (JpegDecompress *)lua_newuserdata(l, sizeof(JpegDecompress));
+static void luajpeg_write_file(JpegCompress *jc, size_t count) {
+	FILE *file = luajpeg_get_destination_file(jc);
+	if (file == NULL) {
+		jc->destError = "file closed";
+	} else if (fwrite(jc->destData, 1, count, file) != count) {
+		jc->destError = "write error";
+	}
+}
 
-	jd->cinfo.err = jpeg_std_error(&jd->errormgr);
-	jd->cinfo.err->error_exit = luajpeg_error_exit;
+METHODDEF(void)
+luajpeg_init_file_destination (j_compress_ptr cinfo)
+{
+	trace("luajpeg_init_file_destination()\n");
+	JpegCompress *jc = JPEG_COMPRESS_PTR(cinfo);
+	jc->destError = NULL;
+	if (jc->destData == NULL) {
+		jc->destData = (JOCTET *) malloc(jc->destSize);
+	}
+	if (jc->destData == NULL) {
+		jc->destError = "not enough memory";
+		cinfo->dest->next_output_byte = jc->destDiscard;
+		cinfo->dest->free_in_buffer = sizeof(jc->destDiscard);
+		return;
+	}
+	cinfo->dest->next_output_byte = jc->destData;
+	cinfo->dest->free_in_buffer = jc->destSize;
+}
 
-	trace("jpeg_create_decompress()\n");
-	jpeg_create_decompress(&jd->cinfo);
+METHODDEF(boolean)
+luajpeg_empty_file_output_buffer (j_compress_ptr cinfo)
+{
+	trace("luajpeg_empty_file_output_buffer()\n");
+	JpegCompress *jc = JPEG_COMPRESS_PTR(cinfo);
+	if (jc->destError == NULL) {
+		luajpeg_write_file(jc, jc->destSize);
+	}
+	if (jc->destError != NULL) {
+		cinfo->dest->next_output_byte = jc->destDiscard;
+		cinfo->dest->free_in_buffer = sizeof(jc->destDiscard);
+	} else {
+		cinfo->dest->next_output_byte = jc->destData;
+		cinfo->dest->free_in_buffer = jc->destSize;
+	}
+	return TRUE;
+}
 
-	// set source manager
-	jd->cinfo.src = &jd->srcmgr;
-	jd->srcmgr.init_source = luajpeg_source_no_operation;
-	jd->srcmgr.fill_input_buffer = luajpeg_fill_input_buffer;
-	jd->srcmgr.skip_input_data = luajpeg_skip_input_data;
-	jd->srcmgr.resync_to_restart = jpeg_resync_to_restart; /* use default method */
-	jd->srcmgr.term_source = luajpeg_source_no_operation;
+METHODDEF(void)
+luajpeg_term_file_destination (j_compress_ptr cinfo)
+{
+	trace("luajpeg_term_file_destination()\n");
+	JpegCompress *jc = JPEG_COMPRESS_PTR(cinfo);
+	if (jc->destError == NULL) {
+		luajpeg_write_file(jc, jc->destSize - cinfo->dest->free_in_buffer);
+	}
+	if (jc->destError == NULL) {
+		FILE *file = luajpeg_get_destination_file(jc);
+		if ((file != NULL) && (fflush(file) != 0)) {
+			jc->destError = "write error";
+		}
+	}
+}
 
-	jd->srcmgr.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
-	jd->srcmgr.next_input_byte = NULL; /* until buffer loaded */
+
+METHODDEF(void)
+luajpeg_source_no_operation (j_decompress_ptr cinfo)
+{
+	trace("luajpeg_source_no_operation()\n");
+}
+
+
+static const JOCTET EOI_BUFFER[2] = { (JOCTET) 0xFF, (JOCTET) JPEG_EOI };
+
+/*
+* The Lua source is either a function returning the next data or the data pushed using fillSource.
+* The function returns a string, nil or an empty string at the end of the input and false to suspend.
+* Without function, the decompression suspends until more data is pushed.
+* libjpeg only commits its input position at markers and MCUs and backs up to it on suspension,
+* so the bytes from that position are kept and the returned data is appended after them.
+* The source manager then points to the new bytes as libjpeg has already read the previous ones.
+*/
+METHODDEF(boolean)
+luajpeg_fill_input_buffer (j_decompress_ptr cinfo)
+{
+	trace("luajpeg_fill_input_buffer()\n");
+	JpegDecompress *jd = JPEG_DECOMPRESS_PTR(cinfo);
+	if ((jd->srcReturned == NULL) || (cinfo->src->next_input_byte != jd->srcReturned)) {
+		// libjpeg has committed its position since the data was returned
+		jd->srcCommitted = cinfo->src->next_input_byte;
+	}
+	size_t kept = (size_t) (cinfo->src->next_input_byte - jd->srcCommitted) + cinfo->src->bytes_in_buffer;
+	for (;;) {
+		if (jd->endOfInput) {
+			// insert a fake EOI marker, libjpeg will warn about the premature end of file
+			cinfo->src->next_input_byte = EOI_BUFFER;
+			cinfo->src->bytes_in_buffer = 2;
+			jd->srcReturned = NULL;
+			return TRUE;
+		}
+		if (!isRegisteredLuaReference(&jd->srcFn)) {
+			break;
+		}
+		lua_State *l = jd->srcFn.state;
+		lua_rawgeti(l, LUA_REGISTRYINDEX, jd->srcFn.ref);
+		if (lua_pcall(l, 0, 1, 0) != 0) {
+			trace("fillBuffer() => Failed\n");
+			jd->endOfInput = TRUE;
+		} else if (lua_isboolean(l, -1) && !lua_toboolean(l, -1)) {
+			lua_pop(l, 1);
+			break;
+		} else if (lua_isstring(l, -1) && (lua_rawlen(l, -1) > 0)) {
+			size_t length = 0;
+			const JOCTET *data = (const JOCTET *)lua_tolstring(l, -1, &length);
+			cinfo->src->next_input_byte = jd->srcCommitted;
+			cinfo->src->bytes_in_buffer = kept;
+			if (!luajpeg_append_source_data(jd, data, length, FALSE)) {
+				jd->endOfInput = TRUE;
+			} else if (cinfo->src->bytes_in_buffer > kept) {
+				// the kept bytes are now in the native buffer
+				unregisterLuaReference(&jd->buffer);
+				lua_pop(l, 1);
+				jd->srcCommitted = cinfo->src->next_input_byte;
+				cinfo->src->next_input_byte += kept;
+				cinfo->src->bytes_in_buffer -= kept;
+				jd->srcReturned = cinfo->src->next_input_byte;
+				return TRUE;
+			}
+		} else {
+			jd->endOfInput = TRUE;
+		}
+		lua_pop(l, 1);
+	}
+	// suspend, libjpeg resumes from its committed position
+	cinfo->src->next_input_byte = jd->srcCommitted;
+	cinfo->src->bytes_in_buffer = kept;
+	jd->srcReturned = NULL;
+	return FALSE;
+}
+
+METHODDEF(void)
+luajpeg_skip_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+	trace("luajpeg_skip_input_data(%d)\n", num_bytes);
+	if (num_bytes > 0) {
+		if (num_bytes > (long) cinfo->src->bytes_in_buffer) {
+			// the skip cannot suspend, the remaining distance is skipped when more data is available
+			JpegDecompress *jd = JPEG_DECOMPRESS_PTR(cinfo);
+			jd->skipBytes += (size_t) num_bytes - cinfo->src->bytes_in_buffer;
+			cinfo->src->next_input_byte += cinfo->src->bytes_in_buffer;
+			cinfo->src->bytes_in_buffer = 0;
+		} else {
+			cinfo->src->next_input_byte += (size_t) num_bytes;
+			cinfo->src->bytes_in_buffer -= (size_t) num_bytes;
+		}
+	}
+}
+
+METHODDEF(boolean)
+luajpeg_fill_file_input_buffer (j_decompress_ptr cinfo)
+{
+	trace("luajpeg_fill_file_input_buffer()\n");
+	JpegDecompress *jd = JPEG_DECOMPRESS_PTR(cinfo);
+	FILE *file = (jd->srcStream != NULL) ? getStreamFile(jd->srcStream) : jd->srcFile;
+	size_t count = 0;
+	if (file != NULL) {
+		count = fread(jd->srcData, 1, jd->srcSize, file);
+	}
+	if (count == 0) {
+		// insert a fake EOI marker, libjpeg will warn about the premature end of file
+		jd->srcData[0] = (JOCTET) 0xFF;
+		jd->srcData[1] = (JOCTET) JPEG_EOI;
+		count = 2;
+	}
+	cinfo->src->next_input_byte = jd->srcData;
+	cinfo->src->bytes_in_buffer = count;
+	return TRUE;
+}
+
+METHODDEF(void)
+luajpeg_skip_file_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+	trace("luajpeg_skip_file_input_data(%d)\n", num_bytes);
+	if (num_bytes > 0) {
+		while (num_bytes > (long) cinfo->src->bytes_in_buffer) {
+			num_bytes -= (long) cinfo->src->bytes_in_buffer;
+			(void) luajpeg_fill_file_input_buffer(cinfo);
+		}
+		cinfo->src->next_input_byte += (size_t) num_bytes;
+		cinfo->src->bytes_in_buffer -= (size_t) num_bytes;
+	}
+}
+
+/*
+* The memory source provides all the data at once, the buffer only needs to be filled
+* when the data is exhausted, in which case a fake EOI marker is inserted.
+*/
+METHODDEF(boolean)
+luajpeg_fill_memory_input_buffer (j_decompress_ptr cinfo)
+{
+	trace("luajpeg_fill_memory_input_buffer()\n");
+	cinfo->src->next_input_byte = EOI_BUFFER;
+	cinfo->src->bytes_in_buffer = 2;
+	return TRUE;
+}
+
+METHODDEF(void)
+luajpeg_skip_memory_input_data (j_decompress_ptr cinfo, long num_bytes)
+{
+	trace("luajpeg_skip_memory_input_data(%d)\n", num_bytes);
+	if (num_bytes > 0) {
+		if (num_bytes > (long) cinfo->src->bytes_in_buffer) {
+			(void) luajpeg_fill_memory_input_buffer(cinfo);
+		} else {
+			cinfo->src->next_input_byte += (size_t) num_bytes;
+			cinfo->src->bytes_in_buffer -= (size_t) num_bytes;
+		}
+	}
+}
+
+
+/*
+********************************************************************************
+* JPEG Decompress functions
+********************************************************************************
+*/
+
+static void luajpeg_decompress_release_source(JpegDecompress *jd) {
+	unregisterLuaReference(&jd->buffer);
+	unregisterLuaReference(&jd->srcFn);
+	unregisterLuaReference(&jd->srcStreamRef);
+	if (jd->srcFile != NULL) {
+		fclose(jd->srcFile);
+		jd->srcFile = NULL;
+	}
+	jd->srcStream = NULL;
+	if (jd->srcData != NULL) {
+		free(jd->srcData);
+		jd->srcData = NULL;
+	}
+	jd->srcSize = 0;
+	if (jd->srcMapping != NULL) {
+		unmapFile(jd->srcMapping, jd->srcMappingSize);
+		jd->srcMapping = NULL;
+	}
+	jd->srcMappingSize = 0;
+	jd->skipBytes = 0;
+	jd->endOfInput = FALSE;
+	jd->srcReturned = NULL;
+	jd->srcType = SOURCE_LUA;
+	jd->srcmgr.bytes_in_buffer = 0;
+	jd->srcmgr.next_input_byte = NULL;
+	jd->srcmgr.fill_input_buffer = luajpeg_fill_input_buffer;
+	jd->srcmgr.skip_input_data = luajpeg_skip_input_data;
+}
+
+static const char *SOURCE_OPTIONS[] = { "data", "path", "mmap", NULL };
+
+/*
+* Sets the memory mapped file as source, the source manager points to the whole mapping
+* so that there is no read call nor copy.
+*/
+static int luajpeg_decompress_set_mapping_source(JpegDecompress *jd, const char *path) {
+	luajpeg_decompress_release_source(jd);
+	jd->srcMapping = mapFile(path, &jd->srcMappingSize);
+	if (jd->srcMapping == NULL) {
+		return 0;
+	}
+	jd->srcType = SOURCE_MAPPING;
+	jd->srcmgr.fill_input_buffer = luajpeg_fill_memory_input_buffer;
+	jd->srcmgr.skip_input_data = luajpeg_skip_memory_input_data;
+	jd->srcmgr.next_input_byte = (const JOCTET *) jd->srcMapping;
+	jd->srcmgr.bytes_in_buffer = jd->srcMappingSize;
+	return 1;
+}
+
+/*
+* Sets a native file source from a Lua file handle or a file path,
+* the data is read by blocks of the specified size without calling Lua.
+*/
+static int luajpeg_decompress_set_file_source(JpegDecompress *jd, lua_State *l, int i, size_t bufferSize) {
+	luajpeg_decompress_release_source(jd);
+	if (bufferSize < 2048) {
+		bufferSize = 2048;
+	}
+	jd->srcData = (JOCTET *) malloc(bufferSize);
+	if (jd->srcData == NULL) {
+		return 0;
+	}
+	jd->srcSize = bufferSize;
+	if (lua_isstring(l, i)) {
+		jd->srcFile = fopen(lua_tostring(l, i), "rb");
+		if (jd->srcFile == NULL) {
+			luajpeg_decompress_release_source(jd);
+			return 0;
+		}
+	} else {
+		jd->srcStream = luaL_checkudata(l, i, LUA_FILEHANDLE);
+		lua_pushvalue(l, i);
+		registerLuaReference(&jd->srcStreamRef, l);
+	}
+	jd->srcType = SOURCE_FILE;
+	jd->srcmgr.fill_input_buffer = luajpeg_fill_file_input_buffer;
+	jd->srcmgr.skip_input_data = luajpeg_skip_file_input_data;
+	jd->srcmgr.bytes_in_buffer = 0;
+	jd->srcmgr.next_input_byte = NULL;
+	return 1;
+}
+
+static int luajpeg_decompress_rows_per_call(JpegDecompress *jd) {
+	int rowsPerCall = jd->rowsPerCall;
+	if ((rowsPerCall <= 0) && (jd->runStep >= 4)) {
+		// the output dimensions are available after jpeg_start_decompress()
+		rowsPerCall = DECOMPRESS_IMCU_ROWS(&jd->cinfo);
+		if (rowsPerCall < jd->cinfo.rec_outbuf_height) {
+			rowsPerCall = jd->cinfo.rec_outbuf_height;
+		}
+	}
+	if (rowsPerCall < 1) {
+		rowsPerCall = 1;
+	} else if (rowsPerCall > MAX_ROWS_PER_CALL) {
+		rowsPerCall = MAX_ROWS_PER_CALL;
+	}
+	return rowsPerCall;
+}
+
+static int luajpeg_decompress_new(lua_State *l) {
+	JpegDecompress *jd = (JpegDecompress *)lua_newuserdata(l, sizeof(JpegDecompress));
+
+	jd->cinfo.err = jpeg_std_error(&jd->errormgr);
+	jd->cinfo.err->error_exit = luajpeg_error_exit;
+
+	trace("jpeg_create_decompress()\n");
+	jpeg_create_decompress(&jd->cinfo);
+
+	// set source manager
+	jd->cinfo.src = &jd->srcmgr;
+	jd->srcmgr.init_source = luajpeg_source_no_operation;
+	jd->srcmgr.fill_input_buffer = luajpeg_fill_input_buffer;
+	jd->srcmgr.skip_input_data = luajpeg_skip_input_data;
+	jd->srcmgr.resync_to_restart = jpeg_resync_to_restart; /* use default method */
+	jd->srcmgr.term_source = luajpeg_source_no_operation;
+
+	jd->srcmgr.bytes_in_buffer = 0; /* forces fill_input_buffer on first read */
+	jd->srcmgr.next_input_byte = NULL; /* until buffer loaded */
 
 	initLuaReference(&jd->buffer);
 	initLuaReference(&jd->srcFn);
+	initLuaReference(&jd->srcStreamRef);
+
+	jd->srcType = SOURCE_LUA;
+	jd->srcFile = NULL;
+	jd->srcStream = NULL;
+	jd->srcData = NULL;
+	jd->srcSize = 0;
+	jd->srcMapping = NULL;
+	jd->srcMappingSize = 0;
+	jd->skipBytes = 0;
+	jd->endOfInput = FALSE;
+	jd->srcCommitted = NULL;
+	jd->srcReturned = NULL;
 
 	jd->runStep = 0;
+	jd->rowsPerCall = 0;
+	jd->transformArrays = NULL;
+	jd->region = FALSE;
+	jd->outputStarted = FALSE;
 
 	luaL_getmetatable(l, "jpeg_decompress");
 	lua_setmetatable(l, -2);
@@ -411,15 +1420,40 @@ static int luajpeg_decompress_new(lua_State *l) {
 static int luajpeg_decompress_fill_source(lua_State *l) {
 	trace("luajpeg_decompress_fill_source()\n");
 	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
-	if (lua_isstring(l, 2)) {
-		lua_pushvalue(l, 2);
-		luajpeg_set_source_buffer(jd, l);
+	int sourceType = luaL_checkoption(l, 3, "data", SOURCE_OPTIONS);
+	size_t bufferSize = (size_t) luaL_optinteger(l, 4, DEFAULT_FILE_BUFFER_SIZE);
+	if (sourceType == 2) {
+		if (!luajpeg_decompress_set_mapping_source(jd, luaL_checkstring(l, 2))) {
+			lua_pushnil(l);
+			lua_pushstring(l, "cannot map source");
+			return 2;
+		}
+	} else if ((sourceType == 1) || luaL_testudata(l, 2, LUA_FILEHANDLE)) {
+		if (!luajpeg_decompress_set_file_source(jd, l, 2, bufferSize)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "cannot open source");
+			return 2;
+		}
+	} else if (lua_isstring(l, 2)) {
+		// push mode, the data is appended to the remaining input, an empty string marks the end of the input
+		if (jd->srcType != SOURCE_LUA) {
+			luajpeg_decompress_release_source(jd);
+		}
+		if (lua_rawlen(l, 2) == 0) {
+			jd->endOfInput = TRUE;
+		} else if (!luajpeg_push_source_data(jd, l, 2)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "not enough memory");
+			return 2;
+		}
 	} else if (lua_isfunction(l, 2)) {
+		if (jd->srcType != SOURCE_LUA) {
+			luajpeg_decompress_release_source(jd);
+		}
 		lua_pushvalue(l, 2);
 		registerLuaReference(&jd->srcFn, l);
 	} else {
-		unregisterLuaReference(&jd->buffer);
-		unregisterLuaReference(&jd->srcFn);
+		luajpeg_decompress_release_source(jd);
 	}
 	return 0;
 }
@@ -452,11 +1486,27 @@ static int luajpeg_decompress_read_header(lua_State *l) {
 	return 1;
 }
 
+static void luajpeg_decompress_save_markers(j_decompress_ptr cinfo) {
+	int m;
+	jpeg_save_markers(cinfo, JPEG_COM, 0xFFFF);
+	for (m = 0; m < 16; m++) {
+		jpeg_save_markers(cinfo, JPEG_APP0 + m, 0xFFFF);
+	}
+}
+
 static int luajpeg_decompress_configure(lua_State *l) {
 	trace("luajpeg_decompress_configure()\n");
 	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
 
 	if (lua_istable(l, 2)) {
+		if (jd->runStep == 0) {
+			/*
+			* Keep the COM and APPn markers, they are available to be copied by a transformation.
+			*/
+			if (getBooleanField(l, 2, "saveMarkers", 0)) {
+				luajpeg_decompress_save_markers(&jd->cinfo);
+			}
+		}
 		if (jd->runStep == 2) {
 			/*
 			* Scale the image by the fraction scale_num/scale_denom.
@@ -475,9 +1525,42 @@ static int luajpeg_decompress_configure(lua_State *l) {
 			SET_OPT_OPTION_FIELD(l, 2, jd->cinfo.out_color_space, "colorSpace", JCS_OPTIONS, JCS_VALUES);
 
 			SET_OPT_NUMBER_FIELD(l, 2, jd->cinfo.output_gamma, "gamma");
+
+			/*
+			* Raw data mode, the components are returned as separate planes at their sampled resolution,
+			* without upsampling nor color conversion, in the JPEG color space.
+			*/
+			jd->cinfo.raw_data_out = getBooleanField(l, 2, "rawData", jd->cinfo.raw_data_out);
+
+			/*
+			* Region of interest in the output image, the rows below the region are not decoded.
+			* The image buffer only contains the region, false to disable.
+			*/
+			lua_getfield(l, 2, "region");
+			if (lua_istable(l, -1)) {
+				jd->region = TRUE;
+				jd->regionX = (JDIMENSION) getLongField(l, -1, "x", 0);
+				jd->regionY = (JDIMENSION) getLongField(l, -1, "y", 0);
+				jd->regionWidth = (JDIMENSION) getLongField(l, -1, "width", 0);
+				jd->regionHeight = (JDIMENSION) getLongField(l, -1, "height", 0);
+			} else if (lua_isboolean(l, -1) && !lua_toboolean(l, -1)) {
+				jd->region = FALSE;
+			}
+			lua_pop(l, 1);
+
+			/*
+			* Buffered image mode, the image is decompressed in output passes, one for each scan of interest,
+			* a progressive image can then be displayed while it is received.
+			*/
+			jd->cinfo.buffered_image = getBooleanField(l, 2, "bufferedImage", jd->cinfo.buffered_image);
 		}
 
 		SET_OPT_INTEGER_FIELD(l, 2, jd->bytesPerRow, "bytesPerRow");
+		/*
+		* Number of scanlines to read per call, the default is to read a whole iMCU row,
+		* which is the natural amount of scanlines produced by the decompressor.
+		*/
+		SET_OPT_INTEGER_FIELD(l, 2, jd->rowsPerCall, "rowsPerCall");
 	}
 	return 0;
 }
@@ -505,6 +1588,163 @@ static int luajpeg_decompress_start(lua_State *l) {
 	trace("gamma: %f\n", jd->cinfo.output_gamma);
 
 	jd->bytesPerRow = jd->cinfo.output_width * jd->cinfo.output_components;
+	jd->rawScratch = NULL;
+	jd->regionScratch = NULL;
+	jd->regionScratchRows = 0;
+	jd->outputStarted = FALSE;
+	if (jd->region) {
+		// the region is clipped to the output image, an empty region is reported by decompress
+		if ((jd->regionX >= jd->cinfo.output_width) || (jd->regionY >= jd->cinfo.output_height)) {
+			jd->regionWidth = jd->regionHeight = 0;
+		}
+		if (jd->regionWidth > jd->cinfo.output_width - jd->regionX) {
+			jd->regionWidth = jd->cinfo.output_width - jd->regionX;
+		}
+		if (jd->regionHeight > jd->cinfo.output_height - jd->regionY) {
+			jd->regionHeight = jd->cinfo.output_height - jd->regionY;
+		}
+		jd->bytesPerRow = jd->regionWidth * jd->cinfo.output_components;
+	}
+	return 0;
+}
+
+static void luajpeg_decompress_push_planes(JpegDecompress *jd, lua_State *l) {
+	jpeg_component_info *compptr;
+	int ci;
+	lua_createtable(l, jd->cinfo.num_components, 0);
+	for (ci = 0, compptr = jd->cinfo.comp_info; ci < jd->cinfo.num_components; ci++, compptr++) {
+		lua_newtable(l);
+		SET_TABLE_KEY_INTEGER(l, "width", compptr->downsampled_width);
+		SET_TABLE_KEY_INTEGER(l, "height", compptr->downsampled_height);
+		SET_TABLE_KEY_INTEGER(l, "bytesPerRow", COMPONENT_RAW_STRIDE(compptr));
+		SET_TABLE_KEY_INTEGER(l, "hSampFactor", compptr->h_samp_factor);
+		SET_TABLE_KEY_INTEGER(l, "vSampFactor", compptr->v_samp_factor);
+		lua_rawseti(l, -2, ci + 1);
+	}
+}
+
+/*
+* Reads the raw data in the planes, the planes are a table of userdata, one per component.
+* The optional plane strides default to the minimal strides.
+* The rows after the plane height are discarded.
+*/
+static int luajpeg_decompress_read_raw(JpegDecompress *jd, lua_State *l) {
+	JSAMPROW rows[MAX_COMPONENTS][MAX_ROWS_PER_CALL];
+	JSAMPARRAY planes[MAX_COMPONENTS];
+	unsigned char *planeData[MAX_COMPONENTS];
+	size_t planeStride[MAX_COMPONENTS];
+	size_t planeRows[MAX_COMPONENTS];
+	jpeg_component_info *compptr;
+	JDIMENSION iMCURows = (JDIMENSION) DECOMPRESS_IMCU_ROWS(&jd->cinfo);
+	JDIMENSION compRows, firstRow, row;
+	int ci;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	for (ci = 0, compptr = jd->cinfo.comp_info; ci < jd->cinfo.num_components; ci++, compptr++) {
+		size_t minStride = COMPONENT_RAW_STRIDE(compptr);
+		planeStride[ci] = minStride;
+		if (lua_istable(l, 3)) {
+			lua_rawgeti(l, 3, ci + 1);
+			if (lua_isnumber(l, -1)) {
+				planeStride[ci] = (size_t) lua_tointeger(l, -1);
+			}
+			lua_pop(l, 1);
+		}
+		lua_rawgeti(l, 2, ci + 1);
+		if (!lua_isuserdata(l, -1) || lua_islightuserdata(l, -1) || (planeStride[ci] < minStride)) {
+			lua_pushnil(l);
+			lua_pushfstring(l, "invalid plane %d", ci + 1);
+			return 2;
+		}
+		planeData[ci] = (unsigned char *)lua_touserdata(l, -1);
+		planeRows[ci] = lua_rawlen(l, -1) / planeStride[ci];
+		lua_pop(l, 1);
+		if (planeRows[ci] < compptr->downsampled_height) {
+			lua_pushnil(l);
+			lua_pushfstring(l, "plane %d buffer too small", ci + 1);
+			return 2;
+		}
+		planes[ci] = rows[ci];
+	}
+	if (jd->rawScratch == NULL) {
+		JDIMENSION maxStride = 0;
+		for (ci = 0, compptr = jd->cinfo.comp_info; ci < jd->cinfo.num_components; ci++, compptr++) {
+			if (COMPONENT_RAW_STRIDE(compptr) > maxStride) {
+				maxStride = COMPONENT_RAW_STRIDE(compptr);
+			}
+		}
+		// released by libjpeg with the image
+		jd->rawScratch = (JSAMPROW) (*jd->cinfo.mem->alloc_small)((j_common_ptr) &jd->cinfo, JPOOL_IMAGE, maxStride);
+	}
+	while (jd->cinfo.output_scanline < jd->cinfo.output_height) {
+		for (ci = 0, compptr = jd->cinfo.comp_info; ci < jd->cinfo.num_components; ci++, compptr++) {
+			compRows = COMPONENT_RAW_ROWS(compptr);
+			firstRow = jd->cinfo.output_scanline / iMCURows * compRows;
+			for (row = 0; row < compRows; row++) {
+				if (firstRow + row < planeRows[ci]) {
+					rows[ci][row] = (JSAMPROW) (planeData[ci] + (firstRow + row) * planeStride[ci]);
+				} else {
+					rows[ci][row] = jd->rawScratch;
+				}
+			}
+		}
+		if (jpeg_read_raw_data(&jd->cinfo, planes, iMCURows) == 0) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+	}
+	return 0;
+}
+
+/*
+* Reads the region rows in the image buffer, the rows above the region and the region rows
+* that are not fully copied are decoded into scratch rows.
+* Returns 1 when the region is complete and 0 on suspension.
+*/
+static int luajpeg_decompress_read_region(JpegDecompress *jd, char *imageData) {
+	JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+	JDIMENSION rowsPerCall = (JDIMENSION) luajpeg_decompress_rows_per_call(jd);
+	JDIMENSION regionEnd = jd->regionY + jd->regionHeight;
+	JDIMENSION rowCount, readCount, row, i;
+	size_t offset = jd->regionX * jd->cinfo.output_components;
+	size_t length = jd->regionWidth * jd->cinfo.output_components;
+	int direct = (jd->regionX == 0) && (jd->regionWidth == jd->cinfo.output_width);
+	if (jd->regionScratch == NULL) {
+		// released by libjpeg with the image
+		jd->regionScratchRows = rowsPerCall;
+		jd->regionScratch = (*jd->cinfo.mem->alloc_sarray)((j_common_ptr) &jd->cinfo, JPOOL_IMAGE,
+			jd->cinfo.output_width * jd->cinfo.output_components, rowsPerCall);
+	}
+	if (rowsPerCall > jd->regionScratchRows) {
+		rowsPerCall = jd->regionScratchRows;
+	}
+	while (jd->cinfo.output_scanline < regionEnd) {
+		rowCount = regionEnd - jd->cinfo.output_scanline;
+		if (rowCount > rowsPerCall) {
+			rowCount = rowsPerCall;
+		}
+		for (i = 0; i < rowCount; i++) {
+			row = jd->cinfo.output_scanline + i;
+			if (direct && (row >= jd->regionY)) {
+				row_pointer[i] = (JSAMPROW) (imageData + (row - jd->regionY) * jd->bytesPerRow);
+			} else {
+				row_pointer[i] = jd->regionScratch[i];
+			}
+		}
+		row = jd->cinfo.output_scanline;
+		readCount = jpeg_read_scanlines(&jd->cinfo, row_pointer, rowCount);
+		if (readCount == 0) {
+			return 0;
+		}
+		if (!direct) {
+			for (i = 0; i < readCount; i++, row++) {
+				if (row >= jd->regionY) {
+					memcpy(imageData + (row - jd->regionY) * jd->bytesPerRow, jd->regionScratch[i] + offset, length);
+				}
+			}
+		}
+	}
+	return 1;
 }
 
 static int luajpeg_decompress_get_infos(lua_State *l) {
@@ -519,6 +1759,9 @@ static int luajpeg_decompress_get_infos(lua_State *l) {
 	SET_TABLE_KEY_INTEGER(l, "height", jd->cinfo.image_height);
 	SET_TABLE_KEY_STRING(l, "colorSpace", getOptionField(jd->cinfo.jpeg_color_space, JCS_UNKNOWN, JCS_OPTIONS, JCS_VALUES));
 	SET_TABLE_KEY_INTEGER(l, "components", jd->cinfo.num_components);
+	lua_pushstring(l, "progressive");
+	lua_pushboolean(l, jd->cinfo.progressive_mode);
+	lua_rawset(l, -3);
 	lua_rawset(l, -3);
 
 	lua_pushstring(l, "output");
@@ -533,61 +1776,314 @@ static int luajpeg_decompress_get_infos(lua_State *l) {
 	SET_TABLE_KEY_INTEGER(l, "scaleDenom", jd->cinfo.scale_denom);
 
 	SET_TABLE_KEY_INTEGER(l, "bytesPerRow", jd->bytesPerRow);
+	SET_TABLE_KEY_INTEGER(l, "rowsPerCall", luajpeg_decompress_rows_per_call(jd));
+	lua_pushstring(l, "rawData");
+	lua_pushboolean(l, jd->cinfo.raw_data_out);
+	lua_rawset(l, -3);
+	if (jd->cinfo.raw_data_out && (jd->runStep >= 4)) {
+		lua_pushstring(l, "planes");
+		luajpeg_decompress_push_planes(jd, l);
+		lua_rawset(l, -3);
+	}
+	lua_pushstring(l, "bufferedImage");
+	lua_pushboolean(l, jd->cinfo.buffered_image);
+	lua_rawset(l, -3);
+	if (jd->cinfo.buffered_image && (jd->runStep >= 4)) {
+		SET_TABLE_KEY_INTEGER(l, "inputScanNumber", jd->cinfo.input_scan_number);
+		SET_TABLE_KEY_INTEGER(l, "outputScanNumber", jd->cinfo.output_scan_number);
+	}
+	if (jd->region && (jd->runStep >= 4)) {
+		lua_pushstring(l, "region");
+		lua_newtable(l);
+		SET_TABLE_KEY_INTEGER(l, "x", jd->regionX);
+		SET_TABLE_KEY_INTEGER(l, "y", jd->regionY);
+		SET_TABLE_KEY_INTEGER(l, "width", jd->regionWidth);
+		SET_TABLE_KEY_INTEGER(l, "height", jd->regionHeight);
+		lua_rawset(l, -3);
+	}
 	lua_rawset(l, -3);
 
 	return 1;
 }
 
-static int luajpeg_decompress_run(lua_State *l) {
-	trace("luajpeg_decompress_run()\n");
-	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
-
-	trace("step: %d\n", jd->runStep);
-	if (jd->runStep == 4) {
-		jd->runStep++;
+/*
+* Decodes the rows by strips into a single strip buffer, the function at index 2 is called with the strip,
+* its first row and its row count, the strip height at index 3 defaults to the rows per call.
+* The function may return false to stop the decompression.
+* The rows decoded before a suspension are passed to the function, the next call continues with the next row.
+*/
+static int luajpeg_decompress_read_strips(JpegDecompress *jd, lua_State *l) {
+	lua_Integer stripHeight = luaL_optinteger(l, 3, luajpeg_decompress_rows_per_call(jd));
+	if (stripHeight < 1) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid strip height");
+		return 2;
 	}
-	if (jd->runStep == 5) {
-		// we may want to allocate a buffer and return it as a string or userdata
-		luaL_checktype(l, 2, LUA_TUSERDATA);
-		size_t imageLength = lua_rawlen(l, 2);
-		char *imageData = (char *)lua_touserdata(l, 2);
-		trace("bytesPerRow: %d\n", jd->bytesPerRow);
-		size_t output_size = (size_t) (jd->bytesPerRow * jd->cinfo.output_height);
-		if (imageLength < output_size) {
-			lua_pushnil(l);
-			lua_pushstring(l, "image buffer too small");
-			return 2;
-		}
-		JSAMPROW row_pointer[1];
-		while (jd->cinfo.output_scanline < jd->cinfo.output_height) {
-			row_pointer[0] = (JSAMPROW) (imageData + jd->cinfo.output_scanline * jd->bytesPerRow);
-			if (jpeg_read_scanlines(&jd->cinfo, row_pointer, 1) == 0) {
-				lua_pushnil(l);
-				lua_pushstring(l, "suspended");
-				return 2;
+	JDIMENSION stripRows = (JDIMENSION) stripHeight;
+	if (jd->region) {
+		lua_pushnil(l);
+		lua_pushstring(l, "region not supported by strips");
+		return 2;
+	}
+	if (stripRows > jd->cinfo.output_height) {
+		stripRows = jd->cinfo.output_height;
+	}
+	unsigned char *strip = (unsigned char *)lua_newuserdata(l, stripRows * jd->bytesPerRow);
+	int stripIndex = lua_gettop(l);
+	JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+	JDIMENSION rowsPerCall = (JDIMENSION) luajpeg_decompress_rows_per_call(jd);
+	JDIMENSION firstRow, stripCount, rowCount, readCount, i;
+	int suspended = FALSE;
+	trace("stripRows: %d, rowsPerCall: %d\n", stripRows, rowsPerCall);
+	while (!suspended && (jd->cinfo.output_scanline < jd->cinfo.output_height)) {
+		firstRow = jd->cinfo.output_scanline;
+		stripCount = 0;
+		while (stripCount < stripRows) {
+			rowCount = jd->cinfo.output_height - jd->cinfo.output_scanline;
+			if (rowCount > stripRows - stripCount) {
+				rowCount = stripRows - stripCount;
+			}
+			if (rowCount > rowsPerCall) {
+				rowCount = rowsPerCall;
+			}
+			if (rowCount == 0) {
+				break;
+			}
+			for (i = 0; i < rowCount; i++) {
+				row_pointer[i] = (JSAMPROW) (strip + (stripCount + i) * jd->bytesPerRow);
+			}
+			readCount = jpeg_read_scanlines(&jd->cinfo, row_pointer, rowCount);
+			if (readCount == 0) {
+				suspended = TRUE;
+				break;
 			}
+			stripCount += readCount;
 		}
-		jd->runStep++;
-	}
-	if (jd->runStep == 6) {
-		trace("jpeg_finish_decompress()\n");
-		if (! jpeg_finish_decompress(&jd->cinfo)) {
+		if (stripCount == 0) {
+			continue;
+		}
+		lua_pushvalue(l, 2);
+		lua_pushvalue(l, stripIndex);
+		lua_pushinteger(l, firstRow);
+		lua_pushinteger(l, stripCount);
+		if (lua_pcall(l, 3, 1, 0) != 0) {
 			lua_pushnil(l);
-			lua_pushstring(l, "suspended");
+			lua_insert(l, -2);
 			return 2;
 		}
-		jd->runStep = 0;
+		if (lua_isboolean(l, -1) && !lua_toboolean(l, -1)) {
+			// the remaining rows are not needed
+			return 0;
+		}
+		lua_pop(l, 1);
+	}
+	if (suspended) {
+		lua_pushnil(l);
+		lua_pushstring(l, "suspended");
+		return 2;
 	}
 	return 0;
 }
 
-static int luajpeg_decompress_gc(lua_State *l) {
-	JpegDecompress *jd = (JpegDecompress *)luaL_testudata(l, 1, "jpeg_decompress");
+/*
+* Reads the output scanlines in the image buffer, returns 0 when the rows are read,
+* otherwise the number of results pushed on the stack.
+*/
+static int luajpeg_decompress_read_output(JpegDecompress *jd, lua_State *l) {
+	if (jd->cinfo.raw_data_out) {
+		return luajpeg_decompress_read_raw(jd, l);
+	}
+	if (lua_isfunction(l, 2)) {
+		return luajpeg_decompress_read_strips(jd, l);
+	}
+	// we may want to allocate a buffer and return it as a string or userdata
+	luaL_checktype(l, 2, LUA_TUSERDATA);
+	size_t imageLength = lua_rawlen(l, 2);
+	char *imageData = (char *)lua_touserdata(l, 2);
+	trace("bytesPerRow: %d\n", jd->bytesPerRow);
+	size_t output_size = (size_t) (jd->bytesPerRow * (jd->region ? jd->regionHeight : jd->cinfo.output_height));
+	if (imageLength < output_size) {
+		lua_pushnil(l);
+		lua_pushstring(l, "image buffer too small");
+		return 2;
+	}
+	if (jd->region) {
+		if ((jd->regionWidth == 0) || (jd->regionHeight == 0)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "empty region");
+			return 2;
+		}
+		if (! luajpeg_decompress_read_region(jd, imageData)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+		return 0;
+	}
+	JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+	JDIMENSION rowsPerCall = (JDIMENSION) luajpeg_decompress_rows_per_call(jd);
+	JDIMENSION rowCount, i;
+	trace("rowsPerCall: %d\n", rowsPerCall);
+	while (jd->cinfo.output_scanline < jd->cinfo.output_height) {
+		rowCount = jd->cinfo.output_height - jd->cinfo.output_scanline;
+		if (rowCount > rowsPerCall) {
+			rowCount = rowsPerCall;
+		}
+		for (i = 0; i < rowCount; i++) {
+			row_pointer[i] = (JSAMPROW) (imageData + (jd->cinfo.output_scanline + i) * jd->bytesPerRow);
+		}
+		if (jpeg_read_scanlines(&jd->cinfo, row_pointer, rowCount) == 0) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+	}
+	return 0;
+}
+
+/*
+* Decompresses the image, in buffered image mode the current output pass is decompressed
+* and a boolean indicating whether it was the final pass is returned.
+*/
+static int luajpeg_decompress_run(lua_State *l) {
+	trace("luajpeg_decompress_run()\n");
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+
+	trace("step: %d\n", jd->runStep);
+	if ((jd->runStep == 4) && !jd->cinfo.buffered_image) {
+		jd->runStep++;
+	}
+	if (((jd->runStep == 4) || (jd->runStep == 5)) && jd->cinfo.buffered_image && !jd->outputStarted) {
+		lua_pushnil(l);
+		lua_pushstring(l, "output not started");
+		return 2;
+	}
+	if (jd->runStep == 5) {
+		int status = luajpeg_decompress_read_output(jd, l);
+		if (status != 0) {
+			return status;
+		}
+		if (jd->cinfo.buffered_image) {
+			// the output pass may be terminated before its last row
+			trace("jpeg_finish_output()\n");
+			if (! jpeg_finish_output(&jd->cinfo)) {
+				lua_pushnil(l);
+				lua_pushstring(l, "suspended");
+				return 2;
+			}
+			jd->outputStarted = FALSE;
+			if (!jpeg_input_complete(&jd->cinfo) || (jd->cinfo.output_scan_number < jd->cinfo.input_scan_number)) {
+				lua_pushboolean(l, 0);
+				return 1;
+			}
+		} else if (jd->cinfo.output_scanline < jd->cinfo.output_height) {
+			// the remaining rows of the region or of the stopped strips are not needed
+			trace("jpeg_abort_decompress()\n");
+			jpeg_abort_decompress(&jd->cinfo);
+			jd->runStep = 0;
+			if (jd->srcType == SOURCE_LUA) {
+				luajpeg_reset_source_data(jd);
+			}
+			return 0;
+		}
+		jd->runStep++;
+	}
+	if (jd->runStep == 6) {
+		trace("jpeg_finish_decompress()\n");
+		if (! jpeg_finish_decompress(&jd->cinfo)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+		jd->runStep = 0;
+		if (jd->srcType == SOURCE_LUA) {
+			// the data following the image is not part of the next image
+			luajpeg_reset_source_data(jd);
+		}
+		if (jd->cinfo.buffered_image) {
+			lua_pushboolean(l, 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+* Absorbs the available input in buffered image mode, at most up to the end of the current scan.
+* Returns the input status, "suspended", "scan" when a scan is completed or "eoi" when the input is complete,
+* and the input scan number.
+*/
+static int luajpeg_decompress_consume_input(lua_State *l) {
+	trace("luajpeg_decompress_consume_input()\n");
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+	int ret;
+
+	if ((jd->runStep < 4) || (jd->runStep > 5) || !jd->cinfo.buffered_image) {
+		lua_pushnil(l);
+		lua_pushstring(l, "buffered image decompress not started");
+		return 2;
+	}
+	do {
+		ret = jpeg_consume_input(&jd->cinfo);
+	} while ((ret != JPEG_SUSPENDED) && (ret != JPEG_REACHED_EOI) && (ret != JPEG_SCAN_COMPLETED));
+	if (ret == JPEG_REACHED_EOI) {
+		lua_pushstring(l, "eoi");
+	} else if (ret == JPEG_SCAN_COMPLETED) {
+		lua_pushstring(l, "scan");
+	} else {
+		lua_pushstring(l, "suspended");
+	}
+	lua_pushinteger(l, jd->cinfo.input_scan_number);
+	return 2;
+}
+
+/*
+* Starts an output pass in buffered image mode, the scan number defaults to the current input scan number.
+* Once the input is complete, the output pass shall use the last scan to be the final one.
+*/
+static int luajpeg_decompress_start_output(lua_State *l) {
+	trace("luajpeg_decompress_start_output()\n");
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+
+	if ((jd->runStep < 4) || (jd->runStep > 5) || !jd->cinfo.buffered_image) {
+		lua_pushnil(l);
+		lua_pushstring(l, "buffered image decompress not started");
+		return 2;
+	}
+	if (jd->outputStarted) {
+		lua_pushnil(l);
+		lua_pushstring(l, "output already started");
+		return 2;
+	}
+	int scanNumber = (int) luaL_optinteger(l, 2, jd->cinfo.input_scan_number);
+	if (jpeg_input_complete(&jd->cinfo) && (scanNumber < jd->cinfo.input_scan_number)) {
+		// the final pass must display the last scan
+		scanNumber = jd->cinfo.input_scan_number;
+	}
+	jd->runStep = 5;
+	trace("jpeg_start_output(%d)\n", scanNumber);
+	if (! jpeg_start_output(&jd->cinfo, scanNumber)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "suspended");
+		return 2;
+	}
+	jd->outputStarted = TRUE;
+	lua_pushinteger(l, jd->cinfo.output_scan_number);
+	return 1;
+}
+
+static int luajpeg_decompress_is_input_complete(lua_State *l) {
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+	lua_pushboolean(l, (jd->runStep >= 2) && jpeg_input_complete(&jd->cinfo));
+	return 1;
+}
+
+static int luajpeg_decompress_gc(lua_State *l) {
+	JpegDecompress *jd = (JpegDecompress *)luaL_testudata(l, 1, "jpeg_decompress");
 	if (jd != NULL) {
 		trace("luajpeg_destroy_decompress()\n");
 		jpeg_destroy_decompress(&jd->cinfo);
-		unregisterLuaReference(&jd->buffer);
-		unregisterLuaReference(&jd->srcFn);
+		luajpeg_decompress_release_source(jd);
 	}
 	return 0;
 }
@@ -599,6 +2095,125 @@ static int luajpeg_decompress_gc(lua_State *l) {
 ********************************************************************************
 */
 
+static int luajpeg_compress_rows_per_call(JpegCompress *jc) {
+	int rowsPerCall = jc->rowsPerCall;
+	if (rowsPerCall <= 0) {
+		// the sampling factors are available after jpeg_start_compress()
+		rowsPerCall = COMPRESS_IMCU_ROWS(&jc->cinfo);
+	}
+	if (rowsPerCall < 1) {
+		rowsPerCall = 1;
+	} else if (rowsPerCall > MAX_ROWS_PER_CALL) {
+		rowsPerCall = MAX_ROWS_PER_CALL;
+	}
+	return rowsPerCall;
+}
+
+static void luajpeg_compress_release_destination(JpegCompress *jc) {
+	unregisterLuaReference(&jc->destFn);
+	unregisterLuaReference(&jc->buffer);
+	unregisterLuaReference(&jc->destStreamRef);
+	if (jc->destFile != NULL) {
+		fclose(jc->destFile);
+		jc->destFile = NULL;
+	}
+	jc->destStream = NULL;
+	if (jc->destData != NULL) {
+		free(jc->destData);
+		jc->destData = NULL;
+	}
+	jc->destSize = 0;
+	jc->destLength = 0;
+	jc->destError = NULL;
+	jc->destType = DESTINATION_NONE;
+}
+
+/*
+* Sets the destination from the Lua value at the specified index, the buffer size is at the next index.
+* A function is called with each chunk of compressed data as a string,
+* a Lua file handle or a file path are written natively,
+* otherwise the compressed data is kept in memory and returned when the compression completes.
+* Returns 0 if the destination file cannot be opened.
+*/
+static int luajpeg_compress_set_destination(JpegCompress *jc, lua_State *l, int i) {
+	luajpeg_compress_release_destination(jc);
+	if (luaL_testudata(l, i, LUA_FILEHANDLE) || lua_isstring(l, i)) {
+		if (lua_isstring(l, i)) {
+			jc->destFile = fopen(lua_tostring(l, i), "wb");
+			if (jc->destFile == NULL) {
+				return 0;
+			}
+		} else {
+			jc->destStream = lua_touserdata(l, i);
+			lua_pushvalue(l, i);
+			registerLuaReference(&jc->destStreamRef, l);
+		}
+		jc->destType = DESTINATION_FILE;
+		jc->destmgr.init_destination = luajpeg_init_file_destination;
+		jc->destmgr.empty_output_buffer = luajpeg_empty_file_output_buffer;
+		jc->destmgr.term_destination = luajpeg_term_file_destination;
+		size_t bufferSize = (size_t) luaL_optinteger(l, i + 1, DEFAULT_FILE_BUFFER_SIZE);
+		if (bufferSize < 2048) {
+			bufferSize = 2048;
+		}
+		jc->destSize = bufferSize;
+	} else if (lua_isfunction(l, i)) {
+		jc->destType = DESTINATION_FUNCTION;
+		jc->destmgr.init_destination = luajpeg_init_destination;
+		jc->destmgr.empty_output_buffer = luajpeg_empty_output_buffer;
+		jc->destmgr.term_destination = luajpeg_term_destination;
+
+		lua_pushvalue(l, i);
+		registerLuaReference(&jc->destFn, l);
+
+		if (lua_isuserdata(l, i + 1) && !lua_islightuserdata(l, i + 1)) {
+			lua_pushvalue(l, i + 1);
+			registerLuaReference(&jc->buffer, l);
+		} else {
+			size_t bufferSize = (size_t) luaL_optinteger(l, i + 1, 0);
+			if (bufferSize < 2048) {
+				bufferSize = 2048;
+			}
+			(void) lua_newuserdata(l, bufferSize);
+			registerLuaReference(&jc->buffer, l);
+		}
+	} else {
+		luaL_argcheck(l, lua_isnoneornil(l, i), i, "function, file or nil expected");
+		jc->destType = DESTINATION_MEMORY;
+		jc->destmgr.init_destination = luajpeg_init_memory_destination;
+		jc->destmgr.empty_output_buffer = luajpeg_empty_memory_output_buffer;
+		jc->destmgr.term_destination = luajpeg_term_memory_destination;
+		// the initial size defaults to an estimate from the image size and quality, computed when the compression starts
+		size_t bufferSize = (size_t) luaL_optinteger(l, i + 1, 0);
+		if ((bufferSize > 0) && (bufferSize < 2048)) {
+			bufferSize = 2048;
+		}
+		jc->destSize = bufferSize;
+	}
+	return 1;
+}
+
+/*
+* Releases the destination once the compression completes,
+* returns the compressed data and its length for the memory destination.
+*/
+static int luajpeg_compress_push_destination(JpegCompress *jc, lua_State *l) {
+	int nresults = 0;
+	if (jc->destError != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, jc->destError);
+		nresults = 2;
+	} else if (jc->destType == DESTINATION_MEMORY) {
+		size_t length = jc->destLength;
+		char *data = (char *)lua_newuserdata(l, length > 0 ? length : 1);
+		memcpy(data, jc->destData, length);
+		lua_pushinteger(l, length);
+		nresults = 2;
+	}
+	luajpeg_compress_release_destination(jc);
+	return nresults;
+}
+
 static int luajpeg_compress_new(lua_State *l) {
 	JpegCompress *jc = (JpegCompress *)lua_newuserdata(l, sizeof(JpegCompress));
 
@@ -608,20 +2223,59 @@ static int luajpeg_compress_new(lua_State *l) {
 	trace("jpeg_create_compress()\n");
 	jpeg_create_compress(&jc->cinfo);
 
-	// set destination manager
+	// set destination manager, the methods depend on the destination type
 	jc->cinfo.dest = &jc->destmgr;
-	jc->destmgr.init_destination = luajpeg_init_destination;
-	jc->destmgr.empty_output_buffer = luajpeg_empty_output_buffer;
-	jc->destmgr.term_destination = luajpeg_term_destination;
+	jc->destType = DESTINATION_NONE;
 
 	initLuaReference(&jc->buffer);
 	initLuaReference(&jc->destFn);
+	initLuaReference(&jc->destStreamRef);
+
+	jc->destFile = NULL;
+	jc->destStream = NULL;
+
+	jc->destData = NULL;
+	jc->destSize = 0;
+	jc->destLength = 0;
+	jc->destError = NULL;
+
+	jc->rowsPerCall = 0;
 
 	luaL_getmetatable(l, "jpeg_compress");
 	lua_setmetatable(l, -2);
 	return 1;
 }
 
+/*
+* Sets the default parameters with the quality and the luma sampling factors then starts the compression,
+* the image size, the input color space and the destination shall be set.
+*/
+static void luajpeg_compress_start_image(JpegCompress *jc, int quality, int subsampling, int rawData) {
+	trace("jpeg_set_defaults()\n");
+	jpeg_set_defaults(&jc->cinfo);
+
+	//jpeg_set_colorspace(&jc->cinfo, JCS_RGB);
+
+	trace("jpeg_set_quality()\n");
+	jpeg_set_quality(&jc->cinfo, quality, TRUE);
+
+	if ((jc->cinfo.jpeg_color_space == JCS_YCbCr) && (jc->cinfo.num_components == 3)) {
+		jc->cinfo.comp_info[0].h_samp_factor = (subsampling >> 4) & 0xf;
+		jc->cinfo.comp_info[0].v_samp_factor = subsampling & 0xf;
+	}
+	jc->cinfo.raw_data_in = rawData ? TRUE : FALSE;
+#if JPEG_LIB_VERSION >= 70
+	if (rawData) {
+		// the raw planes are sampled using the regular block size
+		jc->cinfo.do_fancy_downsampling = FALSE;
+	}
+#endif
+	memset(jc->rawScratch, 0, sizeof(jc->rawScratch));
+
+	trace("jpeg_start_compress()\n");
+	jpeg_start_compress(&jc->cinfo, TRUE);
+}
+
 static int luajpeg_compress_start(lua_State *l) {
 	trace("luajpeg_compress_start()\n");
 	JpegCompress *jc = (JpegCompress *)luaL_checkudata(l, 1, "jpeg_compress");
@@ -633,40 +2287,29 @@ static int luajpeg_compress_start(lua_State *l) {
 	jc->cinfo.image_width = pi.width;
 	jc->cinfo.image_height = pi.height;
 	jc->cinfo.input_components = pi.components;
+	/*
+	* Raw data mode, the components are provided as separate planes already subsampled,
+	* the color conversion and the downsampling are skipped.
+	*/
+	int rawData = getBooleanField(l, 2, "rawData", 0);
 	// Color space of source image
-	jc->cinfo.in_color_space = checkOptionField(l, 2, "colorSpace", "RGB", JCS_OPTIONS, JCS_VALUES);
+	jc->cinfo.in_color_space = checkOptionField(l, 2, "colorSpace", rawData ? "YCbCr" : "RGB", JCS_OPTIONS, JCS_VALUES);
+	int subsampling = checkOptionField(l, 2, "subsampling", "4:2:0", SUBSAMPLING_OPTIONS, SUBSAMPLING_VALUES);
 
 	jc->bytesPerRow = pi.bytesPerRow;
+	// number of scanlines to write per call, the default is a whole iMCU row
+	jc->rowsPerCall = getIntegerField(l, 2, "rowsPerCall", 0);
 
 	// quality 0-100, default 75, should use 50-95
 	int quality = getIntegerField(l, 2, "quality", 75);
 
-	luaL_checktype(l, 3, LUA_TFUNCTION);
-	lua_pushvalue(l, 3);
-	registerLuaReference(&jc->destFn, l);
-
-	if (lua_isuserdata(l, 4) && !lua_islightuserdata(l, 4)) {
-		lua_pushvalue(l, 4);
-		registerLuaReference(&jc->buffer, l);
-	} else {
-		size_t bufferSize = (size_t) luaL_optinteger(l, 4, 0);
-		if (bufferSize < 2048) {
-			bufferSize = 2048;
-		}
-		(void) lua_newuserdata(l, bufferSize);
-		registerLuaReference(&jc->buffer, l);
+	if (!luajpeg_compress_set_destination(jc, l, 3)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot open destination");
+		return 2;
 	}
 
-	trace("jpeg_set_defaults()\n");
-	jpeg_set_defaults(&jc->cinfo);
-
-	//jpeg_set_colorspace(&jc->cinfo, JCS_RGB);
-
-	trace("jpeg_set_quality()\n");
-	jpeg_set_quality(&jc->cinfo, quality, TRUE);
-
-	trace("jpeg_start_compress()\n");
-	jpeg_start_compress(&jc->cinfo, TRUE);
+	luajpeg_compress_start_image(jc, quality, subsampling, rawData);
 
 	return 0;
 }
@@ -678,7 +2321,7 @@ static int luajpeg_compress_writeMarker(lua_State *l) {
 	size_t markerLength = 0;
 	const JOCTET *markerData = NULL;
 
-	if (!isRegisteredLuaReference(&jc->destFn)) {
+	if (jc->destType == DESTINATION_NONE) {
 		lua_pushnil(l);
 		lua_pushstring(l, "compress not started");
 		return 2;
@@ -698,6 +2341,172 @@ static int luajpeg_compress_writeMarker(lua_State *l) {
 	return 0;
 }
 
+/*
+* Writes the raw data from the planes, the planes are a table of userdata or string, one per component.
+* The optional plane strides default to the plane widths.
+* The rows are padded to whole blocks by replicating the last column and the last row.
+*/
+static int luajpeg_compress_write_raw(JpegCompress *jc, lua_State *l) {
+	JSAMPROW rows[MAX_COMPONENTS][MAX_ROWS_PER_CALL];
+	JSAMPARRAY planes[MAX_COMPONENTS];
+	const unsigned char *planeData[MAX_COMPONENTS];
+	size_t planeStride[MAX_COMPONENTS];
+	size_t planeLength;
+	jpeg_component_info *compptr;
+	JDIMENSION iMCURows = (JDIMENSION) COMPRESS_IMCU_ROWS(&jc->cinfo);
+	JDIMENSION compRows, rawStride, width, height, firstRow, planeRow, row, col;
+	JSAMPROW src, dst;
+	int ci;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	for (ci = 0, compptr = jc->cinfo.comp_info; ci < jc->cinfo.num_components; ci++, compptr++) {
+		planeStride[ci] = compptr->downsampled_width;
+		if (lua_istable(l, 3)) {
+			lua_rawgeti(l, 3, ci + 1);
+			if (lua_isnumber(l, -1)) {
+				planeStride[ci] = (size_t) lua_tointeger(l, -1);
+			}
+			lua_pop(l, 1);
+		}
+		lua_rawgeti(l, 2, ci + 1);
+		if (lua_type(l, -1) == LUA_TSTRING) {
+			planeData[ci] = (const unsigned char *)lua_tolstring(l, -1, &planeLength);
+		} else if (lua_type(l, -1) == LUA_TUSERDATA) {
+			planeData[ci] = (const unsigned char *)lua_touserdata(l, -1);
+			planeLength = lua_rawlen(l, -1);
+		} else {
+			planeData[ci] = NULL;
+			planeLength = 0;
+		}
+		// the plane is kept referenced by the argument table
+		lua_pop(l, 1);
+		if ((planeData[ci] == NULL) || (planeStride[ci] < compptr->downsampled_width)) {
+			lua_pushnil(l);
+			lua_pushfstring(l, "invalid plane %d", ci + 1);
+			return 2;
+		}
+		if (planeLength < planeStride[ci] * compptr->downsampled_height) {
+			lua_pushnil(l);
+			lua_pushfstring(l, "plane %d buffer too small", ci + 1);
+			return 2;
+		}
+		if (jc->rawScratch[ci] == NULL) {
+			// released by libjpeg with the image
+			jc->rawScratch[ci] = (*jc->cinfo.mem->alloc_sarray)((j_common_ptr) &jc->cinfo, JPOOL_IMAGE,
+				COMPONENT_RAW_STRIDE(compptr), (JDIMENSION) COMPONENT_RAW_ROWS(compptr));
+		}
+		planes[ci] = rows[ci];
+	}
+	while (jc->cinfo.next_scanline < jc->cinfo.image_height) {
+		for (ci = 0, compptr = jc->cinfo.comp_info; ci < jc->cinfo.num_components; ci++, compptr++) {
+			compRows = COMPONENT_RAW_ROWS(compptr);
+			rawStride = COMPONENT_RAW_STRIDE(compptr);
+			width = compptr->downsampled_width;
+			height = compptr->downsampled_height;
+			firstRow = jc->cinfo.next_scanline / iMCURows * compRows;
+			for (row = 0; row < compRows; row++) {
+				planeRow = firstRow + row < height ? firstRow + row : height - 1;
+				src = (JSAMPROW) (planeData[ci] + planeRow * planeStride[ci]);
+				if (width == rawStride) {
+					// the row is already padded, libjpeg does not modify the input rows
+					rows[ci][row] = src;
+				} else {
+					dst = jc->rawScratch[ci][row];
+					memcpy(dst, src, width);
+					for (col = width; col < rawStride; col++) {
+						dst[col] = dst[width - 1];
+					}
+					rows[ci][row] = dst;
+				}
+			}
+		}
+		(void) jpeg_write_raw_data(&jc->cinfo, planes, iMCURows);
+	}
+	return 0;
+}
+
+/*
+* Writes rows from consecutive rows data, by rows per call.
+*/
+static void luajpeg_compress_write_rows(JpegCompress *jc, const char *data, JDIMENSION rowCount) {
+	JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+	JDIMENSION rowsPerCall = (JDIMENSION) luajpeg_compress_rows_per_call(jc);
+	JDIMENSION count, i;
+	trace("bytesPerRow: %d\n", jc->bytesPerRow);
+	trace("rowsPerCall: %d\n", rowsPerCall);
+	while (rowCount > 0) {
+		count = rowCount > rowsPerCall ? rowsPerCall : rowCount;
+		for (i = 0; i < count; i++) {
+			row_pointer[i] = (JSAMPROW) (data + i * jc->bytesPerRow);
+		}
+		(void) jpeg_write_scanlines(&jc->cinfo, row_pointer, count);
+		data += count * jc->bytesPerRow;
+		rowCount -= count;
+	}
+}
+
+/*
+* Writes the rows of the strip at the specified index, the row count at the next index defaults to the strip rows.
+* The rows after the last image row are ignored.
+*/
+static int luajpeg_compress_write_strip(JpegCompress *jc, lua_State *l, int i) {
+	size_t stripLength = 0;
+	const char *stripData = NULL;
+	if (lua_isstring(l, i)) {
+		stripData = lua_tolstring(l, i, &stripLength);
+	} else if (lua_isuserdata(l, i) && !lua_islightuserdata(l, i)) {
+		stripLength = lua_rawlen(l, i);
+		stripData = (const char *)lua_touserdata(l, i);
+	} else {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid strip");
+		return 2;
+	}
+	lua_Integer rowCount = luaL_optinteger(l, i + 1, (lua_Integer) (stripLength / jc->bytesPerRow));
+	if ((rowCount < 0) || ((size_t) rowCount * jc->bytesPerRow > stripLength)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "strip buffer too small");
+		return 2;
+	}
+	JDIMENSION remainingRows = jc->cinfo.image_height - jc->cinfo.next_scanline;
+	luajpeg_compress_write_rows(jc, stripData, rowCount > (lua_Integer) remainingRows ? remainingRows : (JDIMENSION) rowCount);
+	return 0;
+}
+
+/*
+* Compresses the rows returned by the producer function at index 2, the function is called with the next row
+* and returns a strip with an optional row count, until all the rows are written.
+*/
+static int luajpeg_compress_run_producer(JpegCompress *jc, lua_State *l) {
+	int status;
+	while (jc->cinfo.next_scanline < jc->cinfo.image_height) {
+		lua_pushvalue(l, 2);
+		lua_pushinteger(l, jc->cinfo.next_scanline);
+		if (lua_pcall(l, 1, 2, 0) != 0) {
+			jpeg_abort_compress(&jc->cinfo);
+			luajpeg_compress_release_destination(jc);
+			lua_pushnil(l);
+			lua_insert(l, -2);
+			return 2;
+		}
+		JDIMENSION nextRow = jc->cinfo.next_scanline;
+		status = luajpeg_compress_write_strip(jc, l, lua_gettop(l) - 1);
+		if ((status == 0) && (jc->cinfo.next_scanline == nextRow)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "missing rows");
+			status = 2;
+		}
+		if (status != 0) {
+			jpeg_abort_compress(&jc->cinfo);
+			luajpeg_compress_release_destination(jc);
+			return status;
+		}
+		lua_pop(l, 2);
+	}
+	trace("jpeg_finish_compress()\n");
+	jpeg_finish_compress(&jc->cinfo);
+	return luajpeg_compress_push_destination(jc, l);
+}
+
 static int luajpeg_compress_run(lua_State *l) {
 	trace("luajpeg_compress_run()\n");
 	JpegCompress *jc = (JpegCompress *)luaL_checkudata(l, 1, "jpeg_compress");
@@ -705,12 +2514,25 @@ static int luajpeg_compress_run(lua_State *l) {
 	size_t imageLength = 0;
 	const char *imageData = NULL;
 
-	if (!isRegisteredLuaReference(&jc->destFn)) {
+	if (jc->destType == DESTINATION_NONE) {
 		lua_pushnil(l);
 		lua_pushstring(l, "compress not started");
 		return 2;
 	}
 
+	if (jc->cinfo.raw_data_in) {
+		int status = luajpeg_compress_write_raw(jc, l);
+		if (status != 0) {
+			return status;
+		}
+		trace("jpeg_finish_compress()\n");
+		jpeg_finish_compress(&jc->cinfo);
+		return luajpeg_compress_push_destination(jc, l);
+	}
+
+	if (lua_isfunction(l, 2)) {
+		return luajpeg_compress_run_producer(jc, l);
+	}
 	if (lua_isstring(l, 2)) {
 		imageData = luaL_checklstring(l, 2, &imageLength);
 	} else {
@@ -726,19 +2548,42 @@ static int luajpeg_compress_run(lua_State *l) {
 		return 2;
 	}
 
-	JSAMPROW row_pointer[1];
-	trace("bytesPerRow: %d\n", jc->bytesPerRow);
-	while (jc->cinfo.next_scanline < jc->cinfo.image_height) {
-		row_pointer[0] = (JSAMPROW) (imageData + jc->cinfo.next_scanline * jc->bytesPerRow);
-		(void) jpeg_write_scanlines(&jc->cinfo, row_pointer, 1);
-	}
+	luajpeg_compress_write_rows(jc, imageData + jc->cinfo.next_scanline * jc->bytesPerRow,
+		jc->cinfo.image_height - jc->cinfo.next_scanline);
 
 	trace("jpeg_finish_compress()\n");
 	jpeg_finish_compress(&jc->cinfo);
 
-	unregisterLuaReference(&jc->destFn);
-	unregisterLuaReference(&jc->buffer);
-	return 0;
+	return luajpeg_compress_push_destination(jc, l);
+}
+
+/*
+* Compresses the rows of a strip, the compression completes with the last image row.
+* The rows are then returned for the memory destination.
+*/
+static int luajpeg_compress_rows(lua_State *l) {
+	trace("luajpeg_compress_rows()\n");
+	JpegCompress *jc = (JpegCompress *)luaL_checkudata(l, 1, "jpeg_compress");
+	if (jc->destType == DESTINATION_NONE) {
+		lua_pushnil(l);
+		lua_pushstring(l, "compress not started");
+		return 2;
+	}
+	if (jc->cinfo.raw_data_in) {
+		lua_pushnil(l);
+		lua_pushstring(l, "raw data not supported by strips");
+		return 2;
+	}
+	int status = luajpeg_compress_write_strip(jc, l, 2);
+	if (status != 0) {
+		return status;
+	}
+	if (jc->cinfo.next_scanline < jc->cinfo.image_height) {
+		return 0;
+	}
+	trace("jpeg_finish_compress()\n");
+	jpeg_finish_compress(&jc->cinfo);
+	return luajpeg_compress_push_destination(jc, l);
 }
 
 static int luajpeg_compress_gc(lua_State *l) {
@@ -746,8 +2591,7 @@ static int luajpeg_compress_gc(lua_State *l) {
 	if (jc != NULL) {
 		trace("jpeg_destroy_compress()\n");
 		jpeg_destroy_compress(&jc->cinfo);
-		unregisterLuaReference(&jc->buffer);
-		unregisterLuaReference(&jc->destFn);
+		luajpeg_compress_release_destination(jc);
 	}
 	return 0;
 }
@@ -755,486 +2599,4533 @@ static int luajpeg_compress_gc(lua_State *l) {
 
 /*
 ********************************************************************************
-* Image manipulation functions
+* JPEG Transform functions
 ********************************************************************************
 */
 
+/*
+* The lossless transformations work on the DCT coefficients, as jpegtran does.
+* A block is mirrored horizontally by negating its odd columns and vertically by negating its odd rows,
+* the rotations are a transposition followed by a mirroring.
+* Only whole iMCUs can be mirrored, the partial iMCUs on the mirrored edges are either left in place or trimmed.
+*/
+
+#define TRANSFORM_NONE 0
+#define TRANSFORM_ROT_90 1
+#define TRANSFORM_ROT_180 2
+#define TRANSFORM_ROT_270 3
+#define TRANSFORM_FLIP_H 4
+#define TRANSFORM_FLIP_V 5
+#define TRANSFORM_TRANSPOSE 6
+#define TRANSFORM_TRANSVERSE 7
+
+#define TRANSFORM_IS_TRANSPOSED(_mode) (((_mode) == TRANSFORM_ROT_90) || ((_mode) == TRANSFORM_ROT_270) || \
+	((_mode) == TRANSFORM_TRANSPOSE) || ((_mode) == TRANSFORM_TRANSVERSE))
+
+// runStep while reading the coefficients of a transformation
+#define TRANSFORM_RUN_STEP 7
+
+/*
+* The crop region is aligned on the source iMCU grid, its origin is expressed in iMCUs.
+*/
+typedef struct TransformCropStruct {
+	int enabled;
+	JDIMENSION x;
+	JDIMENSION y;
+	JDIMENSION width;
+	JDIMENSION height;
+} TransformCrop;
+
+static void luajpeg_transform_source_imcu_size(j_decompress_ptr cinfo, JDIMENSION *width, JDIMENSION *height) {
+#if JPEG_LIB_VERSION >= 70
+	*width = (JDIMENSION) (cinfo->max_h_samp_factor * cinfo->min_DCT_h_scaled_size);
+	*height = (JDIMENSION) (cinfo->max_v_samp_factor * cinfo->min_DCT_v_scaled_size);
+#else
+	*width = (JDIMENSION) (cinfo->max_h_samp_factor * cinfo->min_DCT_scaled_size);
+	*height = (JDIMENSION) (cinfo->max_v_samp_factor * cinfo->min_DCT_scaled_size);
+#endif
+}
+
+/*
+* Reads the crop region from the option table field, the region origin is moved back to the iMCU grid
+* and the region is extended accordingly, then clipped to the image.
+* Returns 0 if the region is empty or outside the image.
+*/
+static int luajpeg_transform_get_crop(lua_State *l, int i, j_decompress_ptr srcinfo, TransformCrop *crop) {
+	JDIMENSION iMCUWidth, iMCUHeight;
+	long x, y, width, height;
+	crop->enabled = FALSE;
+	if (!lua_istable(l, i)) {
+		return 1;
+	}
+	lua_getfield(l, i, "crop");
+	if (!lua_istable(l, -1)) {
+		lua_pop(l, 1);
+		return 1;
+	}
+	x = getLongField(l, -1, "x", 0);
+	y = getLongField(l, -1, "y", 0);
+	width = getLongField(l, -1, "width", (long) srcinfo->image_width - x);
+	height = getLongField(l, -1, "height", (long) srcinfo->image_height - y);
+	lua_pop(l, 1);
+	if ((x < 0) || (y < 0) || (width <= 0) || (height <= 0) ||
+			(x >= (long) srcinfo->image_width) || (y >= (long) srcinfo->image_height)) {
+		return 0;
+	}
+	luajpeg_transform_source_imcu_size(srcinfo, &iMCUWidth, &iMCUHeight);
+	crop->enabled = TRUE;
+	crop->x = (JDIMENSION) x / iMCUWidth;
+	crop->y = (JDIMENSION) y / iMCUHeight;
+	width += x - crop->x * iMCUWidth;
+	height += y - crop->y * iMCUHeight;
+	x = crop->x * iMCUWidth;
+	y = crop->y * iMCUHeight;
+	crop->width = (JDIMENSION) (x + width > (long) srcinfo->image_width ? (long) srcinfo->image_width - x : width);
+	crop->height = (JDIMENSION) (y + height > (long) srcinfo->image_height ? (long) srcinfo->image_height - y : height);
+	return 1;
+}
+
+static void luajpeg_transform_imcu_size(j_compress_ptr cinfo, JDIMENSION *width, JDIMENSION *height) {
+	int ci, maxh = 1, maxv = 1;
+	// the max sampling factors are not yet computed before jpeg_write_coefficients()
+	for (ci = 0; ci < cinfo->num_components; ci++) {
+		if (cinfo->comp_info[ci].h_samp_factor > maxh) {
+			maxh = cinfo->comp_info[ci].h_samp_factor;
+		}
+		if (cinfo->comp_info[ci].v_samp_factor > maxv) {
+			maxv = cinfo->comp_info[ci].v_samp_factor;
+		}
+	}
+#if JPEG_LIB_VERSION >= 70
+	*width = (JDIMENSION) (maxh * cinfo->min_DCT_h_scaled_size);
+	*height = (JDIMENSION) (maxv * cinfo->min_DCT_v_scaled_size);
+#else
+	*width = (JDIMENSION) (maxh * DCTSIZE);
+	*height = (JDIMENSION) (maxv * DCTSIZE);
+#endif
+}
+
+static JDIMENSION roundUp(JDIMENSION value, JDIMENSION divisor) {
+	return (value + divisor - 1) / divisor * divisor;
+}
+
+static void transposeBlock(JCOEFPTR src, JCOEFPTR dst) {
+	int i, j;
+	for (i = 0; i < DCTSIZE; i++) {
+		for (j = 0; j < DCTSIZE; j++) {
+			dst[j * DCTSIZE + i] = src[i * DCTSIZE + j];
+		}
+	}
+}
+
+/*
+* Transposes the block then mirrors it, the signs of the odd destination rows and columns are changed
+* according to the mirroring.
+*/
+static void transposeMirrorBlock(JCOEFPTR src, JCOEFPTR dst, int mirrorH, int mirrorV) {
+	int i, j;
+	JCOEF c;
+	for (i = 0; i < DCTSIZE; i++) {
+		for (j = 0; j < DCTSIZE; j++) {
+			c = src[i * DCTSIZE + j];
+			// the source row i becomes the destination column i
+			if ((mirrorH && (i & 1)) != (mirrorV && (j & 1))) {
+				c = -c;
+			}
+			dst[j * DCTSIZE + i] = c;
+		}
+	}
+}
+
+static void mirrorBlock(JCOEFPTR src, JCOEFPTR dst, int mirrorH, int mirrorV) {
+	int i, j;
+	JCOEF c;
+	for (i = 0; i < DCTSIZE; i++) {
+		for (j = 0; j < DCTSIZE; j++) {
+			c = src[i * DCTSIZE + j];
+			if ((mirrorH && (j & 1)) != (mirrorV && (i & 1))) {
+				c = -c;
+			}
+			dst[i * DCTSIZE + j] = c;
+		}
+	}
+}
+
+/*
+* Horizontal flip, done in place by swapping pairs of blocks.
+*/
+static void luajpeg_transform_flip_h(j_decompress_ptr srcinfo, j_compress_ptr dstinfo, jvirt_barray_ptr *srcCoefArrays) {
+	JDIMENSION iMCUWidth, iMCUHeight, compWidth, blkX, blkY;
+	int ci, k, offsetY;
+	JBLOCKARRAY buffer;
+	JCOEFPTR ptr1, ptr2;
+	JCOEF temp1, temp2;
+	jpeg_component_info *compptr;
+	luajpeg_transform_imcu_size(dstinfo, &iMCUWidth, &iMCUHeight);
+	for (ci = 0, compptr = dstinfo->comp_info; ci < dstinfo->num_components; ci++, compptr++) {
+		compWidth = dstinfo->image_width / iMCUWidth * compptr->h_samp_factor;
+		for (blkY = 0; blkY < compptr->height_in_blocks; blkY += compptr->v_samp_factor) {
+			buffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, srcCoefArrays[ci], blkY,
+				(JDIMENSION) compptr->v_samp_factor, TRUE);
+			for (offsetY = 0; offsetY < compptr->v_samp_factor; offsetY++) {
+				for (blkX = 0; blkX * 2 < compWidth; blkX++) {
+					ptr1 = buffer[offsetY][blkX];
+					ptr2 = buffer[offsetY][compWidth - blkX - 1];
+					// the middle block is swapped with itself
+					for (k = 0; k < DCTSIZE2; k += 2) {
+						temp1 = ptr1[k];
+						temp2 = ptr2[k];
+						ptr1[k] = temp2;
+						ptr2[k] = temp1;
+						temp1 = ptr1[k + 1];
+						temp2 = ptr2[k + 1];
+						ptr1[k + 1] = -temp2;
+						ptr2[k + 1] = -temp1;
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+* Vertical flip and 180 rotation, the block rows are mirrored then the blocks are mirrored in each row.
+*/
+static void luajpeg_transform_mirror(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		jvirt_barray_ptr *srcCoefArrays, jvirt_barray_ptr *dstCoefArrays, int mirrorH) {
+	JDIMENSION iMCUWidth, iMCUHeight, compWidth, compHeight, blkX, blkY, srcBlkX;
+	int ci, offsetY, inRows;
+	JBLOCKARRAY srcBuffer, dstBuffer;
+	JBLOCKROW srcRow, dstRow;
+	jpeg_component_info *compptr;
+	luajpeg_transform_imcu_size(dstinfo, &iMCUWidth, &iMCUHeight);
+	for (ci = 0, compptr = dstinfo->comp_info; ci < dstinfo->num_components; ci++, compptr++) {
+		compWidth = mirrorH ? dstinfo->image_width / iMCUWidth * compptr->h_samp_factor : 0;
+		compHeight = dstinfo->image_height / iMCUHeight * compptr->v_samp_factor;
+		for (blkY = 0; blkY < compptr->height_in_blocks; blkY += compptr->v_samp_factor) {
+			dstBuffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, dstCoefArrays[ci], blkY,
+				(JDIMENSION) compptr->v_samp_factor, TRUE);
+			// the bottom edge rows are not mirrored
+			inRows = blkY < compHeight;
+			srcBuffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, srcCoefArrays[ci],
+				inRows ? compHeight - blkY - compptr->v_samp_factor : blkY,
+				(JDIMENSION) compptr->v_samp_factor, FALSE);
+			for (offsetY = 0; offsetY < compptr->v_samp_factor; offsetY++) {
+				dstRow = dstBuffer[offsetY];
+				srcRow = srcBuffer[inRows ? compptr->v_samp_factor - offsetY - 1 : offsetY];
+				for (blkX = 0; blkX < compptr->width_in_blocks; blkX++) {
+					// the right edge blocks are not mirrored
+					srcBlkX = blkX < compWidth ? compWidth - blkX - 1 : blkX;
+					mirrorBlock(srcRow[srcBlkX], dstRow[blkX], blkX < compWidth, inRows);
+				}
+			}
+		}
+	}
+}
+
+/*
+* Transposition and 90, 270 rotations and transverse, each destination block comes from the transposed source block,
+* the destination block position is then mirrored.
+*/
+static void luajpeg_transform_transpose(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		jvirt_barray_ptr *srcCoefArrays, jvirt_barray_ptr *dstCoefArrays, int mirrorH, int mirrorV) {
+	JDIMENSION iMCUWidth, iMCUHeight, compWidth, compHeight, blkX, blkY, srcBlkY, dstBlkX;
+	int ci, offsetX, offsetY, inCols, inRows;
+	JBLOCKARRAY srcBuffer, dstBuffer;
+	jpeg_component_info *compptr;
+	luajpeg_transform_imcu_size(dstinfo, &iMCUWidth, &iMCUHeight);
+	for (ci = 0, compptr = dstinfo->comp_info; ci < dstinfo->num_components; ci++, compptr++) {
+		compWidth = mirrorH ? dstinfo->image_width / iMCUWidth * compptr->h_samp_factor : 0;
+		compHeight = mirrorV ? dstinfo->image_height / iMCUHeight * compptr->v_samp_factor : 0;
+		for (blkY = 0; blkY < compptr->height_in_blocks; blkY += compptr->v_samp_factor) {
+			dstBuffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, dstCoefArrays[ci], blkY,
+				(JDIMENSION) compptr->v_samp_factor, TRUE);
+			for (offsetY = 0; offsetY < compptr->v_samp_factor; offsetY++) {
+				inRows = blkY < compHeight;
+				srcBlkY = inRows ? compHeight - blkY - offsetY - 1 : blkY + offsetY;
+				for (blkX = 0; blkX < compptr->width_in_blocks; blkX += compptr->h_samp_factor) {
+					// the source rows are the destination columns
+					srcBuffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, srcCoefArrays[ci], blkX,
+						(JDIMENSION) compptr->h_samp_factor, FALSE);
+					inCols = blkX < compWidth;
+					for (offsetX = 0; offsetX < compptr->h_samp_factor; offsetX++) {
+						dstBlkX = inCols ? compWidth - blkX - offsetX - 1 : blkX + offsetX;
+						if (inCols || inRows) {
+							transposeMirrorBlock(srcBuffer[offsetX][srcBlkY], dstBuffer[offsetY][dstBlkX], inCols, inRows);
+						} else {
+							transposeBlock(srcBuffer[offsetX][srcBlkY], dstBuffer[offsetY][dstBlkX]);
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+* Copies the blocks of the crop region.
+*/
+static void luajpeg_transform_crop(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		jvirt_barray_ptr *srcCoefArrays, jvirt_barray_ptr *dstCoefArrays, TransformCrop *crop) {
+	JDIMENSION blkY, cropX, cropY;
+	int ci, offsetY;
+	JBLOCKARRAY srcBuffer, dstBuffer;
+	jpeg_component_info *compptr;
+	for (ci = 0, compptr = dstinfo->comp_info; ci < dstinfo->num_components; ci++, compptr++) {
+		cropX = crop->x * compptr->h_samp_factor;
+		cropY = crop->y * compptr->v_samp_factor;
+		for (blkY = 0; blkY < compptr->height_in_blocks; blkY += compptr->v_samp_factor) {
+			dstBuffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, dstCoefArrays[ci], blkY,
+				(JDIMENSION) compptr->v_samp_factor, TRUE);
+			srcBuffer = (*srcinfo->mem->access_virt_barray)((j_common_ptr) srcinfo, srcCoefArrays[ci], blkY + cropY,
+				(JDIMENSION) compptr->v_samp_factor, FALSE);
+			for (offsetY = 0; offsetY < compptr->v_samp_factor; offsetY++) {
+				memcpy(dstBuffer[offsetY][0], srcBuffer[offsetY][cropX], compptr->width_in_blocks * sizeof(JBLOCK));
+			}
+		}
+	}
+}
+
+/*
+* Requests the destination coefficient arrays, must be called before jpeg_read_coefficients().
+* The horizontal flip is done in place and does not need any.
+*/
+static jvirt_barray_ptr *luajpeg_transform_request_arrays(j_decompress_ptr srcinfo, int mode, TransformCrop *crop) {
+	JDIMENSION iMCUWidth, iMCUHeight;
+	jvirt_barray_ptr *coefArrays;
+	jpeg_component_info *compptr;
+	int ci;
+	if ((mode == TRANSFORM_NONE) && !crop->enabled) {
+		return NULL;
+	}
+	if (mode == TRANSFORM_FLIP_H) {
+		return NULL;
+	}
+	luajpeg_transform_source_imcu_size(srcinfo, &iMCUWidth, &iMCUHeight);
+	coefArrays = (jvirt_barray_ptr *) (*srcinfo->mem->alloc_small)((j_common_ptr) srcinfo, JPOOL_IMAGE,
+		sizeof(jvirt_barray_ptr) * srcinfo->num_components);
+	for (ci = 0, compptr = srcinfo->comp_info; ci < srcinfo->num_components; ci++, compptr++) {
+		if (crop->enabled) {
+			coefArrays[ci] = (*srcinfo->mem->request_virt_barray)((j_common_ptr) srcinfo, JPOOL_IMAGE, FALSE,
+				(crop->width + iMCUWidth - 1) / iMCUWidth * (JDIMENSION) compptr->h_samp_factor,
+				(crop->height + iMCUHeight - 1) / iMCUHeight * (JDIMENSION) compptr->v_samp_factor,
+				(JDIMENSION) compptr->v_samp_factor);
+		} else if (TRANSFORM_IS_TRANSPOSED(mode)) {
+			coefArrays[ci] = (*srcinfo->mem->request_virt_barray)((j_common_ptr) srcinfo, JPOOL_IMAGE, FALSE,
+				roundUp(compptr->height_in_blocks, (JDIMENSION) compptr->v_samp_factor),
+				roundUp(compptr->width_in_blocks, (JDIMENSION) compptr->h_samp_factor),
+				(JDIMENSION) compptr->h_samp_factor);
+		} else {
+			coefArrays[ci] = (*srcinfo->mem->request_virt_barray)((j_common_ptr) srcinfo, JPOOL_IMAGE, FALSE,
+				roundUp(compptr->width_in_blocks, (JDIMENSION) compptr->h_samp_factor),
+				roundUp(compptr->height_in_blocks, (JDIMENSION) compptr->v_samp_factor),
+				(JDIMENSION) compptr->v_samp_factor);
+		}
+	}
+	return coefArrays;
+}
+
+/*
+* Adjusts the destination parameters copied from the source, the dimensions, the sampling factors
+* and the quantization tables are transposed and the partial iMCUs on the mirrored edges are trimmed.
+*/
+static void luajpeg_transform_adjust_parameters(j_compress_ptr dstinfo, int mode, int trim, TransformCrop *crop) {
+	JDIMENSION iMCUWidth, iMCUHeight, jtemp;
+	JQUANT_TBL *qtblptr;
+	int ci, tblno, i, j, itemp;
+	UINT16 qtemp;
+	if (crop->enabled) {
+		dstinfo->image_width = crop->width;
+		dstinfo->image_height = crop->height;
+	}
+	if (TRANSFORM_IS_TRANSPOSED(mode)) {
+		jtemp = dstinfo->image_width;
+		dstinfo->image_width = dstinfo->image_height;
+		dstinfo->image_height = jtemp;
+#if JPEG_LIB_VERSION >= 70
+		itemp = dstinfo->min_DCT_h_scaled_size;
+		dstinfo->min_DCT_h_scaled_size = dstinfo->min_DCT_v_scaled_size;
+		dstinfo->min_DCT_v_scaled_size = itemp;
+#endif
+		for (ci = 0; ci < dstinfo->num_components; ci++) {
+			itemp = dstinfo->comp_info[ci].h_samp_factor;
+			dstinfo->comp_info[ci].h_samp_factor = dstinfo->comp_info[ci].v_samp_factor;
+			dstinfo->comp_info[ci].v_samp_factor = itemp;
+		}
+		for (tblno = 0; tblno < NUM_QUANT_TBLS; tblno++) {
+			qtblptr = dstinfo->quant_tbl_ptrs[tblno];
+			if (qtblptr != NULL) {
+				for (i = 0; i < DCTSIZE; i++) {
+					for (j = 0; j < i; j++) {
+						qtemp = qtblptr->quantval[i * DCTSIZE + j];
+						qtblptr->quantval[i * DCTSIZE + j] = qtblptr->quantval[j * DCTSIZE + i];
+						qtblptr->quantval[j * DCTSIZE + i] = qtemp;
+					}
+				}
+			}
+		}
+	}
+	if (trim) {
+		luajpeg_transform_imcu_size(dstinfo, &iMCUWidth, &iMCUHeight);
+		if ((mode == TRANSFORM_FLIP_H) || (mode == TRANSFORM_ROT_90) || (mode == TRANSFORM_ROT_180) || (mode == TRANSFORM_TRANSVERSE)) {
+			if (dstinfo->image_width >= iMCUWidth) {
+				dstinfo->image_width = dstinfo->image_width / iMCUWidth * iMCUWidth;
+			}
+		}
+		if ((mode == TRANSFORM_FLIP_V) || (mode == TRANSFORM_ROT_270) || (mode == TRANSFORM_ROT_180) || (mode == TRANSFORM_TRANSVERSE)) {
+			if (dstinfo->image_height >= iMCUHeight) {
+				dstinfo->image_height = dstinfo->image_height / iMCUHeight * iMCUHeight;
+			}
+		}
+	}
+#if JPEG_LIB_VERSION >= 80
+	dstinfo->jpeg_width = dstinfo->image_width;
+	dstinfo->jpeg_height = dstinfo->image_height;
+#endif
+}
+
+static void luajpeg_transform_execute(j_decompress_ptr srcinfo, j_compress_ptr dstinfo,
+		jvirt_barray_ptr *srcCoefArrays, jvirt_barray_ptr *dstCoefArrays, int mode, TransformCrop *crop) {
+	if (crop->enabled) {
+		luajpeg_transform_crop(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, crop);
+		return;
+	}
+	switch (mode) {
+	case TRANSFORM_FLIP_H:
+		luajpeg_transform_flip_h(srcinfo, dstinfo, srcCoefArrays);
+		break;
+	case TRANSFORM_FLIP_V:
+		luajpeg_transform_mirror(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, FALSE);
+		break;
+	case TRANSFORM_ROT_180:
+		luajpeg_transform_mirror(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, TRUE);
+		break;
+	case TRANSFORM_TRANSPOSE:
+		luajpeg_transform_transpose(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, FALSE, FALSE);
+		break;
+	case TRANSFORM_ROT_90:
+		luajpeg_transform_transpose(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, TRUE, FALSE);
+		break;
+	case TRANSFORM_ROT_270:
+		luajpeg_transform_transpose(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, FALSE, TRUE);
+		break;
+	case TRANSFORM_TRANSVERSE:
+		luajpeg_transform_transpose(srcinfo, dstinfo, srcCoefArrays, dstCoefArrays, TRUE, TRUE);
+		break;
+	}
+}
+
+static unsigned int getExifShort(const JOCTET *p, int bigEndian) {
+	return bigEndian ? ((p[0] << 8) | p[1]) : ((p[1] << 8) | p[0]);
+}
+
+static unsigned long getExifLong(const JOCTET *p, int bigEndian) {
+	return bigEndian ? (((unsigned long) getExifShort(p, 1) << 16) | getExifShort(p + 2, 1)) :
+		(((unsigned long) getExifShort(p + 2, 0) << 16) | getExifShort(p, 0));
+}
+
+/*
+* Resets the Exif orientation tag to the normal orientation, the image being already transformed.
+*/
+static void resetExifOrientation(JOCTET *data, unsigned int length) {
+	const JOCTET EXIF_HEADER[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+	JOCTET *tiff = data + 6;
+	unsigned int tiffLength, count, i;
+	unsigned long offset;
+	int bigEndian;
+	if ((length < 6 + 8) || (memcmp(data, EXIF_HEADER, 6) != 0)) {
+		return;
+	}
+	tiffLength = length - 6;
+	if ((tiff[0] == 'M') && (tiff[1] == 'M')) {
+		bigEndian = 1;
+	} else if ((tiff[0] == 'I') && (tiff[1] == 'I')) {
+		bigEndian = 0;
+	} else {
+		return;
+	}
+	// the first IFD contains the orientation
+	offset = getExifLong(tiff + 4, bigEndian);
+	if ((offset + 2 > tiffLength) || (offset < 8)) {
+		return;
+	}
+	count = getExifShort(tiff + offset, bigEndian);
+	offset += 2;
+	for (i = 0; (i < count) && (offset + 12 <= tiffLength); i++, offset += 12) {
+		if ((getExifShort(tiff + offset, bigEndian) == 0x0112) && (getExifShort(tiff + offset + 2, bigEndian) == 3)) {
+			tiff[offset + 8] = bigEndian ? 0 : 1;
+			tiff[offset + 9] = bigEndian ? 1 : 0;
+			return;
+		}
+	}
+}
+
+/*
+* Copies the saved markers, except the JFIF and Adobe markers that are written by libjpeg.
+*/
+static void luajpeg_transform_copy_markers(j_decompress_ptr srcinfo, j_compress_ptr dstinfo, int resetOrientation) {
+	jpeg_saved_marker_ptr marker;
+	for (marker = srcinfo->marker_list; marker != NULL; marker = marker->next) {
+		if (dstinfo->write_JFIF_header && (marker->marker == JPEG_APP0) && (marker->data_length >= 5) &&
+				(memcmp(marker->data, "JFIF", 5) == 0)) {
+			continue;
+		}
+		if (dstinfo->write_Adobe_marker && (marker->marker == JPEG_APP0 + 14) && (marker->data_length >= 5) &&
+				(memcmp(marker->data, "Adobe", 5) == 0)) {
+			continue;
+		}
+		if (resetOrientation && (marker->marker == JPEG_APP0 + 1)) {
+			resetExifOrientation(marker->data, marker->data_length);
+		}
+		jpeg_write_marker(dstinfo, marker->marker, marker->data, marker->data_length);
+	}
+}
+
+/*
+* Transforms the source JPEG image into the destination without decoding it.
+* The options are the rotation, including transpose and transverse, the trimming of the partial edge iMCUs,
+* the crop region, the copy of the markers, the reset of their EXIF orientation and the Huffman table optimization.
+* The orientation is reset by default for the rotations, transpose and transverse, not for the flips nor the crop.
+* The crop region starts on the iMCU grid and cannot be combined with a rotation.
+* The decompress shall have its source filled and may have its header read, the compress shall not be started.
+* When the source suspends, the transformation shall be called again with the same options.
+*/
+static int luajpeg_transform(lua_State *l) {
+	trace("luajpeg_transform()\n");
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+	JpegCompress *jc = (JpegCompress *)luaL_checkudata(l, 2, "jpeg_compress");
+
+	int mode = TRANSFORM_NONE;
+	int trim = FALSE;
+	int copyMarkers = TRUE;
+	int resetOrientation = FALSE;
+	int optimize = FALSE;
+	if (lua_istable(l, 3)) {
+		mode = checkOptionField(l, 3, "rotate", "none", ROTATE_OPTIONS, ROTATE_VALUES);
+		trim = getBooleanField(l, 3, "trim", trim);
+		copyMarkers = getBooleanField(l, 3, "copyMarkers", copyMarkers);
+		// the rotations usually apply the orientation, the flips are usually intended
+		resetOrientation = getBooleanField(l, 3, "resetOrientation",
+			(mode != TRANSFORM_NONE) && (mode != TRANSFORM_FLIP_H) && (mode != TRANSFORM_FLIP_V));
+		optimize = getBooleanField(l, 3, "optimize", optimize);
+	}
+	if ((mode < TRANSFORM_NONE) || (mode > TRANSFORM_TRANSVERSE)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "unsupported rotation");
+		return 2;
+	}
+	if (jc->destType != DESTINATION_NONE) {
+		lua_pushnil(l);
+		lua_pushstring(l, "compress already started");
+		return 2;
+	}
+	if ((jd->runStep > 2) && (jd->runStep != TRANSFORM_RUN_STEP)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "decompress already started");
+		return 2;
+	}
+
+	if (jd->runStep == 0) {
+		if (copyMarkers) {
+			luajpeg_decompress_save_markers(&jd->cinfo);
+		}
+		jd->runStep++;
+	}
+	if (jd->runStep == 1) {
+		trace("jpeg_read_header()\n");
+		if (jpeg_read_header(&jd->cinfo, TRUE) == JPEG_SUSPENDED) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+		jd->runStep++;
+	}
+	TransformCrop crop;
+	if (!luajpeg_transform_get_crop(l, 3, &jd->cinfo, &crop)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid crop region");
+		return 2;
+	}
+	if (crop.enabled && (mode != TRANSFORM_NONE)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "crop cannot be combined with rotate");
+		return 2;
+	}
+	if (jd->runStep == 2) {
+		jd->transformArrays = luajpeg_transform_request_arrays(&jd->cinfo, mode, &crop);
+		jd->runStep = TRANSFORM_RUN_STEP;
+	}
+
+	trace("jpeg_read_coefficients()\n");
+	jvirt_barray_ptr *srcCoefArrays = jpeg_read_coefficients(&jd->cinfo);
+	if (srcCoefArrays == NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, "suspended");
+		return 2;
+	}
+	jvirt_barray_ptr *dstCoefArrays = jd->transformArrays != NULL ? jd->transformArrays : srcCoefArrays;
+
+	trace("jpeg_copy_critical_parameters()\n");
+	jpeg_copy_critical_parameters(&jd->cinfo, &jc->cinfo);
+	jc->cinfo.optimize_coding = optimize ? TRUE : FALSE;
+	luajpeg_transform_adjust_parameters(&jc->cinfo, mode, trim, &crop);
+
+	int status = 0;
+	if (luajpeg_compress_set_destination(jc, l, 4)) {
+		trace("jpeg_write_coefficients()\n");
+		jpeg_write_coefficients(&jc->cinfo, dstCoefArrays);
+		if (copyMarkers) {
+			luajpeg_transform_copy_markers(&jd->cinfo, &jc->cinfo, resetOrientation);
+		}
+		luajpeg_transform_execute(&jd->cinfo, &jc->cinfo, srcCoefArrays, dstCoefArrays, mode, &crop);
+		trace("jpeg_finish_compress()\n");
+		jpeg_finish_compress(&jc->cinfo);
+		status = luajpeg_compress_push_destination(jc, l);
+	} else {
+		jpeg_abort_compress(&jc->cinfo);
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot open destination");
+		status = 2;
+	}
+
+	// the whole input has been read, up to the EOI marker
+	trace("jpeg_finish_decompress()\n");
+	jpeg_finish_decompress(&jd->cinfo);
+	jd->transformArrays = NULL;
+	jd->runStep = 0;
+	if (jd->srcType == SOURCE_LUA) {
+		luajpeg_reset_source_data(jd);
+	}
+	return status;
+}
+
+
+/*
+********************************************************************************
+* JPEG Thumbnail functions
+********************************************************************************
+*/
+
+/*
+* Area averaging downscaler, the source rows are pushed one at a time and
+* the destination rows are written as soon as they are complete.
+* Each destination pixel is the mean of the source area it covers, the partially covered pixels are weighted.
+*/
+typedef struct AreaResamplerStruct {
+	int srcWidth;
+	int srcHeight;
+	int dstWidth;
+	int dstHeight;
+	int components;
+	int maxCount; // max number of source columns for a destination column
+	int *xStart; // first source column for each destination column
+	int *xCount;
+	float *xWeights; // maxCount weights for each destination column
+	float *row; // the horizontally resampled source row
+	float *acc; // the current destination row accumulator
+	float *next; // the next destination row accumulator
+	double scaleY;
+	int srcY;
+	int dstY;
+} AreaResampler;
+
+static void freeAreaResampler(AreaResampler *r) {
+	if (r != NULL) {
+		free(r->xStart);
+		free(r->xCount);
+		free(r->xWeights);
+		free(r->row);
+		free(r->acc);
+		free(r->next);
+		free(r);
+	}
+}
+
+static AreaResampler *newAreaResampler(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int components) {
+	AreaResampler *r = (AreaResampler *)calloc(1, sizeof(AreaResampler));
+	double scaleX = (double) srcWidth / dstWidth;
+	double x0, x1, w;
+	int x, i, sx;
+	if (r == NULL) {
+		return NULL;
+	}
+	r->srcWidth = srcWidth;
+	r->srcHeight = srcHeight;
+	r->dstWidth = dstWidth;
+	r->dstHeight = dstHeight;
+	r->components = components;
+	r->maxCount = (int) ceil(scaleX) + 1;
+	r->scaleY = (double) srcHeight / dstHeight;
+	r->xStart = (int *)malloc(sizeof(int) * dstWidth);
+	r->xCount = (int *)malloc(sizeof(int) * dstWidth);
+	r->xWeights = (float *)malloc(sizeof(float) * dstWidth * r->maxCount);
+	r->row = (float *)malloc(sizeof(float) * dstWidth * components);
+	r->acc = (float *)calloc(dstWidth * components, sizeof(float));
+	r->next = (float *)calloc(dstWidth * components, sizeof(float));
+	if ((r->xStart == NULL) || (r->xCount == NULL) || (r->xWeights == NULL) || (r->row == NULL) || (r->acc == NULL) || (r->next == NULL)) {
+		freeAreaResampler(r);
+		return NULL;
+	}
+	for (x = 0; x < dstWidth; x++) {
+		x0 = x * scaleX;
+		x1 = x0 + scaleX;
+		sx = (int) x0;
+		r->xStart[x] = sx;
+		for (i = 0; (i < r->maxCount) && (sx + i < srcWidth) && (sx + i < x1); i++) {
+			w = (x1 < sx + i + 1 ? x1 : sx + i + 1) - (x0 > sx + i ? x0 : sx + i);
+			r->xWeights[x * r->maxCount + i] = (float) (w / scaleX);
+		}
+		r->xCount[x] = i;
+	}
+	return r;
+}
+
+static void areaResamplerWriteRow(AreaResampler *r, unsigned char *dstRow) {
+	int i, n = r->dstWidth * r->components;
+	float v, *tmp;
+	for (i = 0; i < n; i++) {
+		v = r->acc[i] + 0.5f;
+		dstRow[i] = v <= 0.0f ? 0 : (v >= 255.0f ? 255 : (unsigned char) v);
+	}
+	// the next accumulator becomes the current one
+	tmp = r->acc;
+	r->acc = r->next;
+	r->next = tmp;
+	memset(r->next, 0, sizeof(float) * n);
+	r->dstY++;
+}
+
+/*
+* Pushes the next source row, returns the number of destination rows written, 0 or more.
+*/
+static int areaResamplerPushRow(AreaResampler *r, const unsigned char *srcRow, unsigned char *dstImage, size_t dstBytesPerRow) {
+	int x, i, k, n, c = r->components;
+	int written = 0;
+	const unsigned char *s;
+	const float *w;
+	float v, wy0, wy1;
+	double y0, y1, boundary;
+	if ((r->srcY >= r->srcHeight) || (r->dstY >= r->dstHeight)) {
+		return 0;
+	}
+	for (x = 0; x < r->dstWidth; x++) {
+		s = srcRow + r->xStart[x] * c;
+		w = r->xWeights + x * r->maxCount;
+		n = r->xCount[x];
+		for (k = 0; k < c; k++) {
+			v = 0.0f;
+			for (i = 0; i < n; i++) {
+				v += w[i] * s[i * c + k];
+			}
+			r->row[x * c + k] = v;
+		}
+	}
+	// the source row covers [y0, y1), it may straddle the current destination row boundary
+	y0 = r->srcY;
+	y1 = y0 + 1.0;
+	boundary = (r->dstY + 1) * r->scaleY;
+	if (y1 <= boundary) {
+		wy0 = (float) (1.0 / r->scaleY);
+		wy1 = 0.0f;
+	} else {
+		wy0 = (float) ((boundary - y0) / r->scaleY);
+		wy1 = (float) ((y1 - boundary) / r->scaleY);
+	}
+	n = r->dstWidth * c;
+	for (i = 0; i < n; i++) {
+		r->acc[i] += wy0 * r->row[i];
+		r->next[i] += wy1 * r->row[i];
+	}
+	r->srcY++;
+	if ((y1 >= boundary) || (r->srcY == r->srcHeight)) {
+		areaResamplerWriteRow(r, dstImage + r->dstY * dstBytesPerRow);
+		written++;
+	}
+	return written;
+}
+
+/*
+* Computes the thumbnail size fitting in the maximum size and keeping the aspect ratio, the image is not enlarged.
+*/
+static void luajpeg_thumbnail_size(JDIMENSION width, JDIMENSION height, JDIMENSION maxWidth, JDIMENSION maxHeight,
+		JDIMENSION *thumbWidth, JDIMENSION *thumbHeight) {
+	double scale = 1.0;
+	if (width > maxWidth) {
+		scale = (double) maxWidth / width;
+	}
+	if (height * scale > maxHeight) {
+		scale = (double) maxHeight / height;
+	}
+	*thumbWidth = (JDIMENSION) (width * scale + 0.5);
+	*thumbHeight = (JDIMENSION) (height * scale + 0.5);
+	if (*thumbWidth < 1) {
+		*thumbWidth = 1;
+	}
+	if (*thumbHeight < 1) {
+		*thumbHeight = 1;
+	}
+}
+
+/*
+* Selects the smallest DCT scaling giving an output at least as large as the thumbnail,
+* the IDCT then does most of the downscaling.
+*/
+static void luajpeg_thumbnail_select_scale(j_decompress_ptr cinfo, JDIMENSION thumbWidth, JDIMENSION thumbHeight) {
+	unsigned int num;
+	cinfo->scale_denom = 8;
+	for (num = 1; num <= 8; num++) {
+		cinfo->scale_num = num;
+		jpeg_calc_output_dimensions(cinfo);
+		if ((cinfo->output_width >= thumbWidth) && (cinfo->output_height >= thumbHeight)) {
+			return;
+		}
+	}
+}
+
+/*
+* Decodes a thumbnail fitting in the maximum size, the thumbnail is returned in a new buffer with its infos.
+* The whole source shall be available, a suspending source aborts the decompression.
+* The decompress region, the raw data and the buffered image modes are not supported.
+*/
+static int luajpeg_thumbnail(lua_State *l) {
+	trace("luajpeg_thumbnail()\n");
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+	JDIMENSION maxWidth = (JDIMENSION) luaL_checkinteger(l, 2);
+	JDIMENSION maxHeight = (JDIMENSION) luaL_checkinteger(l, 3);
+	JDIMENSION thumbWidth, thumbHeight;
+
+	if ((maxWidth < 1) || (maxHeight < 1)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid thumbnail size");
+		return 2;
+	}
+	if ((jd->runStep > 2) && (jd->runStep != 4)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "decompress already started");
+		return 2;
+	}
+	if (jd->runStep == 0) {
+		jd->runStep++;
+	}
+	if (jd->runStep == 1) {
+		trace("jpeg_read_header()\n");
+		if (jpeg_read_header(&jd->cinfo, TRUE) == JPEG_SUSPENDED) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+		jd->runStep++;
+	}
+	luajpeg_thumbnail_size(jd->cinfo.image_width, jd->cinfo.image_height, maxWidth, maxHeight, &thumbWidth, &thumbHeight);
+	if (jd->runStep == 2) {
+		// the thumbnail is always decoded as interleaved pixels of the whole image
+		if (jd->region) {
+			lua_pushnil(l);
+			lua_pushstring(l, "region not supported by the thumbnail");
+			return 2;
+		}
+		if (jd->cinfo.raw_data_out) {
+			lua_pushnil(l);
+			lua_pushstring(l, "raw data not supported by the thumbnail");
+			return 2;
+		}
+		if (jd->cinfo.buffered_image) {
+			lua_pushnil(l);
+			lua_pushstring(l, "buffered image not supported by the thumbnail");
+			return 2;
+		}
+		luajpeg_thumbnail_select_scale(&jd->cinfo, thumbWidth, thumbHeight);
+		trace("scale: %d/%d\n", jd->cinfo.scale_num, jd->cinfo.scale_denom);
+		jd->runStep++;
+		trace("jpeg_start_decompress()\n");
+		if (! jpeg_start_decompress(&jd->cinfo)) {
+			jpeg_abort_decompress(&jd->cinfo);
+			jd->runStep = 0;
+			if (jd->srcType == SOURCE_LUA) {
+				luajpeg_reset_source_data(jd);
+			}
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+		jd->runStep++;
+	}
+	// the scaled output may be smaller than the thumbnail for unsupported scalings
+	if (thumbWidth > jd->cinfo.output_width) {
+		thumbWidth = jd->cinfo.output_width;
+	}
+	if (thumbHeight > jd->cinfo.output_height) {
+		thumbHeight = jd->cinfo.output_height;
+	}
+
+	int components = jd->cinfo.output_components;
+	size_t bytesPerRow = thumbWidth * components;
+	unsigned char *thumbData = (unsigned char *)lua_newuserdata(l, bytesPerRow * thumbHeight);
+	AreaResampler *r = newAreaResampler(jd->cinfo.output_width, jd->cinfo.output_height, thumbWidth, thumbHeight, components);
+	if (r == NULL) {
+		jpeg_abort_decompress(&jd->cinfo);
+		jd->runStep = 0;
+		if (jd->srcType == SOURCE_LUA) {
+			luajpeg_reset_source_data(jd);
+		}
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate resampler");
+		return 2;
+	}
+	JDIMENSION rowsPerCall = (JDIMENSION) luajpeg_decompress_rows_per_call(jd);
+	// released by libjpeg with the image
+	JSAMPARRAY rows = (*jd->cinfo.mem->alloc_sarray)((j_common_ptr) &jd->cinfo, JPOOL_IMAGE,
+		jd->cinfo.output_width * components, rowsPerCall);
+	JDIMENSION rowCount, i;
+	int suspended = FALSE;
+	while (jd->cinfo.output_scanline < jd->cinfo.output_height) {
+		rowCount = jpeg_read_scanlines(&jd->cinfo, rows, rowsPerCall);
+		if (rowCount == 0) {
+			suspended = TRUE;
+			break;
+		}
+		for (i = 0; i < rowCount; i++) {
+			areaResamplerPushRow(r, rows[i], thumbData, bytesPerRow);
+		}
+	}
+	freeAreaResampler(r);
+	if (suspended) {
+		jpeg_abort_decompress(&jd->cinfo);
+	} else {
+		trace("jpeg_finish_decompress()\n");
+		jpeg_finish_decompress(&jd->cinfo);
+	}
+	jd->runStep = 0;
+	if (jd->srcType == SOURCE_LUA) {
+		luajpeg_reset_source_data(jd);
+	}
+	if (suspended) {
+		lua_pushnil(l);
+		lua_pushstring(l, "suspended");
+		return 2;
+	}
+
+	lua_newtable(l);
+	SET_TABLE_KEY_INTEGER(l, "width", thumbWidth);
+	SET_TABLE_KEY_INTEGER(l, "height", thumbHeight);
+	SET_TABLE_KEY_INTEGER(l, "components", components);
+	SET_TABLE_KEY_INTEGER(l, "bytesPerRow", bytesPerRow);
+	SET_TABLE_KEY_STRING(l, "colorSpace", getOptionField(jd->cinfo.out_color_space, JCS_UNKNOWN, JCS_OPTIONS, JCS_VALUES));
+	SET_TABLE_KEY_INTEGER(l, "scaleNum", jd->cinfo.scale_num);
+	SET_TABLE_KEY_INTEGER(l, "scaleDenom", jd->cinfo.scale_denom);
+	return 2;
+}
+
+
+/*
+********************************************************************************
+* Image manipulation functions
+********************************************************************************
+*/
+
+/*
+* The image operations split the rows in bands processed in parallel by the worker pool.
+*/
+#define MIN_BAND_ROWS 16
+
+/*
+* The component matrix uses fixed-point coefficients on 16 bits when the result stays within one of the reference.
+* The pixel components are interleaved, for a vector of interleaved components the output component i at position k
+* is the sum of the coefficients times the input components at the positions k + d with d from 1 - components to components - 1,
+* the coefficient being zero when k + d is outside of the pixel. The offsets are processed by pairs.
+*/
+
+#define MATRIX_FIXED_BITS 14
+// (MAX_PIXEL_COMPONENTS * 255 / 2 + 1 / 2) / (1 << MATRIX_FIXED_MIN_BITS) must be below 1
+#define MATRIX_FIXED_MIN_BITS 10
+
+typedef struct ComponentMatrixContextStruct {
+	unsigned char *imageData;
+	PixmapInfo pi;
+	double matrix[MAX_SQUARE_COMPONENTS];
+	double delta[MAX_PIXEL_COMPONENTS];
+	int fixed; // true to use the fixed-point coefficients
+	int fixedBits;
+	int fixedMatrix[MAX_SQUARE_COMPONENTS];
+	int fixedDelta[MAX_PIXEL_COMPONENTS];
+#if defined(SIMD_LANES)
+	// for each vector of the block and each pair of offsets, the coefficients of the two offsets
+	int16_t simdCoefs[MAX_PIXEL_COMPONENTS][MAX_PIXEL_COMPONENTS][2 * SIMD_LANES];
+	int32_t simdDelta[MAX_PIXEL_COMPONENTS][SIMD_LANES];
+#endif
+} ComponentMatrixContext;
+
+#if defined(SIMD_LANES)
+/*
+* Returns the vector position of the n-th 32-bit result, the low results then the high results.
+* The AVX2 unpack instructions work on each 128-bit lane.
+*/
+static int simdResultPosition(int n) {
+#if defined(SIMD_AVX2)
+	return (n % 4) + 4 * (n / 8) + 8 * ((n % 8) / 4);
+#else
+	return n;
+#endif
+}
+
+static void componentMatrixSetSimd(ComponentMatrixContext *c) {
+	int components = c->pi.components;
+	int r, q, n, h, position, i, j, d;
+	for (r = 0; r < components; r++) {
+		for (n = 0; n < SIMD_LANES; n++) {
+			position = simdResultPosition(n);
+			c->simdDelta[r][n] = c->fixedDelta[(r * SIMD_LANES + position) % components];
+		}
+		for (q = 0; q < components; q++) {
+			for (n = 0; n < SIMD_LANES; n++) {
+				position = simdResultPosition(n);
+				i = (r * SIMD_LANES + position) % components;
+				for (h = 0; h < 2; h++) {
+					d = 2 * q + h + 1 - components;
+					j = i + d;
+					int16_t coef = (int16_t) (((j >= 0) && (j < components)) ? c->fixedMatrix[i * components + j] : 0);
+#if defined(SIMD_NEON)
+					c->simdCoefs[r][q][h * SIMD_LANES + position] = coef;
+#else
+					c->simdCoefs[r][q][2 * n + h] = coef;
+#endif
+				}
+			}
+		}
+	}
+}
+#endif
+
+static void componentMatrixSetFixed(ComponentMatrixContext *c) {
+	int components = c->pi.components;
+	int i, j, bits;
+	double maxCoef = 0.0;
+	c->fixed = 0;
+	for (i = 0; i < components * components; i++) {
+		if (fabs(c->matrix[i]) > maxCoef) {
+			maxCoef = fabs(c->matrix[i]);
+		}
+	}
+	for (bits = MATRIX_FIXED_BITS; (bits >= MATRIX_FIXED_MIN_BITS) && (maxCoef * (1 << bits) > 32767.0); bits--);
+	if (bits < MATRIX_FIXED_MIN_BITS) {
+		return;
+	}
+	for (i = 0; i < components; i++) {
+		double rowSum = 0.0;
+		for (j = 0; j < components; j++) {
+			c->fixedMatrix[i * components + j] = (int) floor(c->matrix[i * components + j] * (1 << bits) + 0.5);
+			rowSum += fabs(c->matrix[i * components + j]);
+		}
+		// a larger delta saturates the result anyway
+		double limit = 256.0 * (rowSum + 1.0);
+		double delta = c->delta[i] < -limit ? -limit : (c->delta[i] > limit ? limit : c->delta[i]);
+		c->fixedDelta[i] = (int) floor(delta * (1 << bits) + 0.5);
+	}
+	c->fixedBits = bits;
+	c->fixed = 1;
+#if defined(SIMD_LANES)
+	componentMatrixSetSimd(c);
+#endif
+}
+
+static inline void componentMatrixPixelFixed(const ComponentMatrixContext *c, unsigned char *pixel, const int components) {
+	int work[MAX_PIXEL_COMPONENTS];
+	int i, j, sum;
+	for (i = 0; i < components; i++) {
+		sum = c->fixedDelta[i];
+		for (j = 0; j < components; j++) {
+			sum += pixel[j] * c->fixedMatrix[i * components + j];
+		}
+		sum >>= c->fixedBits;
+		work[i] = FIX_BYTE(sum);
+	}
+	for (i = 0; i < components; i++) {
+		pixel[i] = (unsigned char) work[i];
+	}
+}
+
+#if defined(SIMD_LANES)
+/*
+* Processes a block of SIMD_LANES pixels, the component before and after the block are read but not used.
+* All the vectors are computed before being stored as their input overlaps.
+*/
+static inline void componentMatrixBlockSimd(const ComponentMatrixContext *c, unsigned char *block, const int components) {
+	int r, q, d0, d1;
+#if defined(SIMD_AVX2)
+	__m128i shift = _mm_cvtsi32_si128(c->fixedBits);
+	__m128i out[MAX_PIXEL_COMPONENTS];
+	for (r = 0; r < components; r++) {
+		const unsigned char *vector = block + r * SIMD_LANES;
+		__m256i lo = _mm256_loadu_si256((const __m256i *) c->simdDelta[r]);
+		__m256i hi = _mm256_loadu_si256((const __m256i *) (c->simdDelta[r] + 8));
+		for (q = 0; q < components; q++) {
+			d0 = 2 * q + 1 - components;
+			d1 = d0 + 1 < components ? d0 + 1 : d0; // the last offset has no pair and a zero coefficient
+			__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (vector + d0)));
+			__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (vector + d1)));
+			const __m256i *coefs = (const __m256i *) c->simdCoefs[r][q];
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), _mm256_loadu_si256(coefs)));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), _mm256_loadu_si256(coefs + 1)));
+		}
+		__m256i w = _mm256_packs_epi32(_mm256_sra_epi32(lo, shift), _mm256_sra_epi32(hi, shift));
+		w = _mm256_permute4x64_epi64(_mm256_packus_epi16(w, w), 0xd8);
+		out[r] = _mm256_castsi256_si128(w);
+	}
+	for (r = 0; r < components; r++) {
+		_mm_storeu_si128((__m128i *) (block + r * SIMD_LANES), out[r]);
+	}
+#elif defined(SIMD_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	__m128i shift = _mm_cvtsi32_si128(c->fixedBits);
+	__m128i out[MAX_PIXEL_COMPONENTS];
+	for (r = 0; r < components; r++) {
+		const unsigned char *vector = block + r * SIMD_LANES;
+		__m128i lo = _mm_loadu_si128((const __m128i *) c->simdDelta[r]);
+		__m128i hi = _mm_loadu_si128((const __m128i *) (c->simdDelta[r] + 4));
+		for (q = 0; q < components; q++) {
+			d0 = 2 * q + 1 - components;
+			d1 = d0 + 1 < components ? d0 + 1 : d0; // the last offset has no pair and a zero coefficient
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (vector + d0)), zero);
+			__m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (vector + d1)), zero);
+			const __m128i *coefs = (const __m128i *) c->simdCoefs[r][q];
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), _mm_loadu_si128(coefs)));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), _mm_loadu_si128(coefs + 1)));
+		}
+		__m128i w = _mm_packs_epi32(_mm_sra_epi32(lo, shift), _mm_sra_epi32(hi, shift));
+		out[r] = _mm_packus_epi16(w, w);
+	}
+	for (r = 0; r < components; r++) {
+		_mm_storel_epi64((__m128i *) (block + r * SIMD_LANES), out[r]);
+	}
+#elif defined(SIMD_NEON)
+	int32x4_t shift = vdupq_n_s32(-c->fixedBits);
+	uint8x8_t out[MAX_PIXEL_COMPONENTS];
+	for (r = 0; r < components; r++) {
+		const unsigned char *vector = block + r * SIMD_LANES;
+		int32x4_t lo = vld1q_s32(c->simdDelta[r]);
+		int32x4_t hi = vld1q_s32(c->simdDelta[r] + 4);
+		for (q = 0; q < components; q++) {
+			d0 = 2 * q + 1 - components;
+			d1 = d0 + 1;
+			int16x8_t a = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(vector + d0)));
+			int16x8_t k = vld1q_s16(c->simdCoefs[r][q]);
+			lo = vmlal_s16(lo, vget_low_s16(a), vget_low_s16(k));
+			hi = vmlal_s16(hi, vget_high_s16(a), vget_high_s16(k));
+			if (d1 < components) {
+				int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(vector + d1)));
+				k = vld1q_s16(c->simdCoefs[r][q] + SIMD_LANES);
+				lo = vmlal_s16(lo, vget_low_s16(b), vget_low_s16(k));
+				hi = vmlal_s16(hi, vget_high_s16(b), vget_high_s16(k));
+			}
+		}
+		int16x8_t w = vcombine_s16(vqmovn_s32(vshlq_s32(lo, shift)), vqmovn_s32(vshlq_s32(hi, shift)));
+		out[r] = vqmovun_s16(w);
+	}
+	for (r = 0; r < components; r++) {
+		vst1_u8(block + r * SIMD_LANES, out[r]);
+	}
+#endif
+}
+#endif
+
+/*
+* Called with a constant number of components to let the compiler specialize the row.
+*/
+static inline void componentMatrixRowFixed(const ComponentMatrixContext *c, unsigned char *row, int width, const int components) {
+	int x = 0;
+#if defined(SIMD_LANES)
+	// the blocks read the component before and after them
+	int margin = components > 1 ? 1 : 0;
+	for (; (x < margin) && (x < width); x++) {
+		componentMatrixPixelFixed(c, row + x * components, components);
+	}
+	for (; x + SIMD_LANES + margin <= width; x += SIMD_LANES) {
+		componentMatrixBlockSimd(c, row + x * components, components);
+	}
+#endif
+	for (; x < width; x++) {
+		componentMatrixPixelFixed(c, row + x * components, components);
+	}
+}
+
+static void componentMatrixBand(void *context, int band, int bandCount) {
+	ComponentMatrixContext *c = (ComponentMatrixContext *) context;
+	unsigned char *imageData = c->imageData;
+	double work[MAX_PIXEL_COMPONENTS];
+	int i, j, x, y, yStart, yEnd, xoffset, yoffset;
+	getBandRows(c->pi.height, band, bandCount, &yStart, &yEnd);
+	if (c->fixed) {
+		for (y = yStart; y < yEnd; y++) {
+			unsigned char *row = imageData + y * c->pi.bytesPerRow;
+			switch (c->pi.components) {
+			case 1:
+				componentMatrixRowFixed(c, row, c->pi.width, 1);
+				break;
+			case 3:
+				componentMatrixRowFixed(c, row, c->pi.width, 3);
+				break;
+			case 4:
+				componentMatrixRowFixed(c, row, c->pi.width, 4);
+				break;
+			default:
+				componentMatrixRowFixed(c, row, c->pi.width, c->pi.components);
+				break;
+			}
+		}
+		return;
+	}
+	for (y = yStart; y < yEnd; y++) {
+		yoffset = y * c->pi.bytesPerRow;
+		for (x = 0; x < c->pi.width; x++) {
+			xoffset = yoffset + x * c->pi.components;
+			for (i = 0; i < c->pi.components; i++) {
+				work[i] = c->delta[i];
+				for (j = 0; j < c->pi.components; j++) {
+					work[i] += imageData[xoffset + j] * c->matrix[i * c->pi.components + j];
+				}
+			}
+			for (i = 0; i < c->pi.components; i++) {
+				imageData[xoffset + i] = FIX_BYTE(work[i]);
+			}
+		}
+	}
+}
+
+/*
+* Reads the matrix and the delta tables at the specified indexes, the pixmap info of the context shall be set.
+*/
+static void getComponentMatrixArguments(lua_State *l, int matrixIndex, int deltaIndex, ComponentMatrixContext *c) {
+	double *matrix = c->matrix;
+	double *delta = c->delta;
+	int matrixLength = c->pi.components * c->pi.components;
+	int i;
+	for (i = 0; i < matrixLength; i++) {
+		matrix[i] = 1.0;
+	}
+	for (i = 0; i < c->pi.components; i++) {
+		delta[i] = 0.0;
+	}
+	if (lua_istable(l, matrixIndex)) {
+		for (i = 0; i < matrixLength; i++) {
+			if (lua_geti(l, matrixIndex, i + 1) == LUA_TNUMBER) {
+				matrix[i] = lua_tonumber(l, -1);
+			}
+			lua_pop(l, 1);
+		}
+	}
+	if (lua_istable(l, deltaIndex)) {
+		for (i = 0; i < c->pi.components; i++) {
+			if (lua_geti(l, deltaIndex, i + 1) == LUA_TNUMBER) {
+				delta[i] = lua_tonumber(l, -1);
+			}
+			lua_pop(l, 1);
+		}
+	}
+	componentMatrixSetFixed(c);
+}
+
 static int luajpeg_componentMatrix(lua_State *l) {
 	trace("luajpeg_componentMatrix()\n");
 	luaL_checktype(l, 1, LUA_TUSERDATA);
-	size_t imageLength = lua_rawlen(l, 1);
-	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
+	size_t imageLength = lua_rawlen(l, 1);
+	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
+	
+	PixmapInfo pi;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &pi);
+	if (pi.components > MAX_PIXEL_COMPONENTS) {
+		lua_pushnil(l);
+		lua_pushstring(l, "too much components");
+		return 2;
+	}
+	size_t image_size = (size_t) (pi.bytesPerRow * pi.height);
+	if (imageLength < image_size) {
+		lua_pushnil(l);
+		lua_pushstring(l, "image buffer too small");
+		return 2;
+	}
+	ComponentMatrixContext context;
+	context.imageData = imageData;
+	context.pi = pi;
+	getComponentMatrixArguments(l, 3, 4, &context);
+	runBands(componentMatrixBand, &context, getBandCount(pi.height, MIN_BAND_ROWS));
+
+	return 0;
+}
+
+typedef struct ComponentSwapContextStruct {
+	unsigned char *imageData;
+	PixmapInfo pi;
+	int indices[MAX_PIXEL_COMPONENTS];
+} ComponentSwapContext;
+
+static void componentSwapBand(void *context, int band, int bandCount) {
+	ComponentSwapContext *c = (ComponentSwapContext *) context;
+	unsigned char *imageData = c->imageData;
+	unsigned char work[MAX_PIXEL_COMPONENTS];
+	int i, x, y, yStart, yEnd, xoffset, yoffset;
+	getBandRows(c->pi.height, band, bandCount, &yStart, &yEnd);
+    for (y = yStart; y < yEnd; y++) {
+        yoffset = y * c->pi.bytesPerRow;
+        for (x = 0; x < c->pi.width; x++) {
+            xoffset = yoffset + x * c->pi.components;
+        	for (i = 0; i < c->pi.components; i++) {
+				work[i] = imageData[xoffset + c->indices[i]];
+            }
+        	for (i = 0; i < c->pi.components; i++) {
+                imageData[xoffset + i] = work[i];
+            }
+        }
+    }
+}
+
+/*
+* Reads the indices table at the specified index, the pixmap info of the context shall be set.
+*/
+static void getComponentSwapArguments(lua_State *l, int indicesIndex, ComponentSwapContext *c) {
+	int *indices = c->indices;
+	int i;
+	for (i = 0; i < c->pi.components; i++) {
+		indices[i] = c->pi.components - 1 - i;
+	}
+	if (lua_istable(l, indicesIndex)) {
+		for (i = 0; i < c->pi.components; i++) {
+			lua_geti(l, indicesIndex, i);
+			if (lua_isinteger(l, -1)) {
+				indices[i] = (int) lua_tointeger(l, -1);
+			}
+			lua_pop(l, 1);
+		}
+	}
+}
+
+static int luajpeg_componentSwap(lua_State *l) {
+	trace("luajpeg_componentSwap()\n");
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	size_t imageLength = lua_rawlen(l, 1);
+	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
+	
+	PixmapInfo pi;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &pi);
+	if (pi.components > MAX_PIXEL_COMPONENTS) {
+		lua_pushnil(l);
+		lua_pushstring(l, "too much components");
+		return 2;
+	}
+	size_t image_size = (size_t) (pi.bytesPerRow * pi.height);
+	if (imageLength < image_size) {
+		lua_pushnil(l);
+		lua_pushstring(l, "image buffer too small");
+		return 2;
+	}
+	ComponentSwapContext context;
+	context.imageData = imageData;
+	context.pi = pi;
+	getComponentSwapArguments(l, 3, &context);
+	runBands(componentSwapBand, &context, getBandCount(pi.height, MIN_BAND_ROWS));
+	return 0;
+}
+
+/*
+* The convolution sums are computed on integers when the kernel values are integers,
+* the sum of the absolute kernel values times 255 bounds all the partial sums.
+* A kernel that is the product of a column and a row is applied as a horizontal pass then a vertical pass.
+* The pixels whose kernel lies inside the image are convolved without bounds checks.
+*/
+#define CONVOLVE_MAX_INTEGER_SUM (INT32_MAX / 255)
+#define CONVOLVE_SEPARABLE_EPSILON 1e-9
+
+typedef struct ConvolveContextStruct {
+	unsigned char *imageData;
+	PixmapInfo pi;
+	int componentStart;
+	int componentStop;
+	int kernelWidth;
+	int kernelHeight;
+	int kernelX;
+	int kernelY;
+	double *kernel; // kernelHeight rows of kernelWidth values
+	double *kernelRowSums;
+	double kernelSum; // the divisor of the direct convolution less the kernel values outside of the image
+	int integer; // whether the sums are computed on integers
+	int *intKernel;
+	int *intKernelRowSums;
+	int separable; // whether the kernel is the product of the column kernel and the row kernel
+	double *rowKernel;
+	double *columnKernel;
+	double *rowDivs; // for each column, the sum of the row kernel values inside the image
+	int *intRowKernel;
+	int *intColumnKernel;
+	int *intRowDivs;
+	int unsharp; // whether the separable convolution is the blur of an unsharp mask
+	int unsharpAmount; // the amount of the difference to the blur added to the pixel, in 1/UNSHARP_AMOUNT_ONE
+	int unsharpThreshold; // the minimal difference to the blur to modify the pixel
+	unsigned char *halos; // for each band, the source rows above then below the band
+	int failed;
+} ConvolveContext;
+
+static int greatestCommonDivisor(int a, int b) {
+	int t;
+	while (b != 0) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static void convolveSetKernel(ConvolveContext *c) {
+	int kernelWidth = c->kernelWidth, kernelHeight = c->kernelHeight;
+	int i, j, p = 0, q = 0, divisor = 0;
+	double d, absSum = 0.0, maxAbs = 0.0;
+	c->integer = 1;
+	c->kernelSum = 0.0;
+	for (j = 0; j < kernelHeight; j++) {
+		c->kernelRowSums[j] = 0.0;
+		for (i = 0; i < kernelWidth; i++) {
+			d = c->kernel[j * kernelWidth + i];
+			c->kernelRowSums[j] += d;
+			c->kernelSum += d;
+			absSum += fabs(d);
+			if (fabs(d) > maxAbs) {
+				maxAbs = fabs(d);
+				p = j;
+				q = i;
+			}
+			if (d != floor(d)) {
+				c->integer = 0;
+			}
+		}
+	}
+	if (absSum > CONVOLVE_MAX_INTEGER_SUM) {
+		c->integer = 0;
+	}
+	if (c->integer) {
+		for (j = 0; j < kernelHeight; j++) {
+			c->intKernelRowSums[j] = (int) c->kernelRowSums[j];
+			for (i = 0; i < kernelWidth; i++) {
+				c->intKernel[j * kernelWidth + i] = (int) c->kernel[j * kernelWidth + i];
+			}
+		}
+	}
+	// the separable kernel is worth it when the two passes have less values
+	c->separable = 0;
+	if ((maxAbs == 0.0) || (kernelWidth + kernelHeight >= kernelWidth * kernelHeight)) {
+		return;
+	}
+	// the row and the column of the largest value are the factors
+	const double *pivotRow = c->kernel + p * kernelWidth;
+	for (i = 0; i < kernelWidth; i++) {
+		c->rowKernel[i] = pivotRow[i];
+	}
+	for (j = 0; j < kernelHeight; j++) {
+		c->columnKernel[j] = c->kernel[j * kernelWidth + q] / pivotRow[q];
+	}
+	for (j = 0; j < kernelHeight; j++) {
+		for (i = 0; i < kernelWidth; i++) {
+			if (fabs(c->kernel[j * kernelWidth + i] - c->columnKernel[j] * c->rowKernel[i]) > maxAbs * CONVOLVE_SEPARABLE_EPSILON) {
+				return;
+			}
+		}
+	}
+	c->separable = 1;
+	trace("separable kernel\n");
+	if (!c->integer) {
+		return;
+	}
+	// the row is divided by the greatest common divisor of its values to keep integer column values
+	const int *intPivotRow = c->intKernel + p * kernelWidth;
+	for (i = 0; i < kernelWidth; i++) {
+		divisor = greatestCommonDivisor(divisor, abs(intPivotRow[i]));
+	}
+	for (i = 0; i < kernelWidth; i++) {
+		c->intRowKernel[i] = intPivotRow[i] / divisor;
+	}
+	for (j = 0; j < kernelHeight; j++) {
+		c->intColumnKernel[j] = c->intKernel[j * kernelWidth + q] / c->intRowKernel[q];
+		for (i = 0; i < kernelWidth; i++) {
+			if (c->intColumnKernel[j] * c->intRowKernel[i] != c->intKernel[j * kernelWidth + i]) {
+				c->integer = 0;
+				return;
+			}
+		}
+	}
+}
+
+// Sets the first and last columns whose kernel lies inside the image
+static void convolveInteriorColumns(const ConvolveContext *c, int *left, int *right) {
+	int width = (int) c->pi.width;
+	*left = c->kernelX < width ? c->kernelX : width;
+	*right = width - (c->kernelWidth - 1 - c->kernelX);
+	if (*right < *left) {
+		*right = *left;
+	}
+}
+
+// Sets the kernel columns inside the image for the specified pixel column
+static void convolveClipColumns(const ConvolveContext *c, int x, int *iStart, int *iEnd) {
+	int width = (int) c->pi.width;
+	*iStart = c->kernelX > x ? c->kernelX - x : 0;
+	*iEnd = width - x + c->kernelX < c->kernelWidth ? width - x + c->kernelX : c->kernelWidth;
+}
+
+static inline unsigned char convolveResult(double sum, double div) {
+	if (div == 0.0) {
+		return 255;
+	}
+	double res = sum / div;
+	return res <= 0.0 ? 0 : (res >= 255.0 ? 255 : (unsigned char) res);
+}
+
+#define UNSHARP_AMOUNT_BITS 8
+#define UNSHARP_AMOUNT_ONE (1 << UNSHARP_AMOUNT_BITS)
+
+static inline unsigned char unsharpResult(const ConvolveContext *c, int value, int blurred) {
+	int diff = value - blurred;
+	if ((diff < c->unsharpThreshold) && (-diff < c->unsharpThreshold)) {
+		return (unsigned char) value;
+	}
+	int res = value + ((diff * c->unsharpAmount + UNSHARP_AMOUNT_ONE / 2) >> UNSHARP_AMOUNT_BITS);
+	return (unsigned char) FIX_BYTE(res);
+}
+
+static inline unsigned char convolveIntResult(int sum, int div) {
+	if (div == 0) {
+		return 255;
+	}
+	int res = sum / div;
+	return (unsigned char) FIX_BYTE(res);
+}
+
+/*
+* Returns the divisor of a pixel, the kernel sum less the kernel values outside of the image.
+* The values are subtracted in the kernel order so the floating point divisor is the one of the direct convolution.
+*/
+static double convolveDiv(const ConvolveContext *c, const unsigned char **windowRows, int iStart, int iEnd) {
+	int i, j;
+	double div = c->kernelSum;
+	for (j = 0; j < c->kernelHeight; j++) {
+		for (i = 0; i < c->kernelWidth; i++) {
+			if ((windowRows[j] == NULL) || (i < iStart) || (i >= iEnd)) {
+				div -= c->kernel[j * c->kernelWidth + i];
+			}
+		}
+	}
+	return div;
+}
+
+/*
+* Convolves the pixels from x0 to x1 of a row from the source rows inside the image and their kernel rows.
+* The window rows are the kernelHeight source rows, NULL outside of the image,
+* for the border pixels the kernel columns outside of the image are ignored.
+*/
+static void convolveColumns(const ConvolveContext *c, const unsigned char **srcRows, const double **kernelRows, int rowCount,
+		const unsigned char **windowRows, double div, unsigned char *dstRow, int x0, int x1, int border) {
+	const int components = c->pi.components, kernelX = c->kernelX;
+	int x, k, j, i, iStart = 0, iEnd = c->kernelWidth;
+	double sum;
+	for (x = x0; x < x1; x++) {
+		if (border) {
+			convolveClipColumns(c, x, &iStart, &iEnd);
+			div = convolveDiv(c, windowRows, iStart, iEnd);
+		}
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			sum = 0.0;
+			for (j = 0; j < rowCount; j++) {
+				const unsigned char *src = srcRows[j] + (x - kernelX + iStart) * components + k;
+				const double *kernel = kernelRows[j];
+				for (i = iStart; i < iEnd; i++, src += components) {
+					sum += *src * kernel[i];
+				}
+			}
+			dstRow[x * components + k] = convolveResult(sum, div);
+		}
+	}
+}
+
+static void convolveIntColumns(const ConvolveContext *c, const unsigned char **srcRows, const int **kernelRows, int rowCount,
+		int div, unsigned char *dstRow, int x0, int x1, int border) {
+	const int components = c->pi.components, kernelX = c->kernelX;
+	int x, k, j, i, sum, iStart = 0, iEnd = c->kernelWidth;
+	for (x = x0; x < x1; x++) {
+		if (border) {
+			convolveClipColumns(c, x, &iStart, &iEnd);
+			div = 0;
+			for (j = 0; j < rowCount; j++) {
+				for (i = iStart; i < iEnd; i++) {
+					div += kernelRows[j][i];
+				}
+			}
+		}
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			sum = 0;
+			for (j = 0; j < rowCount; j++) {
+				const unsigned char *src = srcRows[j] + (x - kernelX + iStart) * components + k;
+				const int *kernel = kernelRows[j];
+				for (i = iStart; i < iEnd; i++, src += components) {
+					sum += *src * kernel[i];
+				}
+			}
+			dstRow[x * components + k] = convolveIntResult(sum, div);
+		}
+	}
+}
+
+/*
+* Computes the horizontal sums of a source row, the border sums only have the kernel values inside the image.
+*/
+static void convolveHorizontal(const ConvolveContext *c, const unsigned char *srcRow, double *sums, int x0, int x1, int border) {
+	const int components = c->pi.components, kernelX = c->kernelX;
+	const double *kernel = c->rowKernel;
+	int x, k, i, iStart = 0, iEnd = c->kernelWidth;
+	double sum;
+	for (x = x0; x < x1; x++) {
+		if (border) {
+			convolveClipColumns(c, x, &iStart, &iEnd);
+		}
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			const unsigned char *src = srcRow + (x - kernelX + iStart) * components + k;
+			sum = 0.0;
+			for (i = iStart; i < iEnd; i++, src += components) {
+				sum += *src * kernel[i];
+			}
+			sums[x * components + k] = sum;
+		}
+	}
+}
+
+static void convolveIntHorizontal(const ConvolveContext *c, const unsigned char *srcRow, int *sums, int x0, int x1, int border) {
+	const int components = c->pi.components, kernelX = c->kernelX;
+	const int *kernel = c->intRowKernel;
+	int x, k, i, sum, iStart = 0, iEnd = c->kernelWidth;
+	for (x = x0; x < x1; x++) {
+		if (border) {
+			convolveClipColumns(c, x, &iStart, &iEnd);
+		}
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			const unsigned char *src = srcRow + (x - kernelX + iStart) * components + k;
+			sum = 0;
+			for (i = iStart; i < iEnd; i++, src += components) {
+				sum += *src * kernel[i];
+			}
+			sums[x * components + k] = sum;
+		}
+	}
+}
+
+/*
+* Computes a destination row from the horizontal sums of the source rows inside the image and their column kernel values.
+*/
+static void convolveVertical(const ConvolveContext *c, const double **sumRows, const double *weights, int rowCount,
+		double columnDiv, unsigned char *dstRow) {
+	const int components = c->pi.components, width = (int) c->pi.width;
+	int x, k, j, offset;
+	double sum;
+	for (x = 0; x < width; x++) {
+		double div = c->rowDivs[x] * columnDiv;
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			offset = x * components + k;
+			sum = 0.0;
+			for (j = 0; j < rowCount; j++) {
+				sum += sumRows[j][offset] * weights[j];
+			}
+			if (c->unsharp) {
+				// the destination row still has the source values, the positive blur is rounded
+				dstRow[offset] = unsharpResult(c, dstRow[offset], convolveResult(sum + div / 2.0, div));
+			} else {
+				dstRow[offset] = convolveResult(sum, div);
+			}
+		}
+	}
+}
+
+static void convolveIntVertical(const ConvolveContext *c, const int **sumRows, const int *weights, int rowCount,
+		int columnDiv, unsigned char *dstRow) {
+	const int components = c->pi.components, width = (int) c->pi.width;
+	int x, k, j, offset, sum;
+	for (x = 0; x < width; x++) {
+		int div = c->intRowDivs[x] * columnDiv;
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			offset = x * components + k;
+			sum = 0;
+			for (j = 0; j < rowCount; j++) {
+				sum += sumRows[j][offset] * weights[j];
+			}
+			if (c->unsharp) {
+				dstRow[offset] = unsharpResult(c, dstRow[offset], convolveIntResult(sum + div / 2, div));
+			} else {
+				dstRow[offset] = convolveIntResult(sum, div);
+			}
+		}
+	}
+}
+
+/*
+* Sets the source rows of the band, the row r is the source row yStart - above + r or NULL outside of the image.
+* The source rows of the neighbor bands come from the halo rows copied before.
+*/
+static void convolveBandRows(const ConvolveContext *c, int band, int yStart, int yEnd, const unsigned char **rows) {
+	const PixmapInfo *pi = &c->pi;
+	int above = c->kernelY, below = c->kernelHeight - 1 - c->kernelY;
+	int rowCount = yEnd - yStart + above + below;
+	int r, sy;
+	unsigned char *halo = c->halos + (size_t) (c->kernelHeight - 1) * pi->bytesPerRow * band;
+	for (r = 0; r < rowCount; r++) {
+		sy = yStart - above + r;
+		if ((sy < 0) || (sy >= (int) pi->height)) {
+			rows[r] = NULL;
+		} else if (sy < yStart) {
+			rows[r] = halo + r * pi->bytesPerRow;
+		} else if (sy >= yEnd) {
+			rows[r] = halo + (above + sy - yEnd) * pi->bytesPerRow;
+		} else {
+			rows[r] = c->imageData + sy * pi->bytesPerRow;
+		}
+	}
+}
+
+/*
+* The separable band keeps the horizontal sums of the last kernelHeight source rows,
+* a destination row is written in place once its last source row is summed as the source rows above are not needed anymore.
+* The integer sums are exact, the floating point sums are rounded in another order than the direct convolution
+* and may differ by one.
+*/
+static void convolveSeparableBand(ConvolveContext *c, int band, int bandCount) {
+	PixmapInfo *pi = &c->pi;
+	int kernelHeight = c->kernelHeight;
+	int yStart, yEnd, rowCount, r, y, j, n, left, right;
+	getBandRows(pi->height, band, bandCount, &yStart, &yEnd);
+	rowCount = yEnd - yStart + kernelHeight - 1;
+	size_t samplesPerRow = pi->width * pi->components;
+	size_t sampleSize = c->integer ? sizeof(int) : sizeof(double);
+	const unsigned char **rows = (const unsigned char **)malloc(rowCount * sizeof(unsigned char *));
+	unsigned char *sums = (unsigned char *)malloc(kernelHeight * samplesPerRow * sampleSize);
+	const void **sumRows = (const void **)malloc(kernelHeight * sizeof(void *));
+	double *weights = (double *)malloc(kernelHeight * sizeof(double));
+	int *intWeights = (int *)malloc(kernelHeight * sizeof(int));
+	if ((rows == NULL) || (sums == NULL) || (sumRows == NULL) || (weights == NULL) || (intWeights == NULL)) {
+		free(rows);
+		free(sums);
+		free(sumRows);
+		free(weights);
+		free(intWeights);
+		c->failed = 1;
+		return;
+	}
+	convolveBandRows(c, band, yStart, yEnd, rows);
+	convolveInteriorColumns(c, &left, &right);
+	for (r = 0; r < rowCount; r++) {
+		unsigned char *rowSums = sums + (r % kernelHeight) * samplesPerRow * sampleSize;
+		if (rows[r] != NULL) {
+			if (c->integer) {
+				convolveIntHorizontal(c, rows[r], (int *) rowSums, 0, left, 1);
+				convolveIntHorizontal(c, rows[r], (int *) rowSums, left, right, 0);
+				convolveIntHorizontal(c, rows[r], (int *) rowSums, right, (int) pi->width, 1);
+			} else {
+				convolveHorizontal(c, rows[r], (double *) rowSums, 0, left, 1);
+				convolveHorizontal(c, rows[r], (double *) rowSums, left, right, 0);
+				convolveHorizontal(c, rows[r], (double *) rowSums, right, (int) pi->width, 1);
+			}
+		}
+		// the destination row whose last source row is r
+		y = yStart + r - (kernelHeight - 1);
+		if (y < yStart) {
+			continue;
+		}
+		double columnDiv = 0.0;
+		int intColumnDiv = 0;
+		for (j = 0, n = 0; j < kernelHeight; j++) {
+			if (rows[y - yStart + j] != NULL) {
+				sumRows[n] = sums + ((y - yStart + j) % kernelHeight) * samplesPerRow * sampleSize;
+				columnDiv += weights[n] = c->columnKernel[j];
+				if (c->integer) {
+					intColumnDiv += intWeights[n] = c->intColumnKernel[j];
+				}
+				n++;
+			}
+		}
+		unsigned char *dstRow = c->imageData + y * pi->bytesPerRow;
+		if (c->integer) {
+			convolveIntVertical(c, (const int **) sumRows, intWeights, n, intColumnDiv, dstRow);
+		} else {
+			convolveVertical(c, (const double **) sumRows, weights, n, columnDiv, dstRow);
+		}
+	}
+	free(rows);
+	free(sums);
+	free(sumRows);
+	free(weights);
+	free(intWeights);
+}
+
+/*
+* The band is convolved in place, the rows are kept in a work buffer until they are not needed anymore.
+*/
+static void convolveBand(void *context, int band, int bandCount) {
+	ConvolveContext *c = (ConvolveContext *) context;
+	if (c->separable) {
+		convolveSeparableBand(c, band, bandCount);
+		return;
+	}
+	PixmapInfo *pi = &c->pi;
+	unsigned char *pbits = c->imageData;
+	int kernelWidth = c->kernelWidth, kernelHeight = c->kernelHeight;
+	int yStart, yEnd, rowCount, left, right;
+	getBandRows(pi->height, band, bandCount, &yStart, &yEnd);
+	rowCount = yEnd - yStart + kernelHeight - 1;
+	int workSize = c->kernelY + 1;
+	unsigned char *work = (unsigned char *)malloc(workSize * pi->bytesPerRow);
+	const unsigned char **rows = (const unsigned char **)malloc((rowCount + kernelHeight) * sizeof(unsigned char *));
+	const double **kernelRows = (const double **)malloc(kernelHeight * sizeof(double *));
+	const int **intKernelRows = (const int **)malloc(kernelHeight * sizeof(int *));
+	if ((work == NULL) || (rows == NULL) || (kernelRows == NULL) || (intKernelRows == NULL)) {
+		free(work);
+		free(rows);
+		free(kernelRows);
+		free(intKernelRows);
+		c->failed = 1;
+		return;
+	}
+	// the source rows inside the image for the current destination row
+	const unsigned char **srcRows = rows + rowCount;
+	convolveBandRows(c, band, yStart, yEnd, rows);
+	convolveInteriorColumns(c, &left, &right);
+	int j, n, y, wy;
+	for (y = yStart; y < yEnd; y++) {
+		if (y - yStart >= workSize) {
+			wy = y - workSize;
+			memcpy(pbits + wy * pi->bytesPerRow, work + ((wy - yStart) % workSize) * pi->bytesPerRow, pi->bytesPerRow);
+		}
+		unsigned char *workRow = work + ((y - yStart) % workSize) * pi->bytesPerRow;
+		// the components that are not convolved are kept
+		memcpy(workRow, pbits + y * pi->bytesPerRow, pi->bytesPerRow);
+		const unsigned char **windowRows = rows + (y - yStart);
+		double div = convolveDiv(c, windowRows, 0, kernelWidth);
+		int intDiv = 0;
+		for (j = 0, n = 0; j < kernelHeight; j++) {
+			if (windowRows[j] != NULL) {
+				srcRows[n] = windowRows[j];
+				kernelRows[n] = c->kernel + j * kernelWidth;
+				if (c->integer) {
+					intKernelRows[n] = c->intKernel + j * kernelWidth;
+					intDiv += c->intKernelRowSums[j];
+				}
+				n++;
+			}
+		}
+		if (c->integer) {
+			convolveIntColumns(c, srcRows, intKernelRows, n, intDiv, workRow, 0, left, 1);
+			convolveIntColumns(c, srcRows, intKernelRows, n, intDiv, workRow, left, right, 0);
+			convolveIntColumns(c, srcRows, intKernelRows, n, intDiv, workRow, right, (int) pi->width, 1);
+		} else {
+			convolveColumns(c, srcRows, kernelRows, n, windowRows, div, workRow, 0, left, 1);
+			convolveColumns(c, srcRows, kernelRows, n, windowRows, div, workRow, left, right, 0);
+			convolveColumns(c, srcRows, kernelRows, n, windowRows, div, workRow, right, (int) pi->width, 1);
+		}
+	}
+	for (wy = yEnd - workSize < yStart ? yStart : yEnd - workSize; wy < yEnd; wy++) {
+		memcpy(pbits + wy * pi->bytesPerRow, work + ((wy - yStart) % workSize) * pi->bytesPerRow, pi->bytesPerRow);
+	}
+	free(work);
+	free(rows);
+	free(kernelRows);
+	free(intKernelRows);
+}
+
+/*
+* Allocates the kernel buffers for the kernel size of the context, the kernel values are then set by the caller.
+* A separable kernel has no kernel values, only its row and column kernels.
+*/
+static int newConvolveKernel(ConvolveContext *c, int separable) {
+	int kernelWidth = c->kernelWidth, kernelHeight = c->kernelHeight;
+	// the kernel, its row sums, the row and column kernels then the row kernel sums for each column
+	size_t kernelValues = (separable ? 0 : (size_t) kernelHeight * kernelWidth) + kernelHeight + kernelWidth + kernelHeight + c->pi.width;
+	c->kernel = (double *)malloc(kernelValues * sizeof(double));
+	c->intKernel = (int *)malloc(kernelValues * sizeof(int));
+	if ((c->kernel == NULL) || (c->intKernel == NULL)) {
+		free(c->kernel);
+		free(c->intKernel);
+		c->kernel = NULL;
+		c->intKernel = NULL;
+		return 0;
+	}
+	c->kernelRowSums = c->kernel + (separable ? 0 : kernelHeight * kernelWidth);
+	c->rowKernel = c->kernelRowSums + kernelHeight;
+	c->columnKernel = c->rowKernel + kernelWidth;
+	c->rowDivs = c->columnKernel + kernelHeight;
+	c->intKernelRowSums = c->intKernel + (separable ? 0 : kernelHeight * kernelWidth);
+	c->intRowKernel = c->intKernelRowSums + kernelHeight;
+	c->intColumnKernel = c->intRowKernel + kernelWidth;
+	c->intRowDivs = c->intColumnKernel + kernelHeight;
+	return 1;
+}
+
+static void freeConvolveKernel(ConvolveContext *c) {
+	free(c->kernel);
+	free(c->intKernel);
+}
+
+// Prepares the kernel of the context, its separable and integer forms and the row divisors
+static void convolvePrepare(ConvolveContext *c) {
+	PixmapInfo *pi = &c->pi;
+	int i, x;
+	// the unsharp mask kernel is set as separable and integer
+	if (!c->unsharp) {
+		convolveSetKernel(c);
+	}
+	trace("kernel initialized, separable: %d, integer: %d\n", c->separable, c->integer);
+	if (c->separable) {
+		for (x = 0; x < (int) pi->width; x++) {
+			int iStart, iEnd;
+			convolveClipColumns(c, x, &iStart, &iEnd);
+			c->rowDivs[x] = 0.0;
+			c->intRowDivs[x] = 0;
+			for (i = iStart; i < iEnd; i++) {
+				c->rowDivs[x] += c->rowKernel[i];
+				if (c->integer) {
+					c->intRowDivs[x] += c->intRowKernel[i];
+				}
+			}
+		}
+	}
+}
+
+/*
+* Convolves the image in place with the kernel values of the context, returns an error message or NULL.
+*/
+static const char *runConvolve(ConvolveContext *c) {
+	PixmapInfo *pi = &c->pi;
+	int kernelHeight = c->kernelHeight, kernelY = c->kernelY;
+	int band;
+	convolvePrepare(c);
+	int bandCount = getBandCount(pi->height, kernelHeight > MIN_BAND_ROWS ? kernelHeight : MIN_BAND_ROWS);
+	// the halo rows of each band are copied before any band is modified
+	size_t haloSize = (size_t) (kernelHeight - 1) * pi->bytesPerRow;
+	c->halos = (unsigned char *)malloc(haloSize * bandCount + 1);
+	if (c->halos == NULL) {
+		return "cannot allocate convolution buffers";
+	}
+	for (band = 0; band < bandCount; band++) {
+		int yStart, yEnd, y;
+		unsigned char *halo = c->halos + haloSize * band;
+		getBandRows(pi->height, band, bandCount, &yStart, &yEnd);
+		for (y = yStart - kernelY; y < yStart; y++, halo += pi->bytesPerRow) {
+			if (y >= 0) {
+				memcpy(halo, c->imageData + y * pi->bytesPerRow, pi->bytesPerRow);
+			}
+		}
+		for (y = yEnd; y < yEnd + kernelHeight - 1 - kernelY; y++, halo += pi->bytesPerRow) {
+			if (y < (int) pi->height) {
+				memcpy(halo, c->imageData + y * pi->bytesPerRow, pi->bytesPerRow);
+			}
+		}
+	}
+	c->failed = 0;
+	runBands(convolveBand, c, bandCount);
+	free(c->halos);
+	return c->failed ? "cannot allocate convolution buffers" : NULL;
+}
+
+/*
+* Reads the kernel table and the kernel options table at the specified indexes then allocates the kernel.
+* The pixmap info of the context shall be set, the kernel shall be freed when no error is returned.
+*/
+static const char *getConvolveArguments(lua_State *l, int kernelIndex, int optionsIndex, ConvolveContext *c) {
+	PixmapInfo *pi = &c->pi;
+	int kernelLength = lua_rawlen(l, kernelIndex);
+
+	int componentStart = 0;
+	int componentStop = pi->components - 1;
+	int kernelWidth = -1;
+	int kernelHeight = -1;
+	int kernelX = -1;
+	int kernelY = -1;
+
+	if (lua_istable(l, optionsIndex)) {
+		componentStart = getIntegerField(l, optionsIndex, "componentStart", componentStart);
+		componentStop = getIntegerField(l, optionsIndex, "componentStop", componentStop);
+
+		kernelWidth = getIntegerField(l, optionsIndex, "kernelWidth", kernelWidth);
+		kernelHeight = getIntegerField(l, optionsIndex, "kernelHeight", kernelHeight);
+		kernelX = getIntegerField(l, optionsIndex, "kernelX", kernelX);
+		kernelY = getIntegerField(l, optionsIndex, "kernelY", kernelY);
+	}
+	if ((kernelWidth < 0) || (kernelHeight < 0)) {
+		int s = sqrt(kernelLength);
+		kernelWidth = kernelHeight = s;
+	}
+	if (kernelWidth * kernelHeight != kernelLength) {
+		return "invalid kernel argument";
+	}
+	if ((kernelX < 0) || (kernelY < 0)) {
+		kernelX = kernelWidth / 2;
+		kernelY = kernelHeight / 2;
+	}
+	if ((kernelWidth < 1) || (kernelX >= kernelWidth) || (kernelY >= kernelHeight)) {
+		return "invalid kernel argument";
+	}
+
+	trace("componentStart - componentStop: %d-%d\n", componentStart, componentStop);
+	trace("kernelWidth x kernelHeight: %dx%d\n", kernelWidth, kernelHeight);
+	trace("kernelX, kernelY: %d, %d\n", kernelX, kernelY);
+
+	// only the existing components are convolved
+	if (componentStart < 0) {
+		componentStart = 0;
+	}
+	if (componentStop >= pi->components) {
+		componentStop = pi->components - 1;
+	}
+
+	c->componentStart = componentStart;
+	c->componentStop = componentStop;
+	c->kernelWidth = kernelWidth;
+	c->kernelHeight = kernelHeight;
+	c->kernelX = kernelX;
+	c->kernelY = kernelY;
+	c->unsharp = 0;
+	if (!newConvolveKernel(c, 0)) {
+		return "cannot allocate convolution buffers";
+	}
+    int i, j;
+    //trace("kernel initialization");
+    for (j = 0; j < kernelHeight; j++) {
+        for (i = 0; i < kernelWidth; i++) {
+			double d = 0.0;
+			if (lua_geti(l, kernelIndex, 1 + j * kernelWidth + i) == LUA_TNUMBER) {
+				d = (double) lua_tonumber(l, -1);
+			}
+			lua_pop(l, 1);
+			c->kernel[j * kernelWidth + i] = d;
+            trace("kernel[%d][%d] = %f\n", j, i, c->kernel[j * kernelWidth + i]);
+        }
+	}
+	return NULL;
+}
+
+static int luajpeg_convolve(lua_State *l) {
+	trace("luajpeg_convolve()\n");
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	//size_t imageLength = lua_rawlen(l, 1);
+	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
+	
+	PixmapInfo pi;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &pi);
+
+	luaL_checktype(l, 3, LUA_TTABLE);
+
+	// the buffer argument at index 4 is not used anymore, the work buffers are allocated for each band
+
+	ConvolveContext context;
+	context.imageData = imageData;
+	context.pi = pi;
+	const char *err = getConvolveArguments(l, 3, 5, &context);
+	if (err != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, err);
+		return 2;
+	}
+	err = runConvolve(&context);
+	freeConvolveKernel(&context);
+	if (err != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, err);
+		return 2;
+	}
+
+	return 0;
+}
+
+/*
+* The unsharp mask blur is a separable Gaussian with integer weights whose sum is UNSHARP_WEIGHT_SUM,
+* the square of the sum stays under CONVOLVE_MAX_INTEGER_SUM so the sums of the two passes fit on integers.
+*/
+#define UNSHARP_WEIGHT_SUM 2048
+
+/*
+* Allocates the Gaussian blur kernel used by the unsharp mask, the pixmap info of the context shall be set.
+* The kernel is set as the separable row and column kernels, the weights rounded to zero are trimmed.
+* Returns 0 on allocation failure.
+*/
+static int newUnsharpMaskKernel(ConvolveContext *c, double radius, double amount, int threshold) {
+	PixmapInfo *pi = &c->pi;
+	// the Gaussian is cut at three standard deviations, a larger kernel covers the whole image
+	int half = (int) ceil(3.0 * radius);
+	int maxHalf = pi->width > pi->height ? (int) pi->width : (int) pi->height;
+	if (half > maxHalf) {
+		half = maxHalf;
+	}
+	if (half < 0) {
+		half = 0;
+	}
+	int i, trim, size = 2 * half + 1;
+	int *weights = (int *)malloc(size * sizeof(int));
+	if (weights == NULL) {
+		return 0;
+	}
+	double gaussianSum = 0.0;
+	for (i = 0; i < size; i++) {
+		gaussianSum += half == 0 ? 1.0 : exp(-(i - half) * (i - half) / (2.0 * radius * radius));
+	}
+	// the center weight takes the remainder so the weights sum is exact
+	int weightSum = 0;
+	for (i = 0; i < size; i++) {
+		if (i != half) {
+			weights[i] = (int) floor(UNSHARP_WEIGHT_SUM * exp(-(i - half) * (i - half) / (2.0 * radius * radius)) / gaussianSum);
+			weightSum += weights[i];
+		}
+	}
+	weights[half] = UNSHARP_WEIGHT_SUM - weightSum;
+	for (trim = 0; (trim < half) && (weights[trim] == 0); trim++);
+	half -= trim;
+	size = 2 * half + 1;
+	trace("unsharp mask kernel size: %d, amount: %f, threshold: %d\n", size, amount, threshold);
+	c->kernelWidth = size;
+	c->kernelHeight = size;
+	c->kernelX = half;
+	c->kernelY = half;
+	c->unsharp = 1;
+	c->unsharpAmount = (int) floor(amount * UNSHARP_AMOUNT_ONE + 0.5);
+	c->unsharpThreshold = threshold;
+	if (!newConvolveKernel(c, 1)) {
+		free(weights);
+		return 0;
+	}
+	c->separable = 1;
+	c->integer = 1;
+	for (i = 0; i < size; i++) {
+		c->intRowKernel[i] = c->intColumnKernel[i] = weights[trim + i];
+		c->rowKernel[i] = c->columnKernel[i] = (double) weights[trim + i];
+	}
+	free(weights);
+	return 1;
+}
+
+/*
+* Sharpens the image in place by adding the difference to its Gaussian blur,
+* the blur is computed in the same pass as a separable convolution.
+*/
+static int luajpeg_unsharpMask(lua_State *l) {
+	trace("luajpeg_unsharpMask()\n");
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	size_t imageLength = lua_rawlen(l, 1);
+	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
+
+	PixmapInfo pi;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &pi);
+	size_t image_size = (size_t) (pi.bytesPerRow * pi.height);
+	if (imageLength < image_size) {
+		lua_pushnil(l);
+		lua_pushstring(l, "image buffer too small");
+		return 2;
+	}
+	// the standard deviation of the Gaussian blur
+	double radius = luaL_checknumber(l, 3);
+	double amount = luaL_optnumber(l, 4, 1.0);
+	int threshold = (int) luaL_optinteger(l, 5, 0);
+
+	int componentStart = 0;
+	int componentStop = pi.components - 1;
+	if (lua_istable(l, 6)) {
+		componentStart = getIntegerField(l, 6, "componentStart", componentStart);
+		componentStop = getIntegerField(l, 6, "componentStop", componentStop);
+	}
+	if ((radius < 0.0) || (amount < 0.0) || (amount > 255.0)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid unsharp mask argument");
+		return 2;
+	}
+	if (componentStart < 0) {
+		componentStart = 0;
+	}
+	if (componentStop >= pi.components) {
+		componentStop = pi.components - 1;
+	}
+	// the Gaussian is cut at three standard deviations
+	if ((int) ceil(3.0 * radius) < 1) {
+		return 0;
+	}
+
+	ConvolveContext context;
+	context.imageData = imageData;
+	context.pi = pi;
+	context.componentStart = componentStart;
+	context.componentStop = componentStop;
+	if (!newUnsharpMaskKernel(&context, radius, amount, threshold)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate convolution buffers");
+		return 2;
+	}
+	const char *err = runConvolve(&context);
+	freeConvolveKernel(&context);
+	if (err != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, err);
+		return 2;
+	}
+	return 0;
+}
+
+/*
+* The blur is made of box passes using running sums, the cost per pixel does not depend on the radius.
+* Each pass is a horizontal box then a vertical box, three passes approximate a Gaussian blur.
+* The window is clipped to the image, the border pixels are divided by the number of pixels inside the image.
+*/
+#define MAX_BLUR_PASSES 8
+#define GAUSSIAN_BLUR_PASSES 3
+// the vertical box processes strips of at most this number of columns
+#define BLUR_STRIP_WIDTH 256
+
+static const char *BLUR_OPTIONS[] = { "box", "gaussian", NULL };
+static const int BLUR_VALUES[] = { 0, 1 };
+
+typedef struct BlurContextStruct {
+	unsigned char *imageData;
+	PixmapInfo pi;
+	int componentStart;
+	int componentStop;
+	int radius; // the radius of the current pass
+	int failed;
+} BlurContext;
+
+// The rows are blurred in place from a copy of the source row
+static void blurHorizontalBand(void *context, int band, int bandCount) {
+	BlurContext *c = (BlurContext *) context;
+	const int components = c->pi.components, width = (int) c->pi.width, radius = c->radius;
+	unsigned int sums[MAX_PIXEL_COMPONENTS];
+	int x, y, k, yStart, yEnd, count;
+	getBandRows(c->pi.height, band, bandCount, &yStart, &yEnd);
+	unsigned char *src = (unsigned char *)malloc(c->pi.bytesPerRow);
+	if (src == NULL) {
+		c->failed = 1;
+		return;
+	}
+	for (y = yStart; y < yEnd; y++) {
+		unsigned char *dst = c->imageData + y * c->pi.bytesPerRow;
+		memcpy(src, dst, width * components);
+		// the window of the first pixel
+		for (k = c->componentStart; k <= c->componentStop; k++) {
+			sums[k] = 0;
+		}
+		for (x = 0; (x <= radius) && (x < width); x++) {
+			for (k = c->componentStart; k <= c->componentStop; k++) {
+				sums[k] += src[x * components + k];
+			}
+		}
+		for (x = 0; x < width; x++) {
+			count = (x + radius < width ? x + radius : width - 1) - (x - radius > 0 ? x - radius : 0) + 1;
+			for (k = c->componentStart; k <= c->componentStop; k++) {
+				dst[x * components + k] = (unsigned char) ((sums[k] + count / 2) / count);
+			}
+			if (x + radius + 1 < width) {
+				for (k = c->componentStart; k <= c->componentStop; k++) {
+					sums[k] += src[(x + radius + 1) * components + k];
+				}
+			}
+			if (x - radius >= 0) {
+				for (k = c->componentStart; k <= c->componentStop; k++) {
+					sums[k] -= src[(x - radius) * components + k];
+				}
+			}
+		}
+	}
+	free(src);
+}
+
+/*
+* The bands are strips of columns blurred in place from the top to the bottom,
+* the source values of the last radius + 1 rows of the strip are kept to be removed from the sums.
+*/
+static void blurVerticalBand(void *context, int band, int bandCount) {
+	BlurContext *c = (BlurContext *) context;
+	const int height = (int) c->pi.height, radius = c->radius;
+	int xStart, xEnd, y, i, count;
+	getBandRows(c->pi.width, band, bandCount, &xStart, &xEnd);
+	int offset = xStart * c->pi.components;
+	int samples = (xEnd - xStart) * c->pi.components;
+	int ringSize = radius + 1;
+	unsigned int *sums = (unsigned int *)calloc(samples, sizeof(unsigned int));
+	unsigned char *ring = (unsigned char *)malloc((size_t) ringSize * samples);
+	if ((sums == NULL) || (ring == NULL)) {
+		free(sums);
+		free(ring);
+		c->failed = 1;
+		return;
+	}
+	// the samples of the components that are not blurred are summed but not modified
+	int all = (c->componentStart == 0) && (c->componentStop == c->pi.components - 1);
+	for (y = 0; (y <= radius) && (y < height); y++) {
+		const unsigned char *row = c->imageData + y * c->pi.bytesPerRow + offset;
+		for (i = 0; i < samples; i++) {
+			sums[i] += row[i];
+		}
+	}
+	for (y = 0; y < height; y++) {
+		unsigned char *row = c->imageData + y * c->pi.bytesPerRow + offset;
+		unsigned char *saved = ring + (y % ringSize) * samples;
+		memcpy(saved, row, samples);
+		count = (y + radius < height ? y + radius : height - 1) - (y - radius > 0 ? y - radius : 0) + 1;
+		if (all) {
+			for (i = 0; i < samples; i++) {
+				row[i] = (unsigned char) ((sums[i] + count / 2) / count);
+			}
+		} else {
+			int k = 0;
+			for (i = 0; i < samples; i++) {
+				if ((k >= c->componentStart) && (k <= c->componentStop)) {
+					row[i] = (unsigned char) ((sums[i] + count / 2) / count);
+				}
+				if (++k == c->pi.components) {
+					k = 0;
+				}
+			}
+		}
+		if (y + radius + 1 < height) {
+			const unsigned char *next = c->imageData + (y + radius + 1) * c->pi.bytesPerRow + offset;
+			for (i = 0; i < samples; i++) {
+				sums[i] += next[i];
+			}
+		}
+		if (y - radius >= 0) {
+			const unsigned char *previous = ring + ((y - radius) % ringSize) * samples;
+			for (i = 0; i < samples; i++) {
+				sums[i] -= previous[i];
+			}
+		}
+	}
+	free(sums);
+	free(ring);
+}
+
+/*
+* Returns the box radii approximating a Gaussian blur of the specified standard deviation.
+*/
+static void gaussianBoxRadii(double sigma, int passes, int *radii) {
+	int i, lower, upper, m;
+	double ideal = sqrt(12.0 * sigma * sigma / passes + 1.0);
+	lower = (int) floor(ideal);
+	if (lower % 2 == 0) {
+		lower--;
+	}
+	upper = lower + 2;
+	// the number of passes using the lower width
+	m = (int) floor((12.0 * sigma * sigma - passes * lower * lower - 4.0 * passes * lower - 3.0 * passes) / (-4.0 * lower - 4.0) + 0.5);
+	for (i = 0; i < passes; i++) {
+		radii[i] = ((i < m ? lower : upper) - 1) / 2;
+	}
+}
+
+static int luajpeg_blur(lua_State *l) {
+	trace("luajpeg_blur()\n");
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	size_t imageLength = lua_rawlen(l, 1);
+	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
+
+	PixmapInfo pi;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &pi);
+	if (pi.components > MAX_PIXEL_COMPONENTS) {
+		lua_pushnil(l);
+		lua_pushstring(l, "too much components");
+		return 2;
+	}
+	size_t image_size = (size_t) (pi.bytesPerRow * pi.height);
+	if (imageLength < image_size) {
+		lua_pushnil(l);
+		lua_pushstring(l, "image buffer too small");
+		return 2;
+	}
+	// the radius of the box or the standard deviation of the Gaussian
+	double radius = luaL_checknumber(l, 3);
+
+	int componentStart = 0;
+	int componentStop = pi.components - 1;
+	int filter = 0;
+	int passes = 1;
+	if (lua_istable(l, 4)) {
+		componentStart = getIntegerField(l, 4, "componentStart", componentStart);
+		componentStop = getIntegerField(l, 4, "componentStop", componentStop);
+		filter = checkOptionField(l, 4, "filter", "box", BLUR_OPTIONS, BLUR_VALUES);
+		passes = getIntegerField(l, 4, "passes", passes);
+	}
+	if ((radius < 0.0) || (passes < 1) || (passes > MAX_BLUR_PASSES)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid blur argument");
+		return 2;
+	}
+	if (componentStart < 0) {
+		componentStart = 0;
+	}
+	if (componentStop >= pi.components) {
+		componentStop = pi.components - 1;
+	}
+	int radii[MAX_BLUR_PASSES];
+	int i;
+	if (filter == 1) {
+		passes = GAUSSIAN_BLUR_PASSES;
+		gaussianBoxRadii(radius, passes, radii);
+	} else {
+		for (i = 0; i < passes; i++) {
+			radii[i] = (int) floor(radius + 0.5);
+		}
+	}
+
+	BlurContext context;
+	context.imageData = imageData;
+	context.pi = pi;
+	context.componentStart = componentStart;
+	context.componentStop = componentStop;
+	context.failed = 0;
+	// a larger radius covers the whole image
+	int maxRadius = pi.width > pi.height ? (int) pi.width : (int) pi.height;
+	int rowBandCount = getBandCount(pi.height, MIN_BAND_ROWS);
+	int stripCount = getBandCount(pi.width, MIN_BAND_ROWS);
+	if (stripCount < (int) ((pi.width + BLUR_STRIP_WIDTH - 1) / BLUR_STRIP_WIDTH)) {
+		stripCount = (int) ((pi.width + BLUR_STRIP_WIDTH - 1) / BLUR_STRIP_WIDTH);
+	}
+	for (i = 0; (i < passes) && !context.failed; i++) {
+		context.radius = radii[i] < maxRadius ? radii[i] : maxRadius;
+		trace("blur pass %d, radius %d\n", i, context.radius);
+		if (context.radius <= 0) {
+			continue;
+		}
+		runBands(blurHorizontalBand, &context, rowBandCount);
+		runBands(blurVerticalBand, &context, stripCount);
+	}
+	if (context.failed) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate blur buffers");
+		return 2;
+	}
+	return 0;
+}
+
+/*
+* The transposing rotations copy square tiles of pixels, the source rows of a tile stay in cache while its destination rows are written.
+* The rows are processed by loops specialized for the number of components.
+*/
+#define ROTATE_TILE_SIZE 32
+
+typedef struct RotateContextStruct {
+	unsigned char *srcImageData;
+	PixmapInfo srcInfo;
+	unsigned char *dstImageData;
+	PixmapInfo dstInfo;
+	int rc;
+	int inPlace; // whether the destination is the source image
+} RotateContext;
+
+static inline void copyPixel(unsigned char *dst, const unsigned char *src, const int components) {
+	int i;
+	for (i = 0; i < components; i++) {
+		dst[i] = src[i];
+	}
+}
+
+static inline void swapPixel(unsigned char *a, unsigned char *b, const int components) {
+	unsigned char t;
+	int i;
+	for (i = 0; i < components; i++) {
+		t = a[i];
+		a[i] = b[i];
+		b[i] = t;
+	}
+}
+
+// Swaps the pixels of the row a with the pixels of the row b in reverse order, the rows may be the same
+static inline void swapMirrorRows(unsigned char *a, unsigned char *b, int width, const int components) {
+	int x, count = a == b ? width / 2 : width;
+	unsigned char *p = b + (width - 1) * components;
+	for (x = 0; x < count; x++, a += components, p -= components) {
+		swapPixel(a, p, components);
+	}
+}
+
+static inline void copyMirrorRow(unsigned char *dst, const unsigned char *src, int width, const int components) {
+	int x;
+	const unsigned char *p = src + (width - 1) * components;
+	for (x = 0; x < width; x++, dst += components, p -= components) {
+		copyPixel(dst, p, components);
+	}
+}
+
+/*
+* Writes the destination rows from yStart to yEnd of a transposing rotation.
+* The destination row yd comes from the source column sx, the destination column xd from the source row sy.
+*/
+static inline void rotateTransposedRows(const RotateContext *c, int yStart, int yEnd, const int components) {
+	const PixmapInfo *srcInfo = &c->srcInfo, *dstInfo = &c->dstInfo;
+	int dstWidth = (int) dstInfo->width;
+	int xt, yd, xd, xEnd, sx;
+	// the source address of the destination column 0 and the step to the next destination column
+	long srcFirstRow, srcStep;
+	if ((c->rc == 1) || (c->rc == 7)) {
+		srcFirstRow = (long) (srcInfo->height - 1) * srcInfo->bytesPerRow;
+		srcStep = -(long) srcInfo->bytesPerRow;
+	} else {
+		srcFirstRow = 0;
+		srcStep = (long) srcInfo->bytesPerRow;
+	}
+	for (xt = 0; xt < dstWidth; xt += ROTATE_TILE_SIZE) {
+		xEnd = xt + ROTATE_TILE_SIZE < dstWidth ? xt + ROTATE_TILE_SIZE : dstWidth;
+		for (yd = yStart; yd < yEnd; yd++) {
+			sx = ((c->rc == 1) || (c->rc == 6)) ? yd : (int) srcInfo->width - 1 - yd;
+			const unsigned char *src = c->srcImageData + srcFirstRow + srcStep * xt + sx * components;
+			unsigned char *dst = c->dstImageData + yd * dstInfo->bytesPerRow + xt * components;
+			for (xd = xt; xd < xEnd; xd++, dst += components, src += srcStep) {
+				copyPixel(dst, src, components);
+			}
+		}
+	}
+}
+
+/*
+* Processes the rows from yStart to yEnd, the destination rows or the pairs of swapped rows for an in place rotation.
+*/
+static inline void rotateRows(const RotateContext *c, int yStart, int yEnd, const int components) {
+	const PixmapInfo *srcInfo = &c->srcInfo, *dstInfo = &c->dstInfo;
+	int width = (int) dstInfo->width, height = (int) dstInfo->height;
+	int y, yt, yTileEnd;
+	unsigned char *a, *b;
+	switch (c->rc) {
+	case 1: // rotate right 90
+	case 3: // rotate left 90
+	case 6: // transpose
+	case 7: // transverse
+		// the destination rows are processed by tiles
+		for (yt = yStart; yt < yEnd; yt += ROTATE_TILE_SIZE) {
+			yTileEnd = yt + ROTATE_TILE_SIZE < yEnd ? yt + ROTATE_TILE_SIZE : yEnd;
+			rotateTransposedRows(c, yt, yTileEnd, components);
+		}
+		break;
+	case 2: // rotate 180
+		for (y = yStart; y < yEnd; y++) {
+			if (c->inPlace) {
+				a = c->dstImageData + y * dstInfo->bytesPerRow;
+				b = c->dstImageData + (height - 1 - y) * dstInfo->bytesPerRow;
+				swapMirrorRows(a, b, width, components);
+			} else {
+				copyMirrorRow(c->dstImageData + y * dstInfo->bytesPerRow,
+					c->srcImageData + (height - 1 - y) * srcInfo->bytesPerRow, width, components);
+			}
+		}
+		break;
+	case 4: // flip horizontal mirror
+		for (y = yStart; y < yEnd; y++) {
+			if (c->inPlace) {
+				a = c->dstImageData + y * dstInfo->bytesPerRow;
+				swapMirrorRows(a, a, width, components);
+			} else {
+				copyMirrorRow(c->dstImageData + y * dstInfo->bytesPerRow,
+					c->srcImageData + y * srcInfo->bytesPerRow, width, components);
+			}
+		}
+		break;
+	case 5: // flip vertical mirror
+		for (y = yStart; y < yEnd; y++) {
+			a = c->dstImageData + y * dstInfo->bytesPerRow;
+			if (c->inPlace) {
+				b = c->dstImageData + (height - 1 - y) * dstInfo->bytesPerRow;
+				int x;
+				for (x = 0; x < width * components; x++) {
+					unsigned char t = a[x];
+					a[x] = b[x];
+					b[x] = t;
+				}
+			} else {
+				memcpy(a, c->srcImageData + (height - 1 - y) * srcInfo->bytesPerRow, width * components);
+			}
+		}
+		break;
+	}
+}
+
+// Returns the number of rows to process, the in place vertical flips process pairs of rows
+static int getRotateRows(const RotateContext *c) {
+	if (c->inPlace && (c->rc == 2)) {
+		return (int) (c->dstInfo.height + 1) / 2;
+	}
+	if (c->inPlace && (c->rc == 5)) {
+		return (int) c->dstInfo.height / 2;
+	}
+	return (int) c->dstInfo.height;
+}
+
+static void rotateBand(void *context, int band, int bandCount) {
+	RotateContext *c = (RotateContext *) context;
+	int yStart, yEnd;
+	getBandRows(getRotateRows(c), band, bandCount, &yStart, &yEnd);
+	switch (c->srcInfo.components) {
+	case 1:
+		rotateRows(c, yStart, yEnd, 1);
+		break;
+	case 3:
+		rotateRows(c, yStart, yEnd, 3);
+		break;
+	case 4:
+		rotateRows(c, yStart, yEnd, 4);
+		break;
+	default:
+		rotateRows(c, yStart, yEnd, c->srcInfo.components);
+		break;
+	}
+}
+
+/*
+* Rotates the source image into the destination image.
+* The 180 degrees rotation and the flips can be done in place, without destination or with the source as destination.
+*/
+static int luajpeg_rotate(lua_State *l) {
+	trace("luajpeg_rotate()\n");
+
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	//size_t srcImageLength = lua_rawlen(l, 1);
+	unsigned char *srcImageData = (unsigned char *)lua_touserdata(l, 1);
+	
+	PixmapInfo srcInfo;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &srcInfo);
+
+	unsigned char *dstImageData = srcImageData;
+	PixmapInfo dstInfo = srcInfo;
+	if (!lua_isnoneornil(l, 3)) {
+		luaL_checktype(l, 3, LUA_TUSERDATA);
+		//size_t dstImageLength = lua_rawlen(l, 3);
+		dstImageData = (unsigned char *)lua_touserdata(l, 3);
+	}
+	if (!lua_isnoneornil(l, 4)) {
+		luaL_checktype(l, 4, LUA_TTABLE);
+		getPixmapInfoFromTableField(l, 4, &dstInfo);
+	}
+	int inPlace = dstImageData == srcImageData;
+
+	if (srcInfo.components != dstInfo.components) {
+		lua_pushnil(l);
+		lua_pushstring(l, "components differ");
+		return 2;
+	}
+
+	int rc = 1;
+	if (lua_isinteger(l, 5)) {
+		rc = lua_tointeger(l, 5);
+	} else if (lua_isstring(l, 5)) {
+		rc = ROTATE_VALUES[luaL_checkoption(l, 5, NULL, ROTATE_OPTIONS)];
+	}
+
+	if ((rc == 1) || (rc == 3) || (rc == 6) || (rc == 7)) {
+		if (inPlace) {
+			lua_pushnil(l);
+			lua_pushstring(l, "unsupported in place rotation");
+			return 2;
+		}
+		if ((srcInfo.width != dstInfo.height) || (srcInfo.height != dstInfo.width)) {
+			lua_pushnil(l);
+			lua_pushstring(l, "incompatible source and destination sizes");
+			return 2;
+		}
+	} else if ((rc == 2) || (rc == 4) || (rc == 5)) {
+		if ((srcInfo.width != dstInfo.width) || (srcInfo.height != dstInfo.height) ||
+				(inPlace && (srcInfo.bytesPerRow != dstInfo.bytesPerRow))) {
+			lua_pushnil(l);
+			lua_pushstring(l, "incompatible source and destination sizes");
+			return 2;
+		}
+	} else {
+		lua_pushnil(l);
+		lua_pushstring(l, "unsupported rotation");
+		return 2;
+	}
+
+	RotateContext context;
+	context.srcImageData = srcImageData;
+	context.srcInfo = srcInfo;
+	context.dstImageData = dstImageData;
+	context.dstInfo = dstInfo;
+	context.rc = rc;
+	context.inPlace = inPlace;
+	runBands(rotateBand, &context, getBandCount(getRotateRows(&context), MIN_BAND_ROWS));
+	return 0;
+}
+
+typedef struct SubsampleContextStruct {
+	unsigned char *srcImageData;
+	PixmapInfo srcInfo;
+	unsigned char *dstImageData;
+	PixmapInfo dstInfo;
+	int failed;
+} SubsampleContext;
+
+/*
+* The bands are made of destination rows, each band reads the source rows overlapping its destination rows.
+*/
+static void subsampleBilinearBand(void *context, int band, int bandCount) {
+	SubsampleContext *c = (SubsampleContext *) context;
+	unsigned char *srcImageData = c->srcImageData;
+	unsigned char *dstImageData = c->dstImageData;
+	PixmapInfo srcInfo = c->srcInfo;
+	PixmapInfo dstInfo = c->dstInfo;
+	int dStart, dEnd;
+	getBandRows(dstInfo.height, band, bandCount, &dStart, &dEnd);
+
+	// components per row
+	int cpr = srcInfo.width * srcInfo.components;
+	unsigned long *work = (unsigned long *)calloc(cpr * 2, sizeof(unsigned long));
+	if (work == NULL) {
+		c->failed = 1;
+		return;
+	}
+	unsigned long *divs = work + cpr;
+
+	int yFirst = dStart * srcInfo.height / dstInfo.height - 1;
+	int yLast = dEnd * srcInfo.height / dstInfo.height + 2;
+	if (yFirst < 0) {
+		yFirst = 0;
+	}
+	if (yLast > srcInfo.height) {
+		yLast = srcInfo.height;
+	}
+
+    int i, x, y = 0, xoffset, yoffset;
+    int xd = 0, yd = 0, woffset, xdoffset, ydoffset;
+    int curr, next = 0, nyd = 0, cp, np, yp, ydd, ypass;
+    int xcurr, xnext = 0, nxd = 0, xcp, xnp, xp, xdd, xpass;
+	next = yFirst * dstInfo.height * 100 / srcInfo.height;
+	nyd = next / 100;
+    for (y = yFirst; y < yLast; y++) {
+    	yoffset = y * srcInfo.bytesPerRow;
+    	curr = next;
+    	next = (y + 1) * dstInfo.height * 100 / srcInfo.height;
+
+        yd = nyd;
+        nyd = next / 100;
+
+        if ((nyd != yd) && (y + 1 < srcInfo.height)) {
+        	// the destination row is going to change
+        	cp = (100 - (curr % 100)) * 100 / (next - curr);
+        	//np = (next % 100) * 100 / (next - curr);
+        	np = 100 - cp;
+        	ypass = 2;
+        } else {
+        	cp = np = 100;
+        	ypass = 1;
+        }
+		yp = cp;
+		ydd = yd;
+        while (--ypass >= 0) {
+        	if ((ydd < dStart) || (ydd >= dEnd)) {
+        		// the destination row belongs to another band
+    			yp = np;
+    			ydd = nyd;
+        		continue;
+        	}
+            ydoffset = ydd * dstInfo.bytesPerRow;
+            //trace("y %d => %d %d%%", y, ydd, yp);
+			xnext = 0;
+			nxd = 0;
+	        for (x = 0; x < srcInfo.width; x++) {
+	        	xoffset = yoffset + x * srcInfo.components;
+	        	xcurr = xnext;
+	        	xnext = (x + 1) * dstInfo.width * 100 / srcInfo.width;
+
+	            xd = nxd;
+	            nxd = xnext / 100;
+
+	            if ((nxd != xd) && (x + 1 < srcInfo.width)) {
+	            	// the destination column is going to change
+	            	xcp = (100 - (xcurr % 100)) * 100 / (xnext - xcurr);
+	            	//np = (next % 100) * 100 / (next - curr);
+	            	xnp = 100 - xcp;
+	            	xpass = 2;
+	            } else {
+	            	xcp = xnp = 100;
+	            	xpass = 1;
+	            }
+	    		xp = xcp;
+	    		xdd = xd;
+	            while (--xpass >= 0) {
+		            woffset = xdd * dstInfo.components;
+					int percent = xp * yp / 100;
+	            	//if ((y == 0) || (yp != 100)) jls_info("x %d => %d %d%% (%d%%)", x, xdd, xp, percent);
+            		divs[woffset] += percent;
+	            	for (i = 0; i < srcInfo.components; i++) {
+	            		work[woffset + i] += srcImageData[xoffset + i] * percent / 100;
+	                }
+	    			xp = xnp;
+	    			xdd = nxd;
+	            }
+	        }
+	        if (nyd != ydd) {
+	            for (xd = 0; xd < dstInfo.width; xd++) {
+	            	xdoffset = ydoffset + xd * dstInfo.components;
+	            	woffset = xd * dstInfo.components;
+	            	for (i = 0; i < dstInfo.components; i++) {
+	            		dstImageData[xdoffset + i] = work[woffset + i] * 100 / divs[woffset];
+	            		work[woffset + i] = 0;
+	                }
+	            	divs[woffset] = 0;
+	            }
+	            //trace("row %d completed", yd);
+	        }
+			yp = np;
+			ydd = nyd;
+        }
+    }
+	free(work);
+}
+
+static int luajpeg_subsampleBilinear(lua_State *l) {
+	trace("luajpeg_subsampleBilinear()\n");
+
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	//size_t srcImageLength = lua_rawlen(l, 1);
+	unsigned char *srcImageData = (unsigned char *)lua_touserdata(l, 1);
 	
-	PixmapInfo pi;
+	PixmapInfo srcInfo;
 	luaL_checktype(l, 2, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 2, &pi);
-	if (pi.components > MAX_PIXEL_COMPONENTS) {
+	getPixmapInfoFromTableField(l, 2, &srcInfo);
+
+	luaL_checktype(l, 3, LUA_TUSERDATA);
+	//size_t dstImageLength = lua_rawlen(l, 3);
+	unsigned char *dstImageData = (unsigned char *)lua_touserdata(l, 3);
+	
+	PixmapInfo dstInfo;
+	luaL_checktype(l, 4, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 4, &dstInfo);
+
+	// the work buffer, argument 5, is now allocated for each band
+
+	if (srcInfo.components != dstInfo.components) {
 		lua_pushnil(l);
-		lua_pushstring(l, "too much components");
+		lua_pushstring(l, "components differ");
+		return 2;
+	}
+    if ((srcInfo.width <= dstInfo.width) || (srcInfo.height <= dstInfo.height)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid image sizes for subsampling");
+		return 2;
+    }
+
+	SubsampleContext context;
+	context.srcImageData = srcImageData;
+	context.srcInfo = srcInfo;
+	context.dstImageData = dstImageData;
+	context.dstInfo = dstInfo;
+	context.failed = 0;
+	runBands(subsampleBilinearBand, &context, getBandCount(dstInfo.height, MIN_BAND_ROWS));
+	if (context.failed) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate subsampling buffers");
+		return 2;
+	}
+	return 0;
+}
+
+
+/*
+* The resampling is separable, the source rows are resampled horizontally then the destination rows vertically.
+* The contributions of the source pixels to each destination pixel are computed once for each axis,
+* the weights are fixed-point values summing to one.
+* The horizontal results keep RESAMPLE_EXTRA_BITS bits of fraction.
+*/
+#define RESAMPLE_BITS 14
+#define RESAMPLE_EXTRA_BITS 6
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define RESAMPLE_BOX 0
+#define RESAMPLE_BILINEAR 1
+#define RESAMPLE_BICUBIC 2
+#define RESAMPLE_LANCZOS3 3
+
+static const char *RESAMPLE_OPTIONS[] = { "box", "bilinear", "bicubic", "lanczos3", NULL };
+static const int RESAMPLE_VALUES[] = { RESAMPLE_BOX, RESAMPLE_BILINEAR, RESAMPLE_BICUBIC, RESAMPLE_LANCZOS3 };
+
+// The half width of the filters
+static const double RESAMPLE_SUPPORTS[] = { 0.5, 1.0, 2.0, 3.0 };
+
+static double resampleFilter(int filter, double x) {
+	x = fabs(x);
+	switch (filter) {
+	case RESAMPLE_BOX:
+		return x <= 0.5 ? 1.0 : 0.0;
+	case RESAMPLE_BILINEAR:
+		return x < 1.0 ? 1.0 - x : 0.0;
+	case RESAMPLE_BICUBIC:
+		// Catmull-Rom, a = -0.5
+		if (x < 1.0) {
+			return (1.5 * x - 2.5) * x * x + 1.0;
+		}
+		if (x < 2.0) {
+			return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+		}
+		return 0.0;
+	case RESAMPLE_LANCZOS3:
+		if (x < 1e-8) {
+			return 1.0;
+		}
+		if (x < 3.0) {
+			double px = M_PI * x;
+			return 3.0 * sin(px) * sin(px / 3.0) / (px * px);
+		}
+		return 0.0;
+	}
+	return 0.0;
+}
+
+typedef struct ResampleAxisStruct {
+	int *starts; // the first source index of each destination index
+	int *counts; // the number of source indexes of each destination index
+	int *weights; // size weights for each destination index
+	int size; // the maximum number of source indexes for a destination index
+} ResampleAxis;
+
+static void freeResampleAxis(ResampleAxis *a) {
+	free(a->starts);
+	free(a->counts);
+	free(a->weights);
+}
+
+/*
+* Computes the contributions of the source indexes to each destination index, returns 0 on failure.
+* When downscaling, the filter is stretched to cover all the source pixels.
+*/
+static int newResampleAxis(ResampleAxis *a, int filter, int srcSize, int dstSize) {
+	double scale = (double) srcSize / dstSize;
+	double filterScale = scale > 1.0 ? scale : 1.0;
+	double support = RESAMPLE_SUPPORTS[filter] * filterScale;
+	int d, i, first, last, count, largest;
+	a->size = (int) ceil(support) * 2 + 1;
+	a->starts = (int *)malloc(dstSize * sizeof(int));
+	a->counts = (int *)malloc(dstSize * sizeof(int));
+	a->weights = (int *)malloc((size_t) dstSize * a->size * sizeof(int));
+	double *values = (double *)malloc(a->size * sizeof(double));
+	if ((a->starts == NULL) || (a->counts == NULL) || (a->weights == NULL) || (values == NULL)) {
+		freeResampleAxis(a);
+		free(values);
+		return 0;
+	}
+	for (d = 0; d < dstSize; d++) {
+		double center = (d + 0.5) * scale;
+		first = (int) floor(center - support + 0.5);
+		last = (int) floor(center + support + 0.5);
+		if (first < 0) {
+			first = 0;
+		}
+		if (last > srcSize) {
+			last = srcSize;
+		}
+		if (last - first > a->size) {
+			last = first + a->size;
+		}
+		double total = 0.0;
+		for (i = first; i < last; i++) {
+			total += values[i - first] = resampleFilter(filter, (i + 0.5 - center) / filterScale);
+		}
+		// the zero weights at the ends are not used
+		while ((last - 1 > first) && (values[last - 1 - first] == 0.0)) {
+			last--;
+		}
+		while ((first + 1 < last) && (values[0] == 0.0)) {
+			memmove(values, values + 1, (last - first - 1) * sizeof(double));
+			first++;
+		}
+		count = last - first;
+		int *weights = a->weights + d * a->size;
+		int sum = 0;
+		largest = 0;
+		for (i = 0; i < count; i++) {
+			double value = total != 0.0 ? values[i] / total : (i == 0 ? 1.0 : 0.0);
+			weights[i] = (int) floor(value * (1 << RESAMPLE_BITS) + 0.5);
+			sum += weights[i];
+			if (weights[i] > weights[largest]) {
+				largest = i;
+			}
+		}
+		// the rounding error goes to the largest weight so that the weights sum to one
+		weights[largest] += (1 << RESAMPLE_BITS) - sum;
+		a->starts[d] = first;
+		a->counts[d] = count;
+	}
+	free(values);
+	return 1;
+}
+
+typedef struct ResizeContextStruct {
+	unsigned char *srcImageData;
+	PixmapInfo srcInfo;
+	unsigned char *dstImageData;
+	PixmapInfo dstInfo;
+	ResampleAxis horizontal;
+	ResampleAxis vertical;
+	int failed;
+} ResizeContext;
+
+static inline void resampleRowHorizontal(const ResizeContext *c, const unsigned char *srcRow, int *dstRow, const int components) {
+	const ResampleAxis *a = &c->horizontal;
+	int x, k, i, sum;
+	for (x = 0; x < (int) c->dstInfo.width; x++) {
+		const int *weights = a->weights + x * a->size;
+		const unsigned char *src = srcRow + a->starts[x] * components;
+		int count = a->counts[x];
+		for (k = 0; k < components; k++) {
+			sum = 1 << (RESAMPLE_BITS - RESAMPLE_EXTRA_BITS - 1);
+			for (i = 0; i < count; i++) {
+				sum += src[i * components + k] * weights[i];
+			}
+			dstRow[x * components + k] = sum >> (RESAMPLE_BITS - RESAMPLE_EXTRA_BITS);
+		}
+	}
+}
+
+static void resampleVertical(const ResizeContext *c, const int **rows, const int *weights, int count, unsigned char *dstRow) {
+	int samples = (int) c->dstInfo.width * c->dstInfo.components;
+	int s, i, sum;
+	for (s = 0; s < samples; s++) {
+		sum = 1 << (RESAMPLE_BITS + RESAMPLE_EXTRA_BITS - 1);
+		for (i = 0; i < count; i++) {
+			sum += rows[i][s] * weights[i];
+		}
+		sum >>= RESAMPLE_BITS + RESAMPLE_EXTRA_BITS;
+		dstRow[s] = (unsigned char) FIX_BYTE(sum);
+	}
+}
+
+/*
+* The bands are made of destination rows, the horizontally resampled source rows are kept in a rolling cache
+* of as many rows as the vertical contributions so that each source row is resampled once in the band.
+*/
+static void resizeBand(void *context, int band, int bandCount) {
+	ResizeContext *c = (ResizeContext *) context;
+	const ResampleAxis *a = &c->vertical;
+	int components = c->srcInfo.components;
+	int samples = (int) c->dstInfo.width * components;
+	int yStart, yEnd, y, i, sy, slot;
+	getBandRows(c->dstInfo.height, band, bandCount, &yStart, &yEnd);
+	int *cache = (int *)malloc((size_t) a->size * samples * sizeof(int));
+	int *cachedRows = (int *)malloc(a->size * sizeof(int));
+	const int **rows = (const int **)malloc(a->size * sizeof(int *));
+	if ((cache == NULL) || (cachedRows == NULL) || (rows == NULL)) {
+		free(cache);
+		free(cachedRows);
+		free(rows);
+		c->failed = 1;
+		return;
+	}
+	for (i = 0; i < a->size; i++) {
+		cachedRows[i] = -1;
+	}
+	for (y = yStart; y < yEnd; y++) {
+		for (i = 0; i < a->counts[y]; i++) {
+			sy = a->starts[y] + i;
+			slot = sy % a->size;
+			int *row = cache + slot * samples;
+			if (cachedRows[slot] != sy) {
+				const unsigned char *srcRow = c->srcImageData + sy * c->srcInfo.bytesPerRow;
+				switch (components) {
+				case 1:
+					resampleRowHorizontal(c, srcRow, row, 1);
+					break;
+				case 3:
+					resampleRowHorizontal(c, srcRow, row, 3);
+					break;
+				case 4:
+					resampleRowHorizontal(c, srcRow, row, 4);
+					break;
+				default:
+					resampleRowHorizontal(c, srcRow, row, components);
+					break;
+				}
+				cachedRows[slot] = sy;
+			}
+			rows[i] = row;
+		}
+		resampleVertical(c, rows, a->weights + y * a->size, a->counts[y], c->dstImageData + y * c->dstInfo.bytesPerRow);
+	}
+	free(cache);
+	free(cachedRows);
+	free(rows);
+}
+
+/*
+* Resizes the source image into the destination image using the filter option, box, bilinear, bicubic or lanczos3.
+* The image can be downscaled or upscaled at any ratio on each axis.
+*/
+static int luajpeg_resize(lua_State *l) {
+	trace("luajpeg_resize()\n");
+
+	luaL_checktype(l, 1, LUA_TUSERDATA);
+	size_t srcImageLength = lua_rawlen(l, 1);
+	unsigned char *srcImageData = (unsigned char *)lua_touserdata(l, 1);
+
+	PixmapInfo srcInfo;
+	luaL_checktype(l, 2, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 2, &srcInfo);
+
+	luaL_checktype(l, 3, LUA_TUSERDATA);
+	size_t dstImageLength = lua_rawlen(l, 3);
+	unsigned char *dstImageData = (unsigned char *)lua_touserdata(l, 3);
+
+	PixmapInfo dstInfo;
+	luaL_checktype(l, 4, LUA_TTABLE);
+	getPixmapInfoFromTableField(l, 4, &dstInfo);
+
+	int filter = RESAMPLE_BICUBIC;
+	if (lua_istable(l, 5)) {
+		filter = checkOptionField(l, 5, "filter", "bicubic", RESAMPLE_OPTIONS, RESAMPLE_VALUES);
+	}
+
+	if (srcInfo.components != dstInfo.components) {
+		lua_pushnil(l);
+		lua_pushstring(l, "components differ");
+		return 2;
+	}
+	if ((srcInfo.width < 1) || (srcInfo.height < 1) || (dstInfo.width < 1) || (dstInfo.height < 1) ||
+			(filter < RESAMPLE_BOX) || (filter > RESAMPLE_LANCZOS3)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "invalid resize argument");
+		return 2;
+	}
+	if ((srcImageLength < srcInfo.bytesPerRow * srcInfo.height) || (dstImageLength < dstInfo.bytesPerRow * dstInfo.height)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "image buffer too small");
+		return 2;
+	}
+
+	ResizeContext context;
+	context.srcImageData = srcImageData;
+	context.srcInfo = srcInfo;
+	context.dstImageData = dstImageData;
+	context.dstInfo = dstInfo;
+	context.failed = 0;
+	if (!newResampleAxis(&context.horizontal, filter, (int) srcInfo.width, (int) dstInfo.width)) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate resize buffers");
+		return 2;
+	}
+	if (!newResampleAxis(&context.vertical, filter, (int) srcInfo.height, (int) dstInfo.height)) {
+		freeResampleAxis(&context.horizontal);
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate resize buffers");
+		return 2;
+	}
+	trace("resize %lux%lu to %lux%lu, contributions %dx%d\n", srcInfo.width, srcInfo.height, dstInfo.width, dstInfo.height,
+		context.horizontal.size, context.vertical.size);
+	runBands(resizeBand, &context, getBandCount(dstInfo.height, MIN_BAND_ROWS));
+	freeResampleAxis(&context.horizontal);
+	freeResampleAxis(&context.vertical);
+	if (context.failed) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate resize buffers");
 		return 2;
 	}
-	size_t image_size = (size_t) (pi.bytesPerRow * pi.height);
-	if (imageLength < image_size) {
-		lua_pushnil(l);
-		lua_pushstring(l, "image buffer too small");
-		return 2;
+	return 0;
+}
+
+/*
+********************************************************************************
+* Pipeline functions
+********************************************************************************
+*/
+
+/*
+* The pipeline decodes the image by strips of rows, passes each strip through the operations then encodes it,
+* the whole image is never in memory.
+* The row operations work in place on the strip. The convolution and the resize keep a window of source rows
+* for their rows above and below, a source row is dropped as soon as no destination row needs it.
+*/
+
+#define PIPELINE_COMPONENT_MATRIX 0
+#define PIPELINE_COMPONENT_SWAP 1
+#define PIPELINE_CONVOLVE 2
+#define PIPELINE_UNSHARP_MASK 3
+#define PIPELINE_RESIZE 4
+#define PIPELINE_ROTATE 5
+
+static const char *PIPELINE_OPTIONS[] = { "componentMatrix", "componentSwap", "convolve", "unsharpMask", "resize", "rotate", NULL };
+static const int PIPELINE_VALUES[] = { PIPELINE_COMPONENT_MATRIX, PIPELINE_COMPONENT_SWAP, PIPELINE_CONVOLVE,
+	PIPELINE_UNSHARP_MASK, PIPELINE_RESIZE, PIPELINE_ROTATE };
+
+/*
+* The window rows are consecutive source rows, the rows are appended at the end and dropped from the start.
+*/
+typedef struct PipelineWindowStruct {
+	unsigned char *data;
+	size_t rowSize;
+	int start; // the source row of the first window row
+	int rows;
+	int capacity;
+} PipelineWindow;
+
+#define PIPELINE_WINDOW_ROW(_w, _y) ((_w)->data + (size_t) ((_y) - (_w)->start) * (_w)->rowSize)
+
+/*
+* Drops the rows before the specified source row then appends rows, returns the first appended row or NULL on failure.
+*/
+static unsigned char *pipelineWindowAppend(PipelineWindow *w, int first, int count) {
+	int drop = first - w->start;
+	if (drop > w->rows) {
+		drop = w->rows;
+	}
+	if (drop > 0) {
+		memmove(w->data, w->data + drop * w->rowSize, (w->rows - drop) * w->rowSize);
+		w->start += drop;
+		w->rows -= drop;
+	}
+	if (w->rows + count > w->capacity) {
+		unsigned char *data = (unsigned char *)realloc(w->data, (w->rows + count) * w->rowSize);
+		if (data == NULL) {
+			return NULL;
+		}
+		w->data = data;
+		w->capacity = w->rows + count;
+	}
+	unsigned char *row = w->data + w->rows * w->rowSize;
+	w->rows += count;
+	return row;
+}
+
+typedef struct PipelineStageStruct {
+	int op;
+	PixmapInfo srcInfo; // the received rows, the height is the whole image height
+	PixmapInfo dstInfo; // the produced rows
+	int srcRows; // the number of rows received
+	int dstRows; // the number of rows produced
+	PipelineWindow window;
+	size_t sumsOffset; // the offset of the horizontal sums in the convolution window rows
+	int *keepFrom; // for each resize destination row, the first source row still needed by the next rows
+	unsigned char *strip; // the produced rows
+	int stripCapacity;
+	const unsigned char *input; // the received rows being processed
+	int yStart; // the rows being processed
+	int yEnd;
+	int failed;
+	ComponentMatrixContext matrix;
+	ComponentSwapContext swap;
+	ConvolveContext convolve;
+	RotateContext rotate;
+	ResizeContext resize;
+} PipelineStage;
+
+typedef struct PipelineStruct {
+	PipelineStage *stages;
+	int stageCount;
+	JpegCompress *jc; // the compressor receiving the rows of the last stage
+	unsigned char *image; // the image receiving the rows of the last stage when there is no compressor
+	size_t imageBytesPerRow;
+	size_t imageLength; // the length of the rows received by the image
+} Pipeline;
+
+static unsigned char *pipelineStageStrip(PipelineStage *s, int rowCount) {
+	if (rowCount > s->stripCapacity) {
+		unsigned char *strip = (unsigned char *)realloc(s->strip, rowCount * s->dstInfo.bytesPerRow);
+		if (strip == NULL) {
+			return NULL;
+		}
+		s->strip = strip;
+		s->stripCapacity = rowCount;
+	}
+	return s->strip;
+}
+
+static void freePipelineStages(PipelineStage *stages, int stageCount) {
+	int i;
+	for (i = 0; i < stageCount; i++) {
+		PipelineStage *s = stages + i;
+		switch (s->op) {
+		case PIPELINE_CONVOLVE:
+		case PIPELINE_UNSHARP_MASK:
+			if (s->convolve.kernel != NULL) {
+				freeConvolveKernel(&s->convolve);
+			}
+			break;
+		case PIPELINE_RESIZE:
+			if (s->keepFrom != NULL) {
+				freeResampleAxis(&s->resize.horizontal);
+				freeResampleAxis(&s->resize.vertical);
+			}
+			break;
+		}
+		free(s->keepFrom);
+		free(s->window.data);
+		free(s->strip);
+	}
+	free(stages);
+}
+
+// Computes the horizontal sums of the received rows, they are kept after the pixels in the window rows
+static void pipelineConvolveSumsBand(void *context, int band, int bandCount) {
+	PipelineStage *s = (PipelineStage *) context;
+	const ConvolveContext *c = &s->convolve;
+	int width = (int) c->pi.width;
+	int yStart, yEnd, y, left, right;
+	getBandRows(s->yEnd - s->yStart, band, bandCount, &yStart, &yEnd);
+	convolveInteriorColumns(c, &left, &right);
+	for (y = s->yStart + yStart; y < s->yStart + yEnd; y++) {
+		const unsigned char *row = PIPELINE_WINDOW_ROW(&s->window, y);
+		void *sums = PIPELINE_WINDOW_ROW(&s->window, y) + s->sumsOffset;
+		if (c->integer) {
+			convolveIntHorizontal(c, row, (int *) sums, 0, left, 1);
+			convolveIntHorizontal(c, row, (int *) sums, left, right, 0);
+			convolveIntHorizontal(c, row, (int *) sums, right, width, 1);
+		} else {
+			convolveHorizontal(c, row, (double *) sums, 0, left, 1);
+			convolveHorizontal(c, row, (double *) sums, left, right, 0);
+			convolveHorizontal(c, row, (double *) sums, right, width, 1);
+		}
+	}
+}
+
+// Convolves the destination rows from yStart to yEnd into the strip, all their source rows are in the window
+static void pipelineConvolveBand(void *context, int band, int bandCount) {
+	PipelineStage *s = (PipelineStage *) context;
+	const ConvolveContext *c = &s->convolve;
+	int kernelWidth = c->kernelWidth, kernelHeight = c->kernelHeight;
+	int width = (int) c->pi.width, height = (int) c->pi.height;
+	size_t bytesPerRow = c->pi.bytesPerRow;
+	int yStart, yEnd, y, j, n, sy, left, right;
+	getBandRows(s->yEnd - s->yStart, band, bandCount, &yStart, &yEnd);
+	const void **srcRows = (const void **)malloc(kernelHeight * sizeof(void *));
+	const unsigned char **windowRows = (const unsigned char **)malloc(kernelHeight * sizeof(unsigned char *));
+	const double **kernelRows = (const double **)malloc(kernelHeight * sizeof(double *));
+	const int **intKernelRows = (const int **)malloc(kernelHeight * sizeof(int *));
+	double *weights = (double *)malloc(kernelHeight * sizeof(double));
+	int *intWeights = (int *)malloc(kernelHeight * sizeof(int));
+	if ((srcRows == NULL) || (windowRows == NULL) || (kernelRows == NULL) || (intKernelRows == NULL) || (weights == NULL) || (intWeights == NULL)) {
+		free(srcRows);
+		free(windowRows);
+		free(kernelRows);
+		free(intKernelRows);
+		free(weights);
+		free(intWeights);
+		s->failed = 1;
+		return;
+	}
+	convolveInteriorColumns(c, &left, &right);
+	for (y = s->yStart + yStart; y < s->yStart + yEnd; y++) {
+		unsigned char *dstRow = s->strip + (y - s->yStart) * bytesPerRow;
+		// the components that are not convolved are kept
+		memcpy(dstRow, PIPELINE_WINDOW_ROW(&s->window, y), bytesPerRow);
+		double div = 0.0;
+		int intDiv = 0;
+		for (j = 0, n = 0; j < kernelHeight; j++) {
+			sy = y - c->kernelY + j;
+			if ((sy < 0) || (sy >= height)) {
+				windowRows[j] = NULL;
+				continue;
+			}
+			windowRows[j] = PIPELINE_WINDOW_ROW(&s->window, sy);
+			if (c->separable) {
+				srcRows[n] = windowRows[j] + s->sumsOffset;
+				div += weights[n] = c->columnKernel[j];
+				if (c->integer) {
+					intDiv += intWeights[n] = c->intColumnKernel[j];
+				}
+			} else {
+				srcRows[n] = windowRows[j];
+				kernelRows[n] = c->kernel + j * kernelWidth;
+				if (c->integer) {
+					intKernelRows[n] = c->intKernel + j * kernelWidth;
+					intDiv += c->intKernelRowSums[j];
+				}
+			}
+			n++;
+		}
+		if (c->separable) {
+			if (c->integer) {
+				convolveIntVertical(c, (const int **) srcRows, intWeights, n, intDiv, dstRow);
+			} else {
+				convolveVertical(c, (const double **) srcRows, weights, n, div, dstRow);
+			}
+		} else if (c->integer) {
+			convolveIntColumns(c, (const unsigned char **) srcRows, intKernelRows, n, intDiv, dstRow, 0, left, 1);
+			convolveIntColumns(c, (const unsigned char **) srcRows, intKernelRows, n, intDiv, dstRow, left, right, 0);
+			convolveIntColumns(c, (const unsigned char **) srcRows, intKernelRows, n, intDiv, dstRow, right, width, 1);
+		} else {
+			div = convolveDiv(c, windowRows, 0, kernelWidth);
+			convolveColumns(c, (const unsigned char **) srcRows, kernelRows, n, windowRows, div, dstRow, 0, left, 1);
+			convolveColumns(c, (const unsigned char **) srcRows, kernelRows, n, windowRows, div, dstRow, left, right, 0);
+			convolveColumns(c, (const unsigned char **) srcRows, kernelRows, n, windowRows, div, dstRow, right, width, 1);
+		}
+	}
+	free(srcRows);
+	free(windowRows);
+	free(kernelRows);
+	free(intKernelRows);
+	free(weights);
+	free(intWeights);
+}
+
+// Resamples horizontally the received rows into the window
+static void pipelineResizeHorizontalBand(void *context, int band, int bandCount) {
+	PipelineStage *s = (PipelineStage *) context;
+	const ResizeContext *c = &s->resize;
+	int components = c->srcInfo.components;
+	int yStart, yEnd, y;
+	getBandRows(s->yEnd - s->yStart, band, bandCount, &yStart, &yEnd);
+	for (y = s->yStart + yStart; y < s->yStart + yEnd; y++) {
+		const unsigned char *srcRow = s->input + (y - s->yStart) * c->srcInfo.bytesPerRow;
+		int *row = (int *) PIPELINE_WINDOW_ROW(&s->window, y);
+		switch (components) {
+		case 1:
+			resampleRowHorizontal(c, srcRow, row, 1);
+			break;
+		case 3:
+			resampleRowHorizontal(c, srcRow, row, 3);
+			break;
+		case 4:
+			resampleRowHorizontal(c, srcRow, row, 4);
+			break;
+		default:
+			resampleRowHorizontal(c, srcRow, row, components);
+			break;
+		}
+	}
+}
+
+static void pipelineResizeVerticalBand(void *context, int band, int bandCount) {
+	PipelineStage *s = (PipelineStage *) context;
+	const ResizeContext *c = &s->resize;
+	const ResampleAxis *a = &c->vertical;
+	int yStart, yEnd, y, i;
+	getBandRows(s->yEnd - s->yStart, band, bandCount, &yStart, &yEnd);
+	const int **rows = (const int **)malloc(a->size * sizeof(int *));
+	if (rows == NULL) {
+		s->failed = 1;
+		return;
 	}
-	double work[MAX_PIXEL_COMPONENTS];
-	double matrix[MAX_SQUARE_COMPONENTS];
-	double delta[MAX_SQUARE_COMPONENTS];
-	int matrixLength = pi.components * pi.components;
-	int i;
-	for (i = 0; i < matrixLength; i++) {
-		matrix[i] = 1.0;
+	for (y = s->yStart + yStart; y < s->yStart + yEnd; y++) {
+		for (i = 0; i < a->counts[y]; i++) {
+			rows[i] = (const int *) PIPELINE_WINDOW_ROW(&s->window, a->starts[y] + i);
+		}
+		resampleVertical(c, rows, a->weights + y * a->size, a->counts[y], s->strip + (y - s->yStart) * c->dstInfo.bytesPerRow);
 	}
-	for (i = 0; i < pi.components; i++) {
-		delta[i] = 0.0;
+	free(rows);
+}
+
+static const char *pipelinePush(Pipeline *p, int index, unsigned char *rows, int rowCount);
+
+/*
+* Produces the destination rows from the last produced row to yEnd then pushes them to the next stage.
+*/
+static const char *pipelineProduce(Pipeline *p, int index, int yEnd, BandFunction fn) {
+	PipelineStage *s = p->stages + index;
+	int rowCount = yEnd - s->dstRows;
+	if (rowCount <= 0) {
+		return NULL;
 	}
-	if (lua_istable(l, 3)) {
-		for (i = 0; i < matrixLength; i++) {
-			if (lua_geti(l, 3, i) == LUA_TNUMBER) {
-				matrix[i] = (int) lua_tonumber(l, -1);
+	if (pipelineStageStrip(s, rowCount) == NULL) {
+		return "cannot allocate pipeline buffers";
+	}
+	s->yStart = s->dstRows;
+	s->yEnd = yEnd;
+	s->failed = 0;
+	runBands(fn, s, getBandCount(rowCount, MIN_BAND_ROWS));
+	if (s->failed) {
+		return "cannot allocate pipeline buffers";
+	}
+	s->dstRows = yEnd;
+	return pipelinePush(p, index + 1, s->strip, rowCount);
+}
+
+/*
+* A destination row is convolved once its last source row is received, the source rows are kept in the window
+* while the next destination row needs them.
+*/
+static const char *pipelineConvolvePush(Pipeline *p, int index, unsigned char *rows, int rowCount) {
+	PipelineStage *s = p->stages + index;
+	const ConvolveContext *c = &s->convolve;
+	int below = c->kernelHeight - 1 - c->kernelY;
+	int y;
+	if (rowCount > 0) {
+		unsigned char *row = pipelineWindowAppend(&s->window, s->dstRows - c->kernelY, rowCount);
+		if (row == NULL) {
+			return "cannot allocate pipeline buffers";
+		}
+		for (y = 0; y < rowCount; y++, row += s->window.rowSize) {
+			memcpy(row, rows + y * s->srcInfo.bytesPerRow, s->srcInfo.bytesPerRow);
+		}
+		if (c->separable) {
+			s->yStart = s->srcRows;
+			s->yEnd = s->srcRows + rowCount;
+			runBands(pipelineConvolveSumsBand, s, getBandCount(rowCount, MIN_BAND_ROWS));
+		}
+		s->srcRows += rowCount;
+	}
+	const char *err = pipelineProduce(p, index, rows == NULL ? (int) s->dstInfo.height : s->srcRows - below, pipelineConvolveBand);
+	if ((err == NULL) && (rows == NULL)) {
+		err = pipelinePush(p, index + 1, NULL, 0);
+	}
+	return err;
+}
+
+/*
+* A destination row is resized once its last source row is received, the source rows are resampled horizontally
+* when received and kept in the window while the next destination rows need them.
+*/
+static const char *pipelineResizePush(Pipeline *p, int index, unsigned char *rows, int rowCount) {
+	PipelineStage *s = p->stages + index;
+	const ResampleAxis *a = &s->resize.vertical;
+	int height = (int) s->dstInfo.height;
+	int yEnd = s->dstRows;
+	if (rowCount > 0) {
+		int first = s->dstRows < height ? s->keepFrom[s->dstRows] : s->srcRows;
+		if (pipelineWindowAppend(&s->window, first, rowCount) == NULL) {
+			return "cannot allocate pipeline buffers";
+		}
+		s->input = rows;
+		s->yStart = s->srcRows;
+		s->yEnd = s->srcRows + rowCount;
+		runBands(pipelineResizeHorizontalBand, s, getBandCount(rowCount, MIN_BAND_ROWS));
+		s->srcRows += rowCount;
+	}
+	while ((yEnd < height) && (a->starts[yEnd] + a->counts[yEnd] <= s->srcRows)) {
+		yEnd++;
+	}
+	const char *err = pipelineProduce(p, index, yEnd, pipelineResizeVerticalBand);
+	if ((err == NULL) && (rows == NULL)) {
+		err = pipelinePush(p, index + 1, NULL, 0);
+	}
+	return err;
+}
+
+/*
+* Pushes rows to the stage at the specified index, the rows after the last stage are written to the compressor.
+* The rows are NULL once all the rows are pushed, the stages then produce their remaining rows.
+*/
+static const char *pipelinePush(Pipeline *p, int index, unsigned char *rows, int rowCount) {
+	if ((index == p->stageCount) && (p->jc == NULL)) {
+		if (rowCount > 0) {
+			memcpy(p->image + p->imageLength, rows, rowCount * p->imageBytesPerRow);
+			p->imageLength += rowCount * p->imageBytesPerRow;
+		}
+		return NULL;
+	}
+	if (index == p->stageCount) {
+		JpegCompress *jc = p->jc;
+		JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+		int rowsPerCall, i;
+		while (rowCount > 0) {
+			rowsPerCall = rowCount > MAX_ROWS_PER_CALL ? MAX_ROWS_PER_CALL : rowCount;
+			for (i = 0; i < rowsPerCall; i++) {
+				row_pointer[i] = (JSAMPROW) (rows + i * jc->bytesPerRow);
 			}
-			lua_pop(l, 1);
+			(void) jpeg_write_scanlines(&jc->cinfo, row_pointer, (JDIMENSION) rowsPerCall);
+			if (jc->destError != NULL) {
+				return jc->destError;
+			}
+			rows += rowsPerCall * jc->bytesPerRow;
+			rowCount -= rowsPerCall;
 		}
+		return NULL;
 	}
-	if (lua_istable(l, 4)) {
-		for (i = 0; i < pi.components; i++) {
-			if (lua_geti(l, 4, i) == LUA_TNUMBER) {
-				delta[i] = (int) lua_tonumber(l, -1);
+	PipelineStage *s = p->stages + index;
+	switch (s->op) {
+	case PIPELINE_CONVOLVE:
+	case PIPELINE_UNSHARP_MASK:
+		return pipelineConvolvePush(p, index, rows, rowCount);
+	case PIPELINE_RESIZE:
+		return pipelineResizePush(p, index, rows, rowCount);
+	}
+	// the row operations work in place
+	if (rowCount > 0) {
+		int bandCount = getBandCount(rowCount, MIN_BAND_ROWS);
+		switch (s->op) {
+		case PIPELINE_COMPONENT_MATRIX:
+			s->matrix.imageData = rows;
+			s->matrix.pi.height = rowCount;
+			runBands(componentMatrixBand, &s->matrix, bandCount);
+			break;
+		case PIPELINE_COMPONENT_SWAP:
+			s->swap.imageData = rows;
+			s->swap.pi.height = rowCount;
+			runBands(componentSwapBand, &s->swap, bandCount);
+			break;
+		case PIPELINE_ROTATE:
+			s->rotate.srcImageData = s->rotate.dstImageData = rows;
+			s->rotate.srcInfo.height = s->rotate.dstInfo.height = rowCount;
+			runBands(rotateBand, &s->rotate, bandCount);
+			break;
+		}
+	}
+	return pipelinePush(p, index + 1, rows, rowCount);
+}
+
+/*
+* Sets the resize stage to the specified size, the source info of the stage shall be set.
+*/
+static const char *pipelineSetResizeStage(PipelineStage *s, int filter, int width, int height) {
+	PixmapInfo *pi = &s->srcInfo;
+	ResizeContext *c = &s->resize;
+	s->op = PIPELINE_RESIZE;
+	s->dstInfo = s->srcInfo;
+	s->dstInfo.width = width;
+	s->dstInfo.height = height;
+	s->dstInfo.bytesPerRow = s->dstInfo.width * s->dstInfo.components;
+	if (((int) s->dstInfo.width < 1) || ((int) s->dstInfo.height < 1) || (filter < RESAMPLE_BOX) || (filter > RESAMPLE_LANCZOS3)) {
+		return "invalid resize argument";
+	}
+	c->srcInfo = *pi;
+	c->dstInfo = s->dstInfo;
+	if (!newResampleAxis(&c->horizontal, filter, (int) pi->width, (int) s->dstInfo.width)) {
+		return "cannot allocate resize buffers";
+	}
+	if (!newResampleAxis(&c->vertical, filter, (int) pi->height, (int) s->dstInfo.height)) {
+		freeResampleAxis(&c->horizontal);
+		return "cannot allocate resize buffers";
+	}
+	s->keepFrom = (int *)malloc(s->dstInfo.height * sizeof(int));
+	if (s->keepFrom == NULL) {
+		freeResampleAxis(&c->horizontal);
+		freeResampleAxis(&c->vertical);
+		return "cannot allocate resize buffers";
+	}
+	int y, first = (int) pi->height;
+	for (y = (int) s->dstInfo.height - 1; y >= 0; y--) {
+		if (c->vertical.starts[y] < first) {
+			first = c->vertical.starts[y];
+		}
+		s->keepFrom[y] = first;
+	}
+	s->window.rowSize = s->dstInfo.width * s->dstInfo.components * sizeof(int);
+	return NULL;
+}
+
+/*
+* Sets the stage from the operation table at the specified index, the source info of the stage shall be set.
+*/
+static const char *pipelineSetStage(lua_State *l, int i, PipelineStage *s) {
+	PixmapInfo *pi = &s->srcInfo;
+	s->op = checkOptionField(l, i, "op", NULL, PIPELINE_OPTIONS, PIPELINE_VALUES);
+	s->dstInfo = s->srcInfo;
+	switch (s->op) {
+	case PIPELINE_COMPONENT_MATRIX:
+		if (pi->components > MAX_PIXEL_COMPONENTS) {
+			return "too much components";
+		}
+		s->matrix.pi = *pi;
+		lua_getfield(l, i, "matrix");
+		lua_getfield(l, i, "delta");
+		getComponentMatrixArguments(l, lua_absindex(l, -2), lua_absindex(l, -1), &s->matrix);
+		lua_pop(l, 2);
+		break;
+	case PIPELINE_COMPONENT_SWAP:
+		if (pi->components > MAX_PIXEL_COMPONENTS) {
+			return "too much components";
+		}
+		s->swap.pi = *pi;
+		lua_getfield(l, i, "indices");
+		getComponentSwapArguments(l, lua_absindex(l, -1), &s->swap);
+		lua_pop(l, 1);
+		break;
+	case PIPELINE_CONVOLVE:
+	case PIPELINE_UNSHARP_MASK: {
+		ConvolveContext *c = &s->convolve;
+		const char *err = NULL;
+		c->pi = *pi;
+		if (s->op == PIPELINE_CONVOLVE) {
+			if (lua_getfield(l, i, "kernel") != LUA_TTABLE) {
+				err = "invalid kernel argument";
+			} else {
+				err = getConvolveArguments(l, lua_absindex(l, -1), i, c);
 			}
 			lua_pop(l, 1);
+		} else {
+			double radius = getNumberField(l, i, "radius", 1.0);
+			double amount = getNumberField(l, i, "amount", 1.0);
+			int threshold = getIntegerField(l, i, "threshold", 0);
+			c->componentStart = getIntegerField(l, i, "componentStart", 0);
+			c->componentStop = getIntegerField(l, i, "componentStop", pi->components - 1);
+			if ((radius < 0.0) || (amount < 0.0) || (amount > 255.0)) {
+				err = "invalid unsharp mask argument";
+			} else {
+				if (c->componentStart < 0) {
+					c->componentStart = 0;
+				}
+				if (c->componentStop >= pi->components) {
+					c->componentStop = pi->components - 1;
+				}
+				if (!newUnsharpMaskKernel(c, radius, amount, threshold)) {
+					err = "cannot allocate convolution buffers";
+				}
+			}
+		}
+		if (err != NULL) {
+			return err;
 		}
+		convolvePrepare(c);
+		// the horizontal sums are kept after the pixels, aligned for the sums
+		s->sumsOffset = (pi->bytesPerRow + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+		s->window.rowSize = s->sumsOffset;
+		if (c->separable) {
+			s->window.rowSize += pi->width * pi->components * (c->integer ? sizeof(int) : sizeof(double));
+		}
+		break;
 	}
-	int j, x, y, xoffset, yoffset;
-    for (y = 0; y < pi.height; y++) {
-        yoffset = y * pi.bytesPerRow;
-        for (x = 0; x < pi.width; x++) {
-            xoffset = yoffset + x * pi.components;
-        	for (i = 0; i < pi.components; i++) {
-        		work[i] = delta[i];
-            	for (j = 0; j < pi.components; j++) {
-            		work[i] += imageData[xoffset + j] * matrix[i * pi.components + j];
-                }
-            }
-        	for (i = 0; i < pi.components; i++) {
-    			imageData[xoffset + i] = FIX_BYTE(work[i]);
-            }
-        }
-    }
-
-	return 0;
+	case PIPELINE_RESIZE: {
+		int filter = checkOptionField(l, i, "filter", "bicubic", RESAMPLE_OPTIONS, RESAMPLE_VALUES);
+		return pipelineSetResizeStage(s, filter, getIntegerField(l, i, "width", (int) pi->width),
+			getIntegerField(l, i, "height", (int) pi->height));
+	}
+	case PIPELINE_ROTATE: {
+		int rc = checkOptionField(l, i, "mode", "flip-horizontal", ROTATE_OPTIONS, ROTATE_VALUES);
+		// only the horizontal flip is local to the rows
+		if (rc != 4) {
+			return "unsupported pipeline rotation";
+		}
+		s->rotate.srcInfo = s->rotate.dstInfo = *pi;
+		s->rotate.rc = rc;
+		s->rotate.inPlace = 1;
+		break;
+	}
+	}
+	return NULL;
 }
 
-static int luajpeg_componentSwap(lua_State *l) {
-	trace("luajpeg_componentSwap()\n");
-	luaL_checktype(l, 1, LUA_TUSERDATA);
-	size_t imageLength = lua_rawlen(l, 1);
-	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
-	
+/*
+* Decodes the image by strips, applies the operations on each strip then encodes it to the destination.
+* The operations are a list of tables with an op field, componentMatrix, componentSwap, convolve, unsharpMask, resize
+* or rotate, and the fields of the corresponding function arguments and options.
+* The rotation is limited to the horizontal flip, the other rotations need the whole image.
+* The compression options are the color space, the quality and the subsampling.
+* The destination is a function, a file or nil as for the compression.
+* The whole source shall be available, a suspending source aborts the decompression.
+* The decompress region, the raw data and the buffered image modes are not supported.
+*/
+static int luajpeg_pipeline(lua_State *l) {
+	trace("luajpeg_pipeline()\n");
+	JpegDecompress *jd = (JpegDecompress *)luaL_checkudata(l, 1, "jpeg_decompress");
+	JpegCompress *jc = (JpegCompress *)luaL_checkudata(l, 2, "jpeg_compress");
+	int stageCount = lua_istable(l, 3) ? (int) lua_rawlen(l, 3) : 0;
+	const char *err = NULL;
+	int i;
+
+	if (jd->runStep > 2) {
+		lua_pushnil(l);
+		lua_pushstring(l, "decompress already started");
+		return 2;
+	}
+	if (jd->region) {
+		lua_pushnil(l);
+		lua_pushstring(l, "region not supported by the pipeline");
+		return 2;
+	}
+	if (jd->runStep == 0) {
+		jd->runStep++;
+	}
+	if (jd->runStep == 1) {
+		trace("jpeg_read_header()\n");
+		if (jpeg_read_header(&jd->cinfo, TRUE) == JPEG_SUSPENDED) {
+			lua_pushnil(l);
+			lua_pushstring(l, "suspended");
+			return 2;
+		}
+		jd->runStep++;
+	}
+	// the pipeline always decodes interleaved pixels of the whole image
+	if (jd->cinfo.raw_data_out) {
+		lua_pushnil(l);
+		lua_pushstring(l, "raw data not supported by the pipeline");
+		return 2;
+	}
+	if (jd->cinfo.buffered_image) {
+		lua_pushnil(l);
+		lua_pushstring(l, "buffered image not supported by the pipeline");
+		return 2;
+	}
+	jpeg_calc_output_dimensions(&jd->cinfo);
+
+	Pipeline p;
+	p.jc = jc;
+	p.image = NULL;
+	p.stageCount = stageCount;
+	p.stages = (PipelineStage *)calloc(stageCount + 1, sizeof(PipelineStage));
+	if (p.stages == NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate pipeline buffers");
+		return 2;
+	}
 	PixmapInfo pi;
-	luaL_checktype(l, 2, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 2, &pi);
-	if (pi.components > MAX_PIXEL_COMPONENTS) {
+	pi.width = jd->cinfo.output_width;
+	pi.height = jd->cinfo.output_height;
+	pi.components = jd->cinfo.output_components;
+	pi.bytesPerRow = pi.width * pi.components;
+	for (i = 0; (i < stageCount) && (err == NULL); i++) {
+		lua_geti(l, 3, i + 1);
+		if (lua_istable(l, -1)) {
+			p.stages[i].srcInfo = pi;
+			err = pipelineSetStage(l, lua_absindex(l, -1), p.stages + i);
+			pi = p.stages[i].dstInfo;
+		} else {
+			err = "invalid pipeline operation";
+		}
+		lua_pop(l, 1);
+	}
+	if (err != NULL) {
+		freePipelineStages(p.stages, stageCount);
 		lua_pushnil(l);
-		lua_pushstring(l, "too much components");
+		lua_pushstring(l, err);
 		return 2;
 	}
-	size_t image_size = (size_t) (pi.bytesPerRow * pi.height);
-	if (imageLength < image_size) {
+
+	// the compressed image is the output of the last stage
+	jc->cinfo.image_width = pi.width;
+	jc->cinfo.image_height = pi.height;
+	jc->cinfo.input_components = pi.components;
+	jc->bytesPerRow = pi.bytesPerRow;
+	jc->rowsPerCall = 0;
+	const char *colorSpace = getOptionField(jd->cinfo.out_color_space, JCS_UNKNOWN, JCS_OPTIONS, JCS_VALUES);
+	jc->cinfo.in_color_space = jd->cinfo.out_color_space;
+	int subsampling = 0x22;
+	int quality = 75;
+	if (lua_istable(l, 4)) {
+		jc->cinfo.in_color_space = checkOptionField(l, 4, "colorSpace", colorSpace, JCS_OPTIONS, JCS_VALUES);
+		subsampling = checkOptionField(l, 4, "subsampling", "4:2:0", SUBSAMPLING_OPTIONS, SUBSAMPLING_VALUES);
+		quality = getIntegerField(l, 4, "quality", quality);
+	}
+	if (!luajpeg_compress_set_destination(jc, l, 5)) {
+		freePipelineStages(p.stages, stageCount);
 		lua_pushnil(l);
-		lua_pushstring(l, "image buffer too small");
+		lua_pushstring(l, "cannot open destination");
 		return 2;
 	}
-	unsigned char work[MAX_PIXEL_COMPONENTS];
-	int indices[MAX_PIXEL_COMPONENTS];
-	int i;
-	for (i = 0; i < pi.components; i++) {
-		indices[i] = pi.components - 1 - i;
+
+	JDIMENSION rowsPerCall = (JDIMENSION) luajpeg_decompress_rows_per_call(jd);
+	size_t bytesPerRow = (size_t) jd->cinfo.output_width * jd->cinfo.output_components;
+	unsigned char *strip = (unsigned char *)malloc(rowsPerCall * bytesPerRow);
+	if (strip == NULL) {
+		freePipelineStages(p.stages, stageCount);
+		luajpeg_compress_release_destination(jc);
+		lua_pushnil(l);
+		lua_pushstring(l, "cannot allocate pipeline buffers");
+		return 2;
 	}
-	if (lua_istable(l, 3)) {
-		for (i = 0; i < pi.components; i++) {
-			lua_geti(l, 3, i);
-			if (lua_isinteger(l, -1)) {
-				indices[i] = (int) lua_tointeger(l, -1);
-			}
-			lua_pop(l, 1);
+	jd->runStep++;
+	trace("jpeg_start_decompress()\n");
+	if (! jpeg_start_decompress(&jd->cinfo)) {
+		err = "suspended";
+	} else {
+		jd->runStep++;
+		luajpeg_compress_start_image(jc, quality, subsampling, 0);
+	}
+	JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+	JDIMENSION rowCount;
+	for (i = 0; i < (int) rowsPerCall; i++) {
+		row_pointer[i] = (JSAMPROW) (strip + i * bytesPerRow);
+	}
+	while ((err == NULL) && (jd->cinfo.output_scanline < jd->cinfo.output_height)) {
+		rowCount = jpeg_read_scanlines(&jd->cinfo, row_pointer, rowsPerCall);
+		if (rowCount == 0) {
+			err = "suspended";
+		} else {
+			err = pipelinePush(&p, 0, strip, (int) rowCount);
 		}
 	}
-    int x, y, xoffset, yoffset;
-    for (y = 0; y < pi.height; y++) {
-        yoffset = y * pi.bytesPerRow;
-        for (x = 0; x < pi.width; x++) {
-            xoffset = yoffset + x * pi.components;
-        	for (i = 0; i < pi.components; i++) {
-				work[i] = imageData[xoffset + indices[i]];
-            }
-        	for (i = 0; i < pi.components; i++) {
-                imageData[xoffset + i] = work[i];
-            }
-        }
-    }
-	return 0;
+	if (err == NULL) {
+		err = pipelinePush(&p, 0, NULL, 0);
+	}
+	free(strip);
+	freePipelineStages(p.stages, stageCount);
+	if (err == NULL) {
+		trace("jpeg_finish_decompress()\n");
+		jpeg_finish_decompress(&jd->cinfo);
+		trace("jpeg_finish_compress()\n");
+		jpeg_finish_compress(&jc->cinfo);
+	} else {
+		jpeg_abort_decompress(&jd->cinfo);
+		jpeg_abort_compress(&jc->cinfo);
+		luajpeg_compress_release_destination(jc);
+	}
+	jd->runStep = 0;
+	if (jd->srcType == SOURCE_LUA) {
+		luajpeg_reset_source_data(jd);
+	}
+	if (err != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, err);
+		return 2;
+	}
+	return luajpeg_compress_push_destination(jc, l);
 }
 
-static int luajpeg_convolve(lua_State *l) {
-	trace("luajpeg_convolve()\n");
-	luaL_checktype(l, 1, LUA_TUSERDATA);
-	//size_t imageLength = lua_rawlen(l, 1);
-	unsigned char *imageData = (unsigned char *)lua_touserdata(l, 1);
-	
-	PixmapInfo pi;
-	luaL_checktype(l, 2, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 2, &pi);
+/*
+********************************************************************************
+* Batch functions
+********************************************************************************
+*/
 
-	luaL_checktype(l, 3, LUA_TTABLE);
-	int kernelLength = lua_rawlen(l, 3);
+/*
+* The batch decodes, optionally resizes, then encodes each item, the items are processed in parallel by the worker pool.
+* The workers do not call Lua, the sources are memory mapped files or the Lua strings kept by the items table,
+* the results are copied in Lua userdata once all the items are done.
+* A libjpeg error fails the item instead of the whole batch, a libjpeg warning is returned with the item result.
+*/
 
-	luaL_checktype(l, 4, LUA_TUSERDATA);
-	size_t bufferLength = lua_rawlen(l, 4);
-	char *bufferData = (char *)lua_touserdata(l, 4);
+typedef struct BatchErrorStruct {
+	struct jpeg_error_mgr pub; // first member, the libjpeg error manager
+	jmp_buf jump;
+	char message[JMSG_LENGTH_MAX];
+	char warning[JMSG_LENGTH_MAX]; // the first warning, empty if none
+} BatchError;
 
-	int componentStart = 0;
-	int componentStop = pi.components - 1;
-	int kernelWidth = -1;
-	int kernelHeight = -1;
-	int kernelX = -1;
-	int kernelY = -1;
+METHODDEF(void)
+luajpeg_batch_error_exit (j_common_ptr cinfo)
+{
+	trace("luajpeg_batch_error_exit()\n");
+	BatchError *err = (BatchError *) cinfo->err;
+	(*cinfo->err->format_message) (cinfo, err->message);
+	longjmp(err->jump, 1);
+}
 
-	if (lua_istable(l, 5)) {
-		componentStart = getIntegerField(l, 5, "componentStart", componentStart);
-		componentStop = getIntegerField(l, 5, "componentStop", componentStop);
+// The workers do not print the warnings on stderr, the first one is kept for the item result
+METHODDEF(void)
+luajpeg_batch_output_message (j_common_ptr cinfo)
+{
+	BatchError *err = (BatchError *) cinfo->err;
+	if (err->warning[0] == '\0') {
+		(*cinfo->err->format_message) (cinfo, err->warning);
+	}
+}
 
-		kernelWidth = getIntegerField(l, 5, "kernelWidth", kernelWidth);
-		kernelHeight = getIntegerField(l, 5, "kernelHeight", kernelHeight);
-		kernelX = getIntegerField(l, 5, "kernelX", kernelX);
-		kernelY = getIntegerField(l, 5, "kernelY", kernelY);
+typedef struct BatchItemStruct {
+	// the source and the options
+	const char *path;
+	const JOCTET *data; // the source data when there is no path
+	size_t length;
+	unsigned int scaleNum;
+	unsigned int scaleDenom;
+	int colorSpace; // the output color space, JCS_UNKNOWN for the default one
+	int width; // the resize size, 0 to keep the decoded size or the aspect ratio
+	int height;
+	int filter;
+	int encode; // whether the image is compressed or returned as pixels
+	int quality;
+	int subsampling;
+	// the resources, released when the item is done
+	BatchError error;
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_source_mgr srcmgr;
+	JpegCompress *jc;
+	void *mapping;
+	size_t mappingSize;
+	PipelineStage *stages;
+	unsigned char *strip;
+	// the result
+	const char *err;
+	PixmapInfo info;
+	int outColorSpace;
+	unsigned char *resultData;
+	size_t resultLength;
+} BatchItem;
+
+static void batchRelease(BatchItem *item) {
+	if (item->jc != NULL) {
+		// the compress struct is zeroed before its creation
+		jpeg_destroy_compress(&item->jc->cinfo);
+		free(item->jc->destData);
+		free(item->jc);
+		item->jc = NULL;
 	}
-	if ((kernelWidth < 0) || (kernelHeight < 0)) {
-		int s = sqrt(kernelLength);
-		kernelWidth = kernelHeight = s;
+	jpeg_destroy_decompress(&item->dinfo);
+	if (item->mapping != NULL) {
+		unmapFile(item->mapping, item->mappingSize);
+		item->mapping = NULL;
 	}
-	if (kernelWidth * kernelHeight != kernelLength) {
-		lua_pushnil(l);
-		lua_pushstring(l, "invalid kernel argument");
-		return 2;
+	if (item->stages != NULL) {
+		freePipelineStages(item->stages, 1);
+		item->stages = NULL;
 	}
-	if ((kernelX < 0) || (kernelY < 0)) {
-		kernelX = kernelWidth / 2;
-		kernelY = kernelHeight / 2;
+	free(item->strip);
+	item->strip = NULL;
+}
+
+static void batchFail(BatchItem *item, const char *err) {
+	item->err = err;
+	free(item->resultData);
+	item->resultData = NULL;
+	batchRelease(item);
+}
+
+static void batchItemRun(BatchItem *item) {
+	struct jpeg_decompress_struct *dinfo = &item->dinfo;
+	dinfo->err = jpeg_std_error(&item->error.pub);
+	item->error.pub.error_exit = luajpeg_batch_error_exit;
+	item->error.pub.output_message = luajpeg_batch_output_message;
+	item->error.warning[0] = '\0';
+	if (setjmp(item->error.jump)) {
+		batchFail(item, item->error.message);
+		return;
+	}
+	jpeg_create_decompress(dinfo);
+	if (item->path != NULL) {
+		item->mapping = mapFile(item->path, &item->mappingSize);
+		if (item->mapping == NULL) {
+			batchFail(item, "cannot open source");
+			return;
+		}
+		item->data = (const JOCTET *) item->mapping;
+		item->length = item->mappingSize;
+	}
+	// the whole source is in memory
+	dinfo->src = &item->srcmgr;
+	item->srcmgr.init_source = luajpeg_source_no_operation;
+	item->srcmgr.fill_input_buffer = luajpeg_fill_memory_input_buffer;
+	item->srcmgr.skip_input_data = luajpeg_skip_memory_input_data;
+	item->srcmgr.resync_to_restart = jpeg_resync_to_restart;
+	item->srcmgr.term_source = luajpeg_source_no_operation;
+	item->srcmgr.next_input_byte = item->data;
+	item->srcmgr.bytes_in_buffer = item->length;
+
+	trace("jpeg_read_header()\n");
+	(void) jpeg_read_header(dinfo, TRUE);
+	if ((item->scaleNum > 0) && (item->scaleDenom > 0)) {
+		dinfo->scale_num = item->scaleNum;
+		dinfo->scale_denom = item->scaleDenom;
+	}
+	if (item->colorSpace != JCS_UNKNOWN) {
+		dinfo->out_color_space = (J_COLOR_SPACE) item->colorSpace;
+	}
+	jpeg_calc_output_dimensions(dinfo);
+
+	Pipeline p;
+	p.stages = NULL;
+	p.stageCount = 0;
+	p.jc = NULL;
+	p.image = NULL;
+	PixmapInfo pi;
+	pi.width = dinfo->output_width;
+	pi.height = dinfo->output_height;
+	pi.components = dinfo->output_components;
+	pi.bytesPerRow = pi.width * pi.components;
+	if ((item->width > 0) || (item->height > 0)) {
+		// a missing dimension keeps the aspect ratio
+		int width = item->width, height = item->height;
+		if (width <= 0) {
+			width = (int) floor((double) height * pi.width / pi.height + 0.5);
+		} else if (height <= 0) {
+			height = (int) floor((double) width * pi.height / pi.width + 0.5);
+		}
+		item->stages = (PipelineStage *)calloc(1, sizeof(PipelineStage));
+		if (item->stages == NULL) {
+			batchFail(item, "cannot allocate resize buffers");
+			return;
+		}
+		item->stages->srcInfo = pi;
+		const char *err = pipelineSetResizeStage(item->stages, item->filter, width < 1 ? 1 : width, height < 1 ? 1 : height);
+		if (err != NULL) {
+			batchFail(item, err);
+			return;
+		}
+		pi = item->stages->dstInfo;
+		p.stages = item->stages;
+		p.stageCount = 1;
+	}
+	if (item->encode) {
+		item->jc = (JpegCompress *)calloc(1, sizeof(JpegCompress));
+		if (item->jc == NULL) {
+			batchFail(item, "not enough memory");
+			return;
+		}
+		JpegCompress *jc = item->jc;
+		jc->cinfo.err = &item->error.pub;
+		jpeg_create_compress(&jc->cinfo);
+		jc->cinfo.dest = &jc->destmgr;
+		jc->destType = DESTINATION_MEMORY;
+		jc->destmgr.init_destination = luajpeg_init_memory_destination;
+		jc->destmgr.empty_output_buffer = luajpeg_empty_memory_output_buffer;
+		jc->destmgr.term_destination = luajpeg_term_memory_destination;
+		// the size is estimated when the compression starts
+		jc->destSize = 0;
+		jc->cinfo.image_width = pi.width;
+		jc->cinfo.image_height = pi.height;
+		jc->cinfo.input_components = pi.components;
+		jc->cinfo.in_color_space = dinfo->out_color_space;
+		jc->bytesPerRow = pi.bytesPerRow;
+		luajpeg_compress_start_image(jc, item->quality, item->subsampling, 0);
+		p.jc = jc;
+	} else {
+		item->resultData = (unsigned char *)malloc(pi.bytesPerRow * pi.height);
+		if (item->resultData == NULL) {
+			batchFail(item, "not enough memory");
+			return;
+		}
+		p.image = item->resultData;
+		p.imageBytesPerRow = pi.bytesPerRow;
+		p.imageLength = 0;
+	}
+
+	trace("jpeg_start_decompress()\n");
+	(void) jpeg_start_decompress(dinfo);
+	JDIMENSION rowsPerCall = (JDIMENSION) DECOMPRESS_IMCU_ROWS(dinfo);
+	if (rowsPerCall < (JDIMENSION) dinfo->rec_outbuf_height) {
+		rowsPerCall = (JDIMENSION) dinfo->rec_outbuf_height;
+	}
+	if (rowsPerCall > MAX_ROWS_PER_CALL) {
+		rowsPerCall = MAX_ROWS_PER_CALL;
+	}
+	size_t bytesPerRow = (size_t) dinfo->output_width * dinfo->output_components;
+	item->strip = (unsigned char *)malloc(rowsPerCall * bytesPerRow);
+	if (item->strip == NULL) {
+		batchFail(item, "not enough memory");
+		return;
+	}
+	JSAMPROW row_pointer[MAX_ROWS_PER_CALL];
+	JDIMENSION rowCount, i;
+	for (i = 0; i < rowsPerCall; i++) {
+		row_pointer[i] = (JSAMPROW) (item->strip + i * bytesPerRow);
+	}
+	const char *err = NULL;
+	while ((err == NULL) && (dinfo->output_scanline < dinfo->output_height)) {
+		rowCount = jpeg_read_scanlines(dinfo, row_pointer, rowsPerCall);
+		// the memory source does not suspend
+		err = rowCount == 0 ? "suspended" : pipelinePush(&p, 0, item->strip, (int) rowCount);
+	}
+	if (err == NULL) {
+		err = pipelinePush(&p, 0, NULL, 0);
+	}
+	if (err != NULL) {
+		batchFail(item, err);
+		return;
+	}
+	trace("jpeg_finish_decompress()\n");
+	(void) jpeg_finish_decompress(dinfo);
+	item->info = pi;
+	item->outColorSpace = dinfo->out_color_space;
+	if (item->encode) {
+		trace("jpeg_finish_compress()\n");
+		jpeg_finish_compress(&item->jc->cinfo);
+		if (item->jc->destError != NULL) {
+			batchFail(item, item->jc->destError);
+			return;
+		}
+		// the compressed data becomes the result
+		item->resultData = item->jc->destData;
+		item->resultLength = item->jc->destLength;
+		item->jc->destData = NULL;
+	} else {
+		item->resultLength = p.imageLength;
+	}
+	batchRelease(item);
+}
+
+static void batchItemBand(void *context, int band, int bandCount) {
+	BatchItem *item = ((BatchItem *) context) + band;
+	// the invalid items keep their error
+	if (item->err == NULL) {
+		batchItemRun(item);
+	}
+}
+
+// Reads the item options from the table at the specified index, the current values are the defaults
+static void getBatchOptions(lua_State *l, int i, BatchItem *item) {
+	item->scaleNum = (unsigned int) getIntegerField(l, i, "scaleNum", (int) item->scaleNum);
+	item->scaleDenom = (unsigned int) getIntegerField(l, i, "scaleDenom", (int) item->scaleDenom);
+	item->colorSpace = checkOptionField(l, i, "colorSpace",
+		getOptionField(item->colorSpace, JCS_UNKNOWN, JCS_OPTIONS, JCS_VALUES), JCS_OPTIONS, JCS_VALUES);
+	item->width = getIntegerField(l, i, "width", item->width);
+	item->height = getIntegerField(l, i, "height", item->height);
+	item->filter = checkOptionField(l, i, "filter",
+		getOptionField(item->filter, RESAMPLE_BICUBIC, RESAMPLE_OPTIONS, RESAMPLE_VALUES), RESAMPLE_OPTIONS, RESAMPLE_VALUES);
+	item->encode = getBooleanField(l, i, "encode", item->encode);
+	item->quality = getIntegerField(l, i, "quality", item->quality);
+	item->subsampling = checkOptionField(l, i, "subsampling",
+		getOptionField(item->subsampling, 0x22, SUBSAMPLING_OPTIONS, SUBSAMPLING_VALUES), SUBSAMPLING_OPTIONS, SUBSAMPLING_VALUES);
+}
+
+static void initBatchItem(BatchItem *item) {
+	memset(item, 0, sizeof(BatchItem));
+	item->colorSpace = JCS_UNKNOWN;
+	item->filter = RESAMPLE_BICUBIC;
+	item->encode = TRUE;
+	item->quality = 75;
+	item->subsampling = 0x22;
+}
+
+// Reads the item at the specified index, a file path or a table with a path or a data field and its options
+static void getBatchItem(lua_State *l, int i, BatchItem *item) {
+	if (lua_isstring(l, i)) {
+		item->path = lua_tostring(l, i);
+	} else if (lua_istable(l, i)) {
+		lua_getfield(l, i, "data");
+		if (lua_isstring(l, -1)) {
+			item->data = (const JOCTET *) lua_tolstring(l, -1, &item->length);
+		}
+		lua_pop(l, 1);
+		lua_getfield(l, i, "path");
+		if (lua_isstring(l, -1)) {
+			item->path = lua_tostring(l, -1);
+		}
+		lua_pop(l, 1);
+		getBatchOptions(l, i, item);
+	}
+	if ((item->path == NULL) && (item->data == NULL)) {
+		item->err = "invalid source";
 	}
+}
 
-    int workSize = kernelY + 1;
-    int sizeOfWork = workSize * pi.bytesPerRow * sizeof(unsigned char);
-	int sizeOfKernel = kernelHeight * sizeof(double *) + kernelHeight * kernelWidth * sizeof(double);
-	unsigned char *work = (unsigned char *)bufferData;
-    double **kernel = (double **) (bufferData + sizeOfWork);
-
-	trace("bufferLength: %d, min: %d\n", bufferLength, sizeOfWork + sizeOfKernel);
-	if (bufferLength < sizeOfWork + sizeOfKernel) {
-		lua_pushnil(l);
-		lua_pushstring(l, "buffer too small");
-		return 2;
+// Pushes the result table of the item then frees its native result
+static void pushBatchResult(lua_State *l, BatchItem *item) {
+	lua_newtable(l);
+	if (item->err != NULL) {
+		SET_TABLE_KEY_STRING(l, "error", item->err);
+	} else {
+		lua_pushstring(l, "data");
+		unsigned char *data = (unsigned char *)lua_newuserdata(l, item->resultLength > 0 ? item->resultLength : 1);
+		memcpy(data, item->resultData, item->resultLength);
+		lua_rawset(l, -3);
+		SET_TABLE_KEY_INTEGER(l, "length", item->resultLength);
+		SET_TABLE_KEY_INTEGER(l, "width", item->info.width);
+		SET_TABLE_KEY_INTEGER(l, "height", item->info.height);
+		SET_TABLE_KEY_INTEGER(l, "components", item->info.components);
+		if (!item->encode) {
+			SET_TABLE_KEY_INTEGER(l, "bytesPerRow", item->info.bytesPerRow);
+		}
+		SET_TABLE_KEY_STRING(l, "colorSpace", getOptionField(item->outColorSpace, JCS_UNKNOWN, JCS_OPTIONS, JCS_VALUES));
 	}
-	trace("componentStart - componentStop: %d-%d\n", componentStart, componentStop);
-	trace("kernelWidth x kernelHeight: %dx%d\n", kernelWidth, kernelHeight);
-	trace("kernelX, kernelY: %d, %d\n", kernelX, kernelY);
-
-	double kernelSum = 0;
-    int i, j, k;
-    //trace("kernel initialization");
-    for (j = 0; j < kernelHeight; j++) {
-    	kernel[j] = (double *)(((unsigned char *)kernel) + kernelHeight * sizeof(double *) + j * kernelWidth * sizeof(double));
-        for (i = 0; i < kernelWidth; i++) {
-			double d = 0.0;
-			if (lua_geti(l, 3, 1 + j * kernelWidth + i) == LUA_TNUMBER) {
-				d = (double) lua_tonumber(l, -1);
-			}
-			lua_pop(l, 1);
-			kernelSum += kernel[j][i] = d;
-            trace("kernel[%d][%d] = %f\n", j, i, kernel[j][i]);
-        }
+	if (item->error.warning[0] != '\0') {
+		SET_TABLE_KEY_STRING(l, "warning", item->error.warning);
 	}
-    //trace("kernel initialized, sum = %f", kernelSum);
-    unsigned char *pbits = imageData;
-    int x, y;
-    for (y = 0; y < pi.height; y++) {
-        if (y >= workSize) {
-        	int wy = y - workSize;
-        	//trace("starting row %d, flushing row %d [%d]", y, wy, wy % workSize);
-        	memcpy(pbits + wy * pi.bytesPerRow, work + (wy % workSize) * pi.bytesPerRow, pi.bytesPerRow);
-        }
-        for (x = 0; x < pi.width; x++) {
-        	//int debug = (x == info.width / 2) && (y == info.height / 2);
-            for (k = 0; k < pi.components; k++) {
-            	if ((k < componentStart) || (k > componentStop)) {
-            		work[(y % workSize) * pi.bytesPerRow + x * pi.components + k] = pbits[y * pi.bytesPerRow + x * pi.components + k];
-            		continue;
-            	} // else
-            	double sum = 0;
-            	double div = kernelSum;
-            	for (j = 0; j < kernelHeight; j++) {
-            		for (i = 0; i < kernelWidth; i++) {
-            			int kx = x - kernelX + i;
-            			int ky = y - kernelY + j;
-            			if ((kx < 0) || (ky < 0) || (ky >= pi.height) || (kx >= pi.width)) {
-            				div -= kernel[j][i];
-            			} else {
-            				/*if (debug)
-            					trace("%d x %f(kernel[%d][%d]) = %f", pbits[ky * pi.bytesPerRow + kx * pi.components + k],
-            							kernel[j][i], j, i, pbits[ky * pi.bytesPerRow + kx * pi.components + k] * kernel[j][i]);*/
-            				sum += pbits[ky * pi.bytesPerRow + kx * pi.components + k] * kernel[j][i];
-            			}
-            		}
-            	}
-            	int res;
-            	if (div != 0.0) {
-            		res = sum / div;
-            	} else {
-            		res = 255;
-            		//trace("div = %f", div);
-            	}
-            	if (res < 0) {
-            		res = 0;
-            	} else if (res > 255) {
-            		res = 255;
-            	}
-            	work[(y % workSize) * pi.bytesPerRow + x * pi.components + k] = res;
-            	/*if (debug) {
-            		trace("%f / %f = %f => %d", sum, div, sum / div, res);
-            	}*/
-            }
-        }
-    }
-    for (j = 0; j < workSize; j++) {
-    	int wy = y - workSize;
-		//trace("flushing row %d [%d]", wy, wy % workSize);
-    	memcpy(pbits + wy * pi.bytesPerRow, work + (wy % workSize) * pi.bytesPerRow, pi.bytesPerRow);
-    	y++;
-    }
+	free(item->resultData);
+	item->resultData = NULL;
+}
 
+static int luajpeg_batch_gc(lua_State *l) {
+	trace("luajpeg_batch_gc()\n");
+	BatchItem *items = (BatchItem *)lua_touserdata(l, 1);
+	size_t i, itemCount = lua_rawlen(l, 1) / sizeof(BatchItem);
+	for (i = 0; i < itemCount; i++) {
+		free(items[i].resultData);
+		items[i].resultData = NULL;
+	}
 	return 0;
 }
 
-static const char *ROTATE_OPTIONS[] = { "right", "180", "left", "flip-horizontal", "flip-vertical", NULL };
-static const int ROTATE_VALUES[] = { 1, 2, 3, 4, 5 };
-
-static int luajpeg_rotate(lua_State *l) {
-	trace("luajpeg_rotate()\n");
+/*
+* Decodes then encodes a list of items on the worker pool. An item is a file path or a table with a path or a data field
+* and its options, the options table at index 2 has the default options of all the items.
+* The options are scaleNum, scaleDenom and colorSpace for the decompression, width, height and filter to resize,
+* encode false to return the pixels rather than the JPEG data, quality and subsampling for the compression.
+* The items run on the pool threads, the threads option sets the pool thread count first, 0 for the number of processors,
+* otherwise the current count is used, see setThreadCount.
+* Returns a list of tables, with the data userdata, its length and the image infos, or with the error,
+* and the first libjpeg warning if any.
+*/
+static int luajpeg_batch(lua_State *l) {
+	trace("luajpeg_batch()\n");
+	luaL_checktype(l, 1, LUA_TTABLE);
+	int itemCount = (int) lua_rawlen(l, 1);
+	int i;
 
-	luaL_checktype(l, 1, LUA_TUSERDATA);
-	//size_t srcImageLength = lua_rawlen(l, 1);
-	unsigned char *srcImageData = (unsigned char *)lua_touserdata(l, 1);
-	
-	PixmapInfo srcInfo;
-	luaL_checktype(l, 2, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 2, &srcInfo);
+	BatchItem defaults;
+	initBatchItem(&defaults);
+	if (lua_istable(l, 2)) {
+		getBatchOptions(l, 2, &defaults);
+		int threadCount = getIntegerField(l, 2, "threads", -1);
+		if (threadCount >= 0) {
+			poolSetThreadCount(threadCount);
+		}
+	}
+	// the items userdata frees the native results not yet pushed if an error is raised
+	size_t itemsSize = (itemCount > 0 ? itemCount : 1) * sizeof(BatchItem);
+	BatchItem *items = (BatchItem *)lua_newuserdata(l, itemsSize);
+	memset(items, 0, itemsSize);
+	luaL_getmetatable(l, "jpeg_batch");
+	lua_setmetatable(l, -2);
+	for (i = 0; i < itemCount; i++) {
+		BatchItem *item = items + i;
+		*item = defaults;
+		// the strings are kept by the items table
+		lua_geti(l, 1, i + 1);
+		getBatchItem(l, lua_gettop(l), item);
+		lua_pop(l, 1);
+	}
 
-	luaL_checktype(l, 3, LUA_TUSERDATA);
-	//size_t dstImageLength = lua_rawlen(l, 3);
-	unsigned char *dstImageData = (unsigned char *)lua_touserdata(l, 3);
-	
-	PixmapInfo dstInfo;
-	luaL_checktype(l, 4, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 4, &dstInfo);
+	runBands(batchItemBand, items, itemCount);
 
-	if (srcInfo.components != dstInfo.components) {
-		lua_pushnil(l);
-		lua_pushstring(l, "components differ");
-		return 2;
+	lua_createtable(l, itemCount, 0);
+	for (i = 0; i < itemCount; i++) {
+		pushBatchResult(l, items + i);
+		lua_rawseti(l, -2, i + 1);
 	}
+	return 1;
+}
 
-	int rc = 1;
-	if (lua_isinteger(l, 5)) {
-		rc = lua_tointeger(l, 5);
-	} else if (lua_isstring(l, 5)) {
-		rc = ROTATE_VALUES[luaL_checkoption(l, 5, NULL, ROTATE_OPTIONS)];
+/*
+********************************************************************************
+* Asynchronous job functions
+********************************************************************************
+*/
+
+/*
+* A job runs a batch item on a worker of the pool, the Lua state polls the job or waits for its completion.
+* The job is shared by its worker and its Lua handle, the last one to release it frees it.
+* The pending jobs are bounded by the pool thread count, a job is rejected as busy when the pool is full.
+*/
+
+typedef struct BatchJobStruct {
+	PoolTask task; // first member, the job is queued on the pool
+	BatchItem item;
+	char *path; // the copies of the source, the Lua strings may be collected while the job runs
+	JOCTET *data;
+	int done;
+	int released; // the Lua handle has been collected
+	int notifyFds[2]; // the pipe written when the job is done, created on demand
+	int *runningJobs; // the running jobs count of the Lua state that submitted the job
+} BatchJob;
+
+typedef struct JobHandleStruct {
+	BatchJob *job;
+	LuaReference result; // the result table, once retrieved
+} JobHandle;
+
+// Protects the done and released flags, the notification pipe and the running jobs count of all the jobs
+static PoolMutex jobMutex = POOL_MUTEX_INITIALIZER;
+static PoolCondition jobDone = POOL_CONDITION_INITIALIZER;
+
+// The number of queued or running jobs of all the Lua states, protected by the job mutex
+static int pendingJobs = 0;
+
+static void freeBatchJob(BatchJob *job) {
+#if !defined(_WIN32)
+	if (job->notifyFds[0] >= 0) {
+		close(job->notifyFds[0]);
+		close(job->notifyFds[1]);
 	}
+#endif
+	free(job->item.resultData);
+	free(job->path);
+	free(job->data);
+	free(job);
+}
 
-	if ((rc == 1) || (rc == 3)) {
-		if ((srcInfo.width != dstInfo.height) || (srcInfo.height != dstInfo.width)) {
-			lua_pushnil(l);
-			lua_pushstring(l, "incompatible source and destination sizes");
-			return 2;
-		}
-	} else if ((rc == 2) || (rc == 4) || (rc == 5)) {
-		if ((srcInfo.width != dstInfo.width) || (srcInfo.height != dstInfo.height)) {
-			lua_pushnil(l);
-			lua_pushstring(l, "incompatible source and destination sizes");
-			return 2;
+static void runBatchJob(PoolTask *task) {
+	BatchJob *job = (BatchJob *) task;
+	int *runningJobs = job->runningJobs;
+	int released;
+	batchItemRun(&job->item);
+	poolMutexLock(&jobMutex);
+	job->done = 1;
+	released = job->released;
+#if !defined(_WIN32)
+	if (job->notifyFds[1] >= 0) {
+		// the byte is never read, the pipe stays readable
+		if (write(job->notifyFds[1], "", 1) != 1) {
+			trace("runBatchJob() cannot notify\n");
 		}
-	} else {
-		lua_pushnil(l);
-		lua_pushstring(l, "unsupported rotation");
-		return 2;
 	}
-
-    int y, x, b;
-    int xoffset, yoffset, xdoffset, ydoffset;
-    for (y = 0; y < srcInfo.height; y++) {
-    	yoffset = y * srcInfo.bytesPerRow;
-        for (x = 0; x < srcInfo.width; x++) {
-        	xoffset = yoffset + x * srcInfo.components;
-        	switch (rc) {
-        	case 1: // rotate right 90
-				ydoffset = x * dstInfo.bytesPerRow;
-				xdoffset = ydoffset + (srcInfo.height - y - 1) * dstInfo.components;
-        		break;
-        	case 2: // rotate 180
-				ydoffset = (srcInfo.height - y - 1) * dstInfo.bytesPerRow;
-				xdoffset = ydoffset + (srcInfo.width - x - 1) * dstInfo.components;
-        		break;
-        	case 3: // rotate left 90
-				ydoffset = (srcInfo.width - x - 1) * dstInfo.bytesPerRow;
-				xdoffset = ydoffset + y * dstInfo.components;
-        		break;
-        	case 4: // flip horizontal mirror
-				ydoffset = y * dstInfo.bytesPerRow;
-				xdoffset = ydoffset + (srcInfo.width - x - 1) * dstInfo.components;
-        		break;
-        	case 5: // flip vertical mirror
-				ydoffset = (srcInfo.height - y - 1) * dstInfo.bytesPerRow;
-				xdoffset = ydoffset + x * dstInfo.components;
-        		break;
-        	}
-            for (b = 0; b < srcInfo.components; b++) {
-        		dstImageData[xdoffset + b] = srcImageData[xoffset + b];
-            }
-        }
-    }
-	return 0;
+#endif
+	if (released) {
+		freeBatchJob(job);
+	}
+	// the count is decremented last, the module may be unloaded once the count of its state is zero
+	(*runningJobs)--;
+	pendingJobs--;
+	poolConditionBroadcast(&jobDone);
+	poolMutexUnlock(&jobMutex);
 }
 
-static int luajpeg_subsampleBilinear(lua_State *l) {
-	trace("luajpeg_subsampleBilinear()\n");
-
-	luaL_checktype(l, 1, LUA_TUSERDATA);
-	//size_t srcImageLength = lua_rawlen(l, 1);
-	unsigned char *srcImageData = (unsigned char *)lua_touserdata(l, 1);
-	
-	PixmapInfo srcInfo;
-	luaL_checktype(l, 2, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 2, &srcInfo);
+static JobHandle *checkJobHandle(lua_State *l, int i) {
+	JobHandle *h = (JobHandle *)luaL_checkudata(l, i, "jpeg_job");
+	if (h->job == NULL) {
+		luaL_argerror(l, i, "invalid job");
+	}
+	return h;
+}
 
-	luaL_checktype(l, 3, LUA_TUSERDATA);
-	//size_t dstImageLength = lua_rawlen(l, 3);
-	unsigned char *dstImageData = (unsigned char *)lua_touserdata(l, 3);
-	
-	PixmapInfo dstInfo;
-	luaL_checktype(l, 4, LUA_TTABLE);
-	getPixmapInfoFromTableField(l, 4, &dstInfo);
+// Pushes the result table of the done job, the native result is released on the first call
+static void pushJobResult(lua_State *l, JobHandle *h) {
+	if (isRegisteredLuaReference(&h->result)) {
+		lua_rawgeti(l, LUA_REGISTRYINDEX, h->result.ref);
+	} else {
+		pushBatchResult(l, &h->job->item);
+		lua_pushvalue(l, -1);
+		registerLuaReference(&h->result, l);
+	}
+}
 
-	luaL_checktype(l, 5, LUA_TUSERDATA);
-	size_t bufferLength = lua_rawlen(l, 5);
-	char *bufferData = (char *)lua_touserdata(l, 5);
-	
-	// components per row
-	int cpr = srcInfo.width * srcInfo.components;
+/*
+* Submits a batch item, a file path or a table with a path or a data field and its options, see batch.
+* The item is queued on the worker pool, returns the job handle immediately or nil and "busy" when the pool is full.
+* Without worker thread, the item is processed by the calling thread before returning.
+*/
+static int luajpeg_job_submit(lua_State *l) {
+	trace("luajpeg_job_submit()\n");
+	BatchItem item;
+	initBatchItem(&item);
+	if (lua_istable(l, 2)) {
+		getBatchOptions(l, 2, &item);
+	}
+	getBatchItem(l, 1, &item);
+	if (item.err != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, item.err);
+		return 2;
+	}
+	lua_getfield(l, LUA_REGISTRYINDEX, "jpeg_jobs");
+	int *runningJobs = (int *)lua_touserdata(l, -1);
+	lua_pop(l, 1);
+	JobHandle *h = (JobHandle *)lua_newuserdata(l, sizeof(JobHandle));
+	h->job = NULL;
+	initLuaReference(&h->result);
+	luaL_getmetatable(l, "jpeg_job");
+	lua_setmetatable(l, -2);
 
-	if (srcInfo.components != dstInfo.components) {
+	BatchJob *job = (BatchJob *)calloc(1, sizeof(BatchJob));
+	if (job == NULL) {
 		lua_pushnil(l);
-		lua_pushstring(l, "components differ");
+		lua_pushstring(l, "not enough memory");
 		return 2;
 	}
-    if ((srcInfo.width <= dstInfo.width) || (srcInfo.height <= dstInfo.height)) {
+	job->item = item;
+	job->notifyFds[0] = job->notifyFds[1] = -1;
+	job->runningJobs = runningJobs;
+	if (item.path != NULL) {
+		size_t pathLength = strlen(item.path);
+		job->path = (char *)malloc(pathLength + 1);
+		if (job->path != NULL) {
+			memcpy(job->path, item.path, pathLength + 1);
+		}
+		job->item.path = job->path;
+	} else {
+		job->data = (JOCTET *)malloc(item.length > 0 ? item.length : 1);
+		if (job->data != NULL) {
+			memcpy(job->data, item.data, item.length);
+		}
+		job->item.data = job->data;
+	}
+	if ((job->path == NULL) && (job->data == NULL)) {
+		freeBatchJob(job);
 		lua_pushnil(l);
-		lua_pushstring(l, "invalid image sizes for subsampling");
+		lua_pushstring(l, "not enough memory");
 		return 2;
-    }
-	size_t minBufferLength = cpr * sizeof(unsigned long) * 2;
-	if (bufferLength < minBufferLength) {
+	}
+	int maxPendingJobs = poolGetThreadCount();
+	poolMutexLock(&jobMutex);
+	if (pendingJobs >= maxPendingJobs) {
+		poolMutexUnlock(&jobMutex);
+		freeBatchJob(job);
 		lua_pushnil(l);
-		lua_pushfstring(l, "buffer too small (%d < %d)", bufferLength, minBufferLength);
+		lua_pushstring(l, "busy");
 		return 2;
 	}
+	pendingJobs++;
+	(*runningJobs)++;
+	poolMutexUnlock(&jobMutex);
+	h->job = job;
+	job->task.run = runBatchJob;
+	poolMutexLock(&pool.mutex);
+	int queued = pool.workerCount > 0;
+	if (queued) {
+		poolEnqueue(&job->task);
+	}
+	poolMutexUnlock(&pool.mutex);
+	if (!queued) {
+		runBatchJob(&job->task);
+	}
+	return 1;
+}
 
-	unsigned long *work = (unsigned long *)bufferData;
-	unsigned long *divs = work + cpr;
-
-    int i, x, y = 0, xoffset, yoffset;
-    int xd = 0, yd = 0, woffset, xdoffset, ydoffset;
-    int curr, next = 0, nyd = 0, cp, np, yp, ydd, ypass;
-    int xcurr, xnext = 0, nxd = 0, xcp, xnp, xp, xdd, xpass;
-    //while (y < srcInfo.height) {
-	for (i = 0; i < cpr; i++) {
-		work[i] = divs[i] = 0;
-    }
-    for (y = 0; y < srcInfo.height; y++) {
-    	yoffset = y * srcInfo.bytesPerRow;
-    	curr = next;
-    	next = (y + 1) * dstInfo.height * 100 / srcInfo.height;
-
-        yd = nyd;
-        nyd = next / 100;
+/*
+* Returns false while the job is running, then its result table, see batch.
+*/
+static int luajpeg_job_poll(lua_State *l) {
+	JobHandle *h = checkJobHandle(l, 1);
+	int done;
+	poolMutexLock(&jobMutex);
+	done = h->job->done;
+	poolMutexUnlock(&jobMutex);
+	if (!done) {
+		lua_pushboolean(l, 0);
+		return 1;
+	}
+	pushJobResult(l, h);
+	return 1;
+}
 
-        if ((nyd != yd) && (y + 1 < srcInfo.height)) {
-        	// the destination row is going to change
-        	cp = (100 - (curr % 100)) * 100 / (next - curr);
-        	//np = (next % 100) * 100 / (next - curr);
-        	np = 100 - cp;
-        	ypass = 2;
-        } else {
-        	cp = np = 100;
-        	ypass = 1;
-        }
-		yp = cp;
-		ydd = yd;
-        while (--ypass >= 0) {
-            ydoffset = ydd * dstInfo.bytesPerRow;
-            //trace("y %d => %d %d%%", y, ydd, yp);
-			xnext = 0;
-			nxd = 0;
-	        for (x = 0; x < srcInfo.width; x++) {
-	        	xoffset = yoffset + x * srcInfo.components;
-	        	xcurr = xnext;
-	        	xnext = (x + 1) * dstInfo.width * 100 / srcInfo.width;
+/*
+* Blocks until the job is done then returns its result table, see batch.
+*/
+static int luajpeg_job_wait(lua_State *l) {
+	JobHandle *h = checkJobHandle(l, 1);
+	poolMutexLock(&jobMutex);
+	while (!h->job->done) {
+		poolConditionWait(&jobDone, &jobMutex);
+	}
+	poolMutexUnlock(&jobMutex);
+	pushJobResult(l, h);
+	return 1;
+}
 
-	            xd = nxd;
-	            nxd = xnext / 100;
+/*
+* Returns a file descriptor that becomes readable when the job is done, to be watched by an event loop.
+* The descriptor is owned by the job and shall not be read nor closed.
+*/
+static int luajpeg_job_fd(lua_State *l) {
+	JobHandle *h = checkJobHandle(l, 1);
+#if defined(_WIN32)
+	lua_pushnil(l);
+	lua_pushstring(l, "not supported");
+	return 2;
+#else
+	BatchJob *job = h->job;
+	const char *err = NULL;
+	poolMutexLock(&jobMutex);
+	if (job->notifyFds[0] < 0) {
+		if (pipe(job->notifyFds) != 0) {
+			job->notifyFds[0] = job->notifyFds[1] = -1;
+			err = "cannot create pipe";
+		} else if (job->done) {
+			if (write(job->notifyFds[1], "", 1) != 1) {
+				err = "cannot notify";
+			}
+		}
+	}
+	poolMutexUnlock(&jobMutex);
+	if (err != NULL) {
+		lua_pushnil(l);
+		lua_pushstring(l, err);
+		return 2;
+	}
+	lua_pushinteger(l, job->notifyFds[0]);
+	return 1;
+#endif
+}
 
-	            if ((nxd != xd) && (x + 1 < srcInfo.width)) {
-	            	// the destination column is going to change
-	            	xcp = (100 - (xcurr % 100)) * 100 / (xnext - xcurr);
-	            	//np = (next % 100) * 100 / (next - curr);
-	            	xnp = 100 - xcp;
-	            	xpass = 2;
-	            } else {
-	            	xcp = xnp = 100;
-	            	xpass = 1;
-	            }
-	    		xp = xcp;
-	    		xdd = xd;
-	            while (--xpass >= 0) {
-		            woffset = xdd * dstInfo.components;
-					int percent = xp * yp / 100;
-	            	//if ((y == 0) || (yp != 100)) jls_info("x %d => %d %d%% (%d%%)", x, xdd, xp, percent);
-            		divs[woffset] += percent;
-	            	for (i = 0; i < srcInfo.components; i++) {
-	            		work[woffset + i] += srcImageData[xoffset + i] * percent / 100;
-	                }
-	    			xp = xnp;
-	    			xdd = nxd;
-	            }
-	        }
-	        if (nyd != ydd) {
-	            for (xd = 0; xd < dstInfo.width; xd++) {
-	            	xdoffset = ydoffset + xd * dstInfo.components;
-	            	woffset = xd * dstInfo.components;
-	            	for (i = 0; i < dstInfo.components; i++) {
-	            		dstImageData[xdoffset + i] = work[woffset + i] * 100 / divs[woffset];
-	            		work[woffset + i] = 0;
-	                }
-	            	divs[woffset] = 0;
-	            }
-	            //trace("row %d completed", yd);
-	        }
-			yp = np;
-			ydd = nyd;
-        }
-    }
+// The Lua state waits for its running jobs when closed, as the module code may be unloaded afterwards
+static int luajpeg_jobs_gc(lua_State *l) {
+	trace("luajpeg_jobs_gc()\n");
+	int *runningJobs = (int *)lua_touserdata(l, 1);
+	poolMutexLock(&jobMutex);
+	while (*runningJobs > 0) {
+		poolConditionWait(&jobDone, &jobMutex);
+	}
+	poolMutexUnlock(&jobMutex);
 	return 0;
 }
 
+// A running job is abandoned, its thread frees it when done
+static int luajpeg_job_gc(lua_State *l) {
+	trace("luajpeg_job_gc()\n");
+	JobHandle *h = (JobHandle *)luaL_checkudata(l, 1, "jpeg_job");
+	BatchJob *job = h->job;
+	unregisterLuaReference(&h->result);
+	if (job != NULL) {
+		int done;
+		h->job = NULL;
+		poolMutexLock(&jobMutex);
+		done = job->done;
+		job->released = 1;
+		poolMutexUnlock(&jobMutex);
+		if (done) {
+			freeBatchJob(job);
+		}
+	}
+	return 0;
+}
 
 /*
 ********************************************************************************
@@ -1287,6 +7178,42 @@ LUALIB_API int luaopen_jpeg(lua_State *l) {
 	lua_pushcfunction(l, luajpeg_compress_gc);
 	lua_settable(l, -3);
 
+	luaL_newmetatable(l, "jpeg_batch");
+	lua_pushstring(l, "__gc");
+	lua_pushcfunction(l, luajpeg_batch_gc);
+	lua_settable(l, -3);
+
+	luaL_newmetatable(l, "jpeg_job");
+	lua_pushstring(l, "__gc");
+	lua_pushcfunction(l, luajpeg_job_gc);
+	lua_settable(l, -3);
+
+	// the pool sentinel counts the states, the workers are stopped when the last one is closed
+	if (lua_getfield(l, LUA_REGISTRYINDEX, "jpeg_pool") == LUA_TNIL) {
+		lua_newuserdata(l, 1);
+		luaL_newmetatable(l, "jpeg_pool");
+		lua_pushstring(l, "__gc");
+		lua_pushcfunction(l, luajpeg_pool_gc);
+		lua_settable(l, -3);
+		lua_setmetatable(l, -2);
+		lua_setfield(l, LUA_REGISTRYINDEX, "jpeg_pool");
+		poolAddState();
+	}
+	lua_pop(l, 1);
+
+	// the jobs sentinel counts the running jobs of the state, it waits for them when the state is closed
+	if (lua_getfield(l, LUA_REGISTRYINDEX, "jpeg_jobs") == LUA_TNIL) {
+		int *runningJobs = (int *)lua_newuserdata(l, sizeof(int));
+		*runningJobs = 0;
+		luaL_newmetatable(l, "jpeg_jobs");
+		lua_pushstring(l, "__gc");
+		lua_pushcfunction(l, luajpeg_jobs_gc);
+		lua_settable(l, -3);
+		lua_setmetatable(l, -2);
+		lua_setfield(l, LUA_REGISTRYINDEX, "jpeg_jobs");
+	}
+	lua_pop(l, 1);
+
 	luaL_Reg reg[] = {
 		// Buffer
 		{ "newBuffer", luajpeg_buffer_new },
@@ -1295,6 +7222,7 @@ LUALIB_API int luaopen_jpeg(lua_State *l) {
 		{ "startCompress", luajpeg_compress_start },
 		{ "writeMarker", luajpeg_compress_writeMarker },
 		{ "compress", luajpeg_compress_run },
+		{ "compressRows", luajpeg_compress_rows },
 		// JPEG Decompress
 		{ "newDecompress", luajpeg_decompress_new },
 		{ "startDecompress", luajpeg_decompress_start },
@@ -1303,12 +7231,34 @@ LUALIB_API int luaopen_jpeg(lua_State *l) {
 		{ "configureDecompress", luajpeg_decompress_configure },
 		{ "getInfosDecompress", luajpeg_decompress_get_infos },
 		{ "decompress", luajpeg_decompress_run },
+		{ "consumeInput", luajpeg_decompress_consume_input },
+		{ "startOutput", luajpeg_decompress_start_output },
+		{ "isInputComplete", luajpeg_decompress_is_input_complete },
+		// JPEG Transform
+		{ "transform", luajpeg_transform },
+		// JPEG Thumbnail
+		{ "thumbnail", luajpeg_thumbnail },
 		// Image manipulation
 		{ "componentMatrix", luajpeg_componentMatrix },
 		{ "componentSwap", luajpeg_componentSwap },
 		{ "convolve", luajpeg_convolve },
+		{ "blur", luajpeg_blur },
+		{ "unsharpMask", luajpeg_unsharpMask },
 		{ "rotate", luajpeg_rotate },
 		{ "subsampleBilinear", luajpeg_subsampleBilinear },
+		{ "resize", luajpeg_resize },
+		// Image pipeline
+		{ "pipeline", luajpeg_pipeline },
+		// Batch
+		{ "batch", luajpeg_batch },
+		// Asynchronous jobs
+		{ "submitJob", luajpeg_job_submit },
+		{ "pollJob", luajpeg_job_poll },
+		{ "waitJob", luajpeg_job_wait },
+		{ "getJobFd", luajpeg_job_fd },
+		// Worker pool
+		{ "setThreadCount", luajpeg_set_thread_count },
+		{ "getThreadCount", luajpeg_get_thread_count },
 		{ NULL, NULL }
 	};
 	lua_newtable(l);
@@ -0,0 +1,23 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+-- the items are decoded, resized and encoded in parallel by the worker pool
+-- the threads option sizes the pool first, 0 for the number of processors
+local results = jpegLib.batch({
+    filename,
+    {path = filename, width = 64},
+    {path = filename, scaleNum = 1, scaleDenom = 2, encode = false},
+    {data = 'not a jpeg'}
+}, {quality = 85, threads = 4})
+
+for i, result in ipairs(results) do
+    if result.error then
+        print('item '..tostring(i)..' failed: '..tostring(result.error))
+    else
+        print('item '..tostring(i)..' '..tostring(result.width)..'x'..tostring(result.height)..' in '..tostring(result.length)..' bytes')
+    end
+    if result.warning then
+        print('item '..tostring(i)..' warning: '..tostring(result.warning))
+    end
+end
@@ -0,0 +1,70 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+local scaleNum = tonumber(arg[1]) or 16
+local count = tonumber(arg[2]) or 10
+
+local function readFile(name)
+    local fd = io.open(name, 'rb')
+    local data = fd:read('*a')
+    fd:close()
+    return data
+end
+
+local jpegData = readFile(filename)
+
+local function decompress(rowsPerCall, scale)
+    local cinfo = jpegLib.newDecompress()
+    jpegLib.fillSource(cinfo, jpegData)
+    jpegLib.readHeader(cinfo)
+    jpegLib.configureDecompress(cinfo, {scaleNum = scale or 8, scaleDenom = 8, rowsPerCall = rowsPerCall})
+    jpegLib.startDecompress(cinfo)
+    local info = jpegLib.getInfosDecompress(cinfo)
+    local image = jpegLib.newBuffer(info.output.components * info.output.width * info.output.height)
+    jpegLib.decompress(cinfo, image)
+    return image, info.output
+end
+
+local function compress(image, info, rowsPerCall)
+    local cinfo = jpegLib.newCompress()
+    local size = 0
+    jpegLib.startCompress(cinfo, {
+        width = info.width,
+        height = info.height,
+        components = info.components,
+        colorSpace = info.colorSpace,
+        rowsPerCall = rowsPerCall
+    }, function(data)
+        size = size + #data
+    end, 65536)
+    jpegLib.compress(cinfo, image)
+    return size
+end
+
+local function bench(name, megaPixels, fn)
+    fn()
+    local start = os.clock()
+    for _ = 1, count do
+        fn()
+    end
+    local elapsed = os.clock() - start
+    print(string.format('%-30s %8.2f MP/s', name, megaPixels * count / elapsed))
+end
+
+-- use the DCT scaling to get a larger image
+local image, info = decompress(1, scaleNum)
+local megaPixels = info.width * info.height / 1000000
+print(string.format('image is %dx%dx%d, %d iterations', info.width, info.height, info.components, count))
+
+bench('decompress 1 row per call', megaPixels, function()
+    decompress(1, scaleNum)
+end)
+bench('decompress iMCU row per call', megaPixels, function()
+    decompress(0, scaleNum)
+end)
+bench('compress 1 row per call', megaPixels, function()
+    compress(image, info, 1)
+end)
+bench('compress iMCU row per call', megaPixels, function()
+    compress(image, info, 0)
+end)
@@ -21,14 +21,15 @@ local fd = io.open(filename, 'wb')
 
 local cinfo = jpegLib.newCompress()
 
-jpegLib.startCompress(cinfo, info, function(data)
-    --print('write('..tostring(#data)..')')
-    fd:write(data)
-end)
+-- the file is written natively, a function could be used to receive each chunk
+jpegLib.startCompress(cinfo, info, fd)
 
 --jpegLib.writeMarker(cinfo, 0xe1, buffer)
 
 jpegLib.compress(cinfo, image)
+-- the rows could be provided by strips, with repeated calls or by a function returning the strip from a row
+--jpegLib.compressRows(cinfo, strip, rowCount)
+--jpegLib.compress(cinfo, function(firstRow) return strip, rowCount end)
 
 fd:close()
 
@@ -20,11 +20,8 @@ local filename = 'libjpeg/testimg.jpg'
 print('reading '..filename)
 local fd = io.open(filename, 'rb')
 
-jpegLib.fillSource(cinfo, function()
-    local data = fd:read(2048)
-    --print('read '..tostring(#data))
-    return data
-end)
+-- the file is read natively, a function could be used to provide each chunk
+jpegLib.fillSource(cinfo, fd)
 
 local info, err = jpegLib.readHeader(cinfo)
 
@@ -37,6 +34,8 @@ print('image header infos:')
 printTable(info)
 
 --jpegLib.configureDecompress(cinfo, {scaleNum = 8, scaleDenom = 8})
+-- only a region could be decoded, the image buffer then contains the region
+--jpegLib.configureDecompress(cinfo, {region = {x = 16, y = 16, width = 64, height = 32}})
 
 jpegLib.startDecompress(cinfo)
 
@@ -47,6 +46,8 @@ printTable(info)
 
 local image = jpegLib.newBuffer(info.output.components * info.output.width * info.output.height)
 jpegLib.decompress(cinfo, image)
+-- the image could be decoded by strips passed to a function, here of 64 rows, without a whole image buffer
+--jpegLib.decompress(cinfo, function(strip, firstRow, rowCount) end, 64)
 
 fd:close()
 
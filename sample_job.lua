@@ -0,0 +1,21 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+-- the job runs on a worker of the pool, the calling thread stays available
+-- the pending jobs are bounded by the thread count, submitJob returns nil and 'busy' when the pool is full
+jpegLib.setThreadCount(2)
+local job, err = jpegLib.submitJob({path = filename, width = 64}, {quality = 85})
+if not job then
+    error('Cannot submit job: '..tostring(err))
+end
+
+-- an event loop would watch the descriptor returned by jpegLib.getJobFd(job)
+-- and call jpegLib.pollJob(job) when it becomes readable, pollJob returns false while the job runs
+local result = jpegLib.waitJob(job)
+
+if result.error then
+    error('Cannot run job: '..tostring(result.error))
+end
+
+print('job done '..tostring(result.width)..'x'..tostring(result.height)..' in '..tostring(result.length)..' bytes')
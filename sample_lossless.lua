@@ -0,0 +1,40 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+print('reading '..filename)
+local fd = io.open(filename, 'rb')
+
+local dcinfo = jpegLib.newDecompress()
+jpegLib.fillSource(dcinfo, fd)
+
+local ccinfo = jpegLib.newCompress()
+
+-- the image is rotated without decoding, the markers such as Exif are copied
+-- the Exif orientation is reset for a rotation unless resetOrientation is false
+local outFilename = 'tmp.jpg'
+local _, err = jpegLib.transform(dcinfo, ccinfo, {
+    rotate = 'right',
+    trim = true,
+    copyMarkers = true,
+    resetOrientation = true
+}, outFilename)
+
+fd:close()
+
+if err then
+    error('Cannot transform: '..tostring(err))
+end
+
+print('image transformed in '..outFilename)
+
+-- the image is cropped without decoding, the region origin is moved back to the iMCU grid
+fd = io.open(filename, 'rb')
+jpegLib.fillSource(dcinfo, fd)
+ccinfo = jpegLib.newCompress()
+local data, length = jpegLib.transform(dcinfo, ccinfo, {
+    crop = {x = 20, y = 20, width = 100, height = 80}
+})
+fd:close()
+
+print('image cropped in '..tostring(length)..' bytes')
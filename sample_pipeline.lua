@@ -0,0 +1,28 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+print('reading '..filename)
+local fd = io.open(filename, 'rb')
+
+local dcinfo = jpegLib.newDecompress()
+jpegLib.fillSource(dcinfo, fd)
+jpegLib.readHeader(dcinfo)
+local srcInfo = jpegLib.getInfosDecompress(dcinfo).image
+
+-- the image goes through the operations by strips of rows, it is never fully decoded in memory
+local outFilename = 'tmp_pipeline.jpg'
+local ccinfo = jpegLib.newCompress()
+local _, err = jpegLib.pipeline(dcinfo, ccinfo, {
+    {op = 'unsharpMask', radius = 1.5, amount = 0.8, threshold = 3},
+    {op = 'resize', width = srcInfo.width // 2, height = srcInfo.height // 2, filter = 'lanczos3'},
+    {op = 'rotate', mode = 'flip-horizontal'}
+}, {quality = 85}, outFilename)
+
+fd:close()
+
+if err then
+    error('Cannot run pipeline: '..tostring(err))
+end
+
+print('pipeline output compressed in '..outFilename)
@@ -0,0 +1,33 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testprog.jpg'
+
+print('reading '..filename)
+local fd = io.open(filename, 'rb')
+
+local cinfo = jpegLib.newDecompress()
+
+-- with a function or pushed data, the functions return nil and 'suspended' until more data is available
+jpegLib.fillSource(cinfo, fd)
+
+jpegLib.readHeader(cinfo)
+
+jpegLib.configureDecompress(cinfo, {bufferedImage = true})
+
+jpegLib.startDecompress(cinfo)
+
+local info = jpegLib.getInfosDecompress(cinfo)
+local image = jpegLib.newBuffer(info.output.components * info.output.width * info.output.height)
+
+local final
+repeat
+    -- absorb the input up to the end of the next scan then display it
+    local status, inputScanNumber = jpegLib.consumeInput(cinfo)
+    local outputScanNumber = jpegLib.startOutput(cinfo)
+    final = jpegLib.decompress(cinfo, image)
+    print('input '..status..' '..tostring(inputScanNumber)..', output pass for scan '..tostring(outputScanNumber)..(final and ' (final)' or ''))
+until final
+
+fd:close()
+
+print('image decompressed')
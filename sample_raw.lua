@@ -0,0 +1,46 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+print('reading '..filename)
+local fd = io.open(filename, 'rb')
+
+local dcinfo = jpegLib.newDecompress()
+jpegLib.fillSource(dcinfo, fd)
+jpegLib.readHeader(dcinfo)
+
+-- the components are decoded as separate planes, without upsampling nor color conversion
+jpegLib.configureDecompress(dcinfo, {rawData = true})
+jpegLib.startDecompress(dcinfo)
+
+local info = jpegLib.getInfosDecompress(dcinfo)
+
+local planes = {}
+for i, plane in ipairs(info.output.planes) do
+    print('plane '..tostring(i)..': '..tostring(plane.width)..'x'..tostring(plane.height)..' bytesPerRow: '..tostring(plane.bytesPerRow))
+    planes[i] = jpegLib.newBuffer(plane.bytesPerRow * plane.height)
+end
+
+local strides = {}
+for i, plane in ipairs(info.output.planes) do
+    strides[i] = plane.bytesPerRow
+end
+
+jpegLib.decompress(dcinfo, planes)
+
+fd:close()
+
+-- the planes are encoded back, the subsampling shall match the plane sizes
+local ccinfo = jpegLib.newCompress()
+jpegLib.startCompress(ccinfo, {
+    width = info.output.width,
+    height = info.output.height,
+    components = #planes,
+    rawData = true,
+    subsampling = '4:2:0',
+    quality = 90
+})
+
+local data, length = jpegLib.compress(ccinfo, planes, strides)
+
+print('planes compressed in '..tostring(length)..' bytes')
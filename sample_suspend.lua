@@ -0,0 +1,56 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+local fd = io.open(filename, 'rb')
+local data = fd:read('*a')
+fd:close()
+
+-- decodes the image then encodes it again, the encoded data is returned to compare the images
+local function decode(source)
+    local cinfo = jpegLib.newDecompress()
+    jpegLib.fillSource(cinfo, source)
+    local suspensions = 0
+    local function run(fn, ...)
+        while true do
+            local status, err = fn(cinfo, ...)
+            if err ~= 'suspended' then
+                return status, err
+            end
+            suspensions = suspensions + 1
+        end
+    end
+    run(jpegLib.readHeader)
+    run(jpegLib.startDecompress)
+    local info = jpegLib.getInfosDecompress(cinfo)
+    local image = jpegLib.newBuffer(info.output.components * info.output.width * info.output.height)
+    run(jpegLib.decompress, image)
+    local chunks = {}
+    local ccinfo = jpegLib.newCompress()
+    jpegLib.startCompress(ccinfo, info.output, function(chunk)
+        table.insert(chunks, chunk)
+    end)
+    jpegLib.compress(ccinfo, image)
+    return table.concat(chunks), suspensions
+end
+
+local expected = decode(data)
+
+-- the function alternates chunks and false, libjpeg backs up in the kept bytes when suspending within a marker or MCU
+for _, chunkSize in ipairs({1, 7, 100, 4096}) do
+    local position = 1
+    local suspend = false
+    local result, suspensions = decode(function()
+        suspend = not suspend
+        if not suspend then
+            return false
+        end
+        local chunk = string.sub(data, position, position + chunkSize - 1)
+        position = position + chunkSize
+        return chunk
+    end)
+    if result ~= expected then
+        error('image differs for chunks of '..tostring(chunkSize)..' bytes')
+    end
+    print('chunks of '..tostring(chunkSize)..' bytes decoded with '..tostring(suspensions)..' suspensions')
+end
@@ -0,0 +1,27 @@
+local jpegLib = require('jpeg')
+
+local filename = 'libjpeg/testimg.jpg'
+
+print('reading '..filename)
+local fd = io.open(filename, 'rb')
+
+local dcinfo = jpegLib.newDecompress()
+jpegLib.fillSource(dcinfo, fd)
+
+-- the scaling is selected to let the IDCT do most of the work, then the image is area averaged
+local image, info = jpegLib.thumbnail(dcinfo, 64, 64)
+
+fd:close()
+
+if not image then
+    error('Cannot create thumbnail: '..tostring(info))
+end
+
+print('thumbnail '..tostring(info.width)..'x'..tostring(info.height)..' decoded at '..tostring(info.scaleNum)..'/'..tostring(info.scaleDenom))
+
+local outFilename = 'tmp_thumbnail.jpg'
+local ccinfo = jpegLib.newCompress()
+jpegLib.startCompress(ccinfo, info, outFilename)
+jpegLib.compress(ccinfo, image)
+
+print('thumbnail compressed in '..outFilename)
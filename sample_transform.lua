@@ -77,6 +77,21 @@ local function subsampleBilinear(imageUserdata, imageInfoTable, dividor)
     return image, info
 end
 
+local function resize(imageUserdata, imageInfoTable, factor, filter)
+    local info = {
+        width = math.floor(imageInfoTable.width * factor + 0.5),
+        height = math.floor(imageInfoTable.height * factor + 0.5),
+        components = imageInfoTable.components
+    }
+    local image = jpegLib.newBuffer(info.components * info.width * info.height)
+    local _, err = jpegLib.resize(imageUserdata, imageInfoTable, image, info, {filter = filter or 'lanczos3'})
+    if err then
+        print('resize failed due to '..tostring(err))
+        return imageUserdata, imageInfoTable
+    end
+    return image, info
+end
+
 local cinfo = jpegLib.newDecompress()
 
 local modifications = {
@@ -96,6 +111,11 @@ for k in pairs(modifications) do
 end
 print('modifications:'..modificationList)
 
+if modifications['threads'] then
+    -- use all the processors for the image manipulations
+    print('using '..tostring(jpegLib.setThreadCount(0))..' threads')
+end
+
 local filename = 'libjpeg/testimg.jpg'
 
 print('reading '..filename)
@@ -146,14 +166,29 @@ if modifications['rotate'] then
     image, info.output = rotate(image, info.output)
 end
 if modifications['flip'] then
-    image, info.output = rotate(image, info.output, 'flip-horizontal')
+    -- the flips and the 180 degrees rotation do not need a destination image
+    jpegLib.rotate(image, info.output, nil, nil, 'flip-horizontal')
 end
 if modifications['subsample'] then
     image, info.output = subsampleBilinear(image, info.output, 2)
 end
+if modifications['downscale'] then
+    image, info.output = resize(image, info.output, 0.3)
+end
+if modifications['upscale'] then
+    image, info.output = resize(image, info.output, 1.5, 'bicubic')
+end
 if modifications['sharpen'] then
     sharpen(image, info.output, 0.5)
 end
+if modifications['unsharp'] then
+    -- sharpens the details larger than one pixel and ignores the small differences
+    jpegLib.unsharpMask(image, info.output, 1.5, 0.8, 3)
+end
+if modifications['blur'] then
+    -- approximates a Gaussian blur with a standard deviation of 4 pixels
+    jpegLib.blur(image, info.output, 4, {filter = 'gaussian'})
+end
 
 local filename = 'tmp_transform.jpg'
 fd = io.open(filename, 'wb')